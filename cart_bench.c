@@ -0,0 +1,362 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_bench.c
+//  Description    : This is a micro-benchmark for the CART driver.  It drives
+//                   the open/read/write/seek interface directly with
+//                   sequential or random offsets, a range of operation
+//                   sizes, read/write mixes and file counts, and reports the
+//                   throughput and bus operations per call of each run.
+//
+//   Author        : John Flanigan
+//   Last Modified : Oct 16 2026
+//
+
+// Include Files
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+
+// Project Includes
+#include <cart_driver.h>
+#include <cart_controller.h>
+#include <cart_cache.h>
+#include <cmpsc311_log.h>
+
+// Defines
+#define CART_BENCH_MAX_FILES 64
+#define CART_BENCH_MAX_OP_SIZE (64*CART_FRAME_SIZE)
+#define CART_BENCH_FILL_SIZE (64*CART_FRAME_SIZE) // Write size used to fill the files
+#define CART_ARGUMENTS "hwp:s:r:f:n:k:c:x:"
+#define USAGE \
+	"USAGE: cart_bench [-h] [-w] [-p <seq|rand>] [-s <bytes>] [-r <pct>] [-f <files>]\n" \
+	"                  [-n <ops>] [-k <kb>] [-c <sz>] [-x <seed>]\n" \
+	"\n" \
+	"where:\n" \
+	"    -h - help mode (display this message)\n" \
+	"    -w - write-back frame caching (flushed on close and shut down)\n" \
+	"    -p - offset pattern, sequential or random\n" \
+	"    -s - bytes per read or write\n" \
+	"    -r - percentage of operations that are reads\n" \
+	"    -f - number of files the operations are spread over\n" \
+	"    -n - operations per run (default 2000)\n" \
+	"    -k - size of each file in kilobytes (default 512)\n" \
+	"    -c - set the cart frame cache to size <sz> frames (0 disables)\n" \
+	"    -x - random seed (default 1)\n" \
+	"\n" \
+	"Each of -p, -s, -r and -f fixes that parameter, otherwise a standard\n" \
+	"set of values is swept and every combination is run.\n" \
+	"\n" \
+
+// Offset patterns
+#define CART_BENCH_SEQUENTIAL 0
+#define CART_BENCH_RANDOM 1
+
+// This is one benchmark run
+typedef struct {
+	int       pattern;   // CART_BENCH_SEQUENTIAL or CART_BENCH_RANDOM
+	int       size;      // Bytes per read or write
+	int       readpct;   // Percentage of operations that are reads
+	int       files;     // Number of files
+} CartBenchRun;
+
+//
+// Global Data
+int bench_ops = 2000;          // Operations per run
+int bench_file_size = 512*1024;// Bytes in each file
+unsigned int bench_seed = 1;   // Seed of the operation stream
+int bench_runs;                // Runs made so far, names the files
+
+// The standard sweep
+int sweep_patterns[] = { CART_BENCH_SEQUENTIAL, CART_BENCH_RANDOM };
+int sweep_sizes[] = { 1, 64, 512, CART_FRAME_SIZE, 4*CART_FRAME_SIZE, 16*CART_FRAME_SIZE };
+int sweep_readpcts[] = { 0, 50, 100 };
+int sweep_files[] = { 1, 16 };
+
+//
+// Functional Prototypes
+
+int run_benchmark( CartBenchRun *run );      // Perform and report one run
+uint64_t bus_operations( void );             // Bus operations issued so far
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the CART benchmark
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful, -1 if failure
+
+int main( int argc, char *argv[] ) {
+
+	// Local variables
+	int ch, write_back = 0, err = 0;
+	int npatterns, nsizes, nreadpcts, nfiles, p, s, r, f;
+	int *patterns = sweep_patterns, *sizes = sweep_sizes, *readpcts = sweep_readpcts, *files = sweep_files;
+	int pattern, size, readpct, file_count;
+	uint32_t cache_size = DEFAULT_CART_FRAME_CACHE_SIZE;
+	CartBenchRun run;
+
+	npatterns = sizeof(sweep_patterns)/sizeof(int);
+	nsizes = sizeof(sweep_sizes)/sizeof(int);
+	nreadpcts = sizeof(sweep_readpcts)/sizeof(int);
+	nfiles = sizeof(sweep_files)/sizeof(int);
+
+	// Process the command line parameters
+	while ((ch = getopt(argc, argv, CART_ARGUMENTS)) != -1) {
+
+		switch (ch) {
+		case 'h': // Help, print usage
+			fprintf( stderr, USAGE );
+			return( -1 );
+
+		case 'w': // Write-back Flag
+			write_back = 1;
+			break;
+
+		case 'p': // Fix the offset pattern
+			if ( strcmp(optarg, "seq") == 0 ) {
+				pattern = CART_BENCH_SEQUENTIAL;
+			} else if ( strcmp(optarg, "rand") == 0 ) {
+				pattern = CART_BENCH_RANDOM;
+			} else {
+				fprintf( stderr, "Bad pattern [%s], use seq or rand.\n", optarg );
+				return( -1 );
+			}
+			patterns = &pattern;
+			npatterns = 1;
+			break;
+
+		case 's': // Fix the operation size
+			if ( (sscanf(optarg, "%d", &size) != 1) || (size < 1) || (size > CART_BENCH_MAX_OP_SIZE) ) {
+				fprintf( stderr, "Bad operation size [%s], must be 1 to %d.\n", optarg, CART_BENCH_MAX_OP_SIZE );
+				return( -1 );
+			}
+			sizes = &size;
+			nsizes = 1;
+			break;
+
+		case 'r': // Fix the read percentage
+			if ( (sscanf(optarg, "%d", &readpct) != 1) || (readpct < 0) || (readpct > 100) ) {
+				fprintf( stderr, "Bad read percentage [%s].\n", optarg );
+				return( -1 );
+			}
+			readpcts = &readpct;
+			nreadpcts = 1;
+			break;
+
+		case 'f': // Fix the file count
+			if ( (sscanf(optarg, "%d", &file_count) != 1) || (file_count < 1) || (file_count > CART_BENCH_MAX_FILES) ) {
+				fprintf( stderr, "Bad file count [%s], must be 1 to %d.\n", optarg, CART_BENCH_MAX_FILES );
+				return( -1 );
+			}
+			files = &file_count;
+			nfiles = 1;
+			break;
+
+		case 'n': // Operations per run
+			if ( (sscanf(optarg, "%d", &bench_ops) != 1) || (bench_ops < 1) ) {
+				fprintf( stderr, "Bad operation count [%s].\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'k': // File size
+			if ( (sscanf(optarg, "%d", &bench_file_size) != 1) || (bench_file_size < 1) ) {
+				fprintf( stderr, "Bad file size [%s].\n", optarg );
+				return( -1 );
+			}
+			bench_file_size *= 1024;
+			break;
+
+		case 'c': // Set cache line size
+			if ( sscanf( optarg, "%u", &cache_size ) != 1 ) {
+				fprintf( stderr, "Bad cache size [%s].\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'x': // Random seed
+			if ( sscanf( optarg, "%u", &bench_seed ) != 1 ) {
+				fprintf( stderr, "Bad seed [%s].\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		default:  // Default (unknown)
+			fprintf( stderr, "Unknown command line option (%c), aborting.\n", ch );
+			return( -1 );
+		}
+	}
+
+	// Every file of the largest run has to fit on the cartridges at once
+	for (f=0; f<nfiles; f++) {
+		if ( (uint64_t)files[f]*bench_file_size > (uint64_t)(CART_MAX_CARTRIDGES-1)*CART_CARTRIDGE_SIZE*CART_FRAME_SIZE ) {
+			fprintf( stderr, "%d files of %d bytes do not fit on the cartridges.\n", files[f], bench_file_size );
+			return( -1 );
+		}
+	}
+
+	// Start the driver once, each run makes and deletes its own files
+	set_cart_cache_size( cache_size );
+	cart_set_write_back( write_back );
+	if ( cart_poweron() == -1 ) {
+		fprintf( stderr, "CART benchmark failed initialization.\n" );
+		return( -1 );
+	}
+
+	printf( "%-4s %8s %5s %5s %8s %12s %12s %10s\n", "pat", "size", "read", "files",
+		"ops", "ops/sec", "bytes/sec", "bus/call" );
+	for (p=0; (p<npatterns) && (err==0); p++) {
+		for (s=0; (s<nsizes) && (err==0); s++) {
+			for (r=0; (r<nreadpcts) && (err==0); r++) {
+				for (f=0; (f<nfiles) && (err==0); f++) {
+					run.pattern = patterns[p];
+					run.size = sizes[s];
+					run.readpct = readpcts[r];
+					run.files = files[f];
+					err = run_benchmark( &run );
+				}
+			}
+		}
+	}
+
+	// Shut down the driver
+	if ( cart_poweroff() == -1 ) {
+		fprintf( stderr, "CART benchmark failed shutdown.\n" );
+		return( -1 );
+	}
+	return( err );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bus_operations
+// Description  : Counts the operations the driver has sent over the bus
+//
+// Inputs       : none
+// Outputs      : loads, reads, writes and zeroes since power on
+
+uint64_t bus_operations( void ) {
+
+	// Local variables
+	CartDriverStatistics stats;
+
+	cart_get_statistics( &stats );
+	return( stats.loads + stats.reads + stats.writes + stats.zeroes );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : run_benchmark
+// Description  : Creates and fills the run's files, times the operations
+//                (including the close that writes back cached frames),
+//                prints the results and deletes the files
+//
+// Inputs       : run - the parameters of the run
+// Outputs      : 0 if successful, -1 if failure
+
+int run_benchmark( CartBenchRun *run ) {
+
+	// Local variables
+	char name[CART_MAX_PATH_LENGTH], *buf;
+	int16_t fh[CART_BENCH_MAX_FILES];
+	int32_t position[CART_BENCH_MAX_FILES];
+	unsigned int seed = bench_seed;
+	int i, f, off, len, calls = 0, err = 0;
+	uint64_t bytes = 0, busops;
+	struct timespec start, stop;
+	double seconds;
+
+	if ( (buf = malloc(CART_BENCH_MAX_OP_SIZE)) == NULL ) {
+		fprintf( stderr, "CART benchmark failed buffer allocation.\n" );
+		return( -1 );
+	}
+	memset( buf, 'b', CART_BENCH_MAX_OP_SIZE );
+	if ( run->size > bench_file_size ) {
+		run->size = bench_file_size;
+	}
+
+	// Create and fill the files, not timed
+	bench_runs ++;
+	for (f=0; f<run->files; f++) {
+		snprintf( name, CART_MAX_PATH_LENGTH, "bench-%d-%d", bench_runs, f );
+		if ( (fh[f] = cart_open(name)) == -1 ) {
+			fprintf( stderr, "CART benchmark failed to open [%s].\n", name );
+			free( buf );
+			return( -1 );
+		}
+		for (off=0; off<bench_file_size; off+=len) {
+			len = (bench_file_size-off < CART_BENCH_FILL_SIZE) ? bench_file_size-off : CART_BENCH_FILL_SIZE;
+			if ( cart_write(fh[f], buf, len) != len ) {
+				fprintf( stderr, "CART benchmark failed to fill [%s].\n", name );
+				free( buf );
+				return( -1 );
+			}
+		}
+		if ( cart_flush(fh[f]) == -1 ) {
+			fprintf( stderr, "CART benchmark failed to flush [%s].\n", name );
+			free( buf );
+			return( -1 );
+		}
+		position[f] = 0;
+	}
+
+	// Run the operations, files taken in turn
+	busops = bus_operations();
+	clock_gettime( CLOCK_MONOTONIC, &start );
+	for (i=0; (i<bench_ops) && (err==0); i++) {
+		f = i % run->files;
+		if ( run->pattern == CART_BENCH_SEQUENTIAL ) {
+			if ( position[f] + run->size > bench_file_size ) {
+				position[f] = 0;
+			}
+			off = position[f];
+			position[f] += run->size;
+		} else {
+			off = rand_r(&seed) % (bench_file_size - run->size + 1);
+		}
+		if ( cart_seek(fh[f], off) != 0 ) {
+			err = -1;
+		} else if ( (int)(rand_r(&seed) % 100) < run->readpct ) {
+			err = (cart_read(fh[f], buf, run->size) == run->size) ? 0 : -1;
+		} else {
+			err = (cart_write(fh[f], buf, run->size) == run->size) ? 0 : -1;
+		}
+		bytes += run->size;
+		calls += 2;
+	}
+	for (f=0; f<run->files; f++) {
+		if ( cart_close(fh[f]) != 0 ) {
+			err = -1;
+		}
+		calls ++;
+	}
+	clock_gettime( CLOCK_MONOTONIC, &stop );
+	busops = bus_operations() - busops;
+	if ( err ) {
+		fprintf( stderr, "CART benchmark operation failed, aborting.\n" );
+		free( buf );
+		return( -1 );
+	}
+
+	// Report the run
+	seconds = (stop.tv_sec-start.tv_sec) + (stop.tv_nsec-start.tv_nsec)/1e9;
+	printf( "%-4s %8d %4d%% %5d %8d %12.0f %12.0f %10.3f\n",
+		(run->pattern == CART_BENCH_SEQUENTIAL) ? "seq" : "rand", run->size, run->readpct,
+		run->files, bench_ops, bench_ops/seconds, bytes/seconds, (double)busops/calls );
+
+	// Remove the files so the next run starts with free cartridges
+	for (f=0; f<run->files; f++) {
+		snprintf( name, CART_MAX_PATH_LENGTH, "bench-%d-%d", bench_runs, f );
+		cart_delete( name );
+	}
+	free( buf );
+	return( 0 );
+}
@@ -0,0 +1,403 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_cache.c
+//  Description    : This is the implementation of the frame cache for the
+//                   CART memory system driver.  Frames are keyed by
+//                   (cartridge, frame) and evicted least recently used first.
+//
+//  Author         : John Flanigan
+//  Last Modified  : Oct 16 2026
+//
+
+// Includes
+#include <stdlib.h>
+#include <string.h>
+
+// Project Includes
+#include <cart_cache.h>
+#include <cmpsc311_log.h>
+
+// Cache line
+typedef struct {
+	int valid;				// Non-zero if the line holds a frame
+	int dirty;				// Non-zero if the controller copy is stale
+	CartridgeIndex cartIndex;		// Cartridge of the cached frame
+	CartFrameIndex frameIndex;		// Frame index of the cached frame
+	int prev;				// Next more recently used line (-1 if head)
+	int next;				// Next less recently used line (-1 if tail)
+	char data[CART_FRAME_SIZE];		// Contents of the frame
+} CartCacheLine;
+
+// Cache state
+static uint32_t cacheSize = DEFAULT_CART_FRAME_CACHE_SIZE;
+static CartCacheLine *cacheLines = NULL;
+static int *cacheIndex = NULL;	// Line holding each (cart, frame), -1 if uncached
+static int lruHead;		// Most recently used line
+static int lruTail;		// Least recently used line
+static int freeLine;		// Next line never used, cacheSize once full
+static CartCacheWriteback writebackFrame = NULL;
+
+// Position of a (cart, frame) pair in the index
+#define CACHE_KEY(cart, frm) (((int)(cart) * CART_CARTRIDGE_SIZE) + (int)(frm))
+
+// Implementation
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unlinkLine
+// Description  : Removes a line from the LRU list
+//
+// Inputs       : line - the line to remove
+// Outputs      : none
+
+static void unlinkLine(int line) {
+	if (cacheLines[line].prev != -1) {
+		cacheLines[cacheLines[line].prev].next = cacheLines[line].next;
+	} else {
+		lruHead = cacheLines[line].next;
+	}
+	if (cacheLines[line].next != -1) {
+		cacheLines[cacheLines[line].next].prev = cacheLines[line].prev;
+	} else {
+		lruTail = cacheLines[line].prev;
+	}
+	cacheLines[line].prev = -1;
+	cacheLines[line].next = -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pushLine
+// Description  : Places a line at the most recently used end of the LRU list
+//
+// Inputs       : line - the line to place
+// Outputs      : none
+
+static void pushLine(int line) {
+	cacheLines[line].prev = -1;
+	cacheLines[line].next = lruHead;
+	if (lruHead != -1) {
+		cacheLines[lruHead].prev = line;
+	} else {
+		lruTail = line;
+	}
+	lruHead = line;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : set_cart_cache_size
+// Description  : Set the size of the cache (must be called before init)
+//
+// Inputs       : max_frames - the maximum number of frames in the cache,
+//                             zero disables the cache
+// Outputs      : 0 if successful, -1 if failure
+
+int set_cart_cache_size(uint32_t max_frames) {
+	if (cacheLines != NULL) {
+		logMessage(LOG_ERROR_LEVEL, "CART cache failed: cannot resize an initialized cache.");
+		return (-1);
+	}
+	cacheSize = max_frames;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : get_cart_cache_size
+// Description  : Get the number of frames the cache holds
+//
+// Inputs       : none
+// Outputs      : the maximum number of frames, zero if the cache is disabled
+
+uint32_t get_cart_cache_size(void) {
+	return (cacheSize);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : set_cart_cache_writeback
+// Description  : Set the function used to write dirty frames back to the
+//                controller
+//
+// Inputs       : writeback - the function storing a frame on the controller
+// Outputs      : 0 if successful, -1 if failure
+
+int set_cart_cache_writeback(CartCacheWriteback writeback) {
+	writebackFrame = writeback;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : init_cart_cache
+// Description  : Initialize the cache
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int init_cart_cache(void) {
+	if (cacheLines != NULL) {
+		close_cart_cache();
+	}
+	lruHead = -1;
+	lruTail = -1;
+	freeLine = 0;
+	if (cacheSize == 0) {
+		return (0);
+	}
+
+	cacheLines = malloc(sizeof(CartCacheLine) * cacheSize);
+	cacheIndex = malloc(sizeof(int) * CART_MAX_CARTRIDGES * CART_CARTRIDGE_SIZE);
+	if (cacheLines == NULL || cacheIndex == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "CART cache failed: unable to allocate %u frames.", cacheSize);
+		free(cacheLines);
+		free(cacheIndex);
+		cacheLines = NULL;
+		cacheIndex = NULL;
+		return (-1);
+	}
+	memset(cacheIndex, 0xff, sizeof(int) * CART_MAX_CARTRIDGES * CART_CARTRIDGE_SIZE);
+	for (uint32_t i = 0; i < cacheSize; i++) {
+		cacheLines[i].valid = 0;
+		cacheLines[i].dirty = 0;
+		cacheLines[i].prev = -1;
+		cacheLines[i].next = -1;
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : close_cart_cache
+// Description  : Clear all of the contents of the cache, cleanup.  Dirty
+//                frames must be flushed first.
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int close_cart_cache(void) {
+	free(cacheLines);
+	free(cacheIndex);
+	cacheLines = NULL;
+	cacheIndex = NULL;
+	lruHead = -1;
+	lruTail = -1;
+	freeLine = 0;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : writebackLine
+// Description  : Writes a line back to the controller if it is dirty
+//
+// Inputs       : line - the line to write back
+// Outputs      : 0 if successful, -1 if failure
+
+static int writebackLine(int line) {
+	if (!cacheLines[line].valid || !cacheLines[line].dirty) {
+		return (0);
+	}
+	if (writebackFrame == NULL || writebackFrame(cacheLines[line].cartIndex,
+			cacheLines[line].frameIndex, cacheLines[line].data) == -1) {
+		logMessage(LOG_ERROR_LEVEL, "CART cache failed: write back of frame %d/%d failed.",
+			cacheLines[line].cartIndex, cacheLines[line].frameIndex);
+		return (-1);
+	}
+	cacheLines[line].dirty = 0;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : storeLine
+// Description  : Places a frame in the cache, evicting (and writing back)
+//                the least recently used frame as necessary
+//
+// Inputs       : cart - the cartridge of the frame
+//                frm - the frame index within the cartridge
+//                frame - the contents of the frame (CART_FRAME_SIZE bytes)
+//                dirty - non-zero if the frame differs from the controller
+// Outputs      : 0 if successful, -1 if failure
+
+static int storeLine(CartridgeIndex cart, CartFrameIndex frm, void *frame, int dirty) {
+	int line;
+
+	if (cart >= CART_MAX_CARTRIDGES || frm >= CART_CARTRIDGE_SIZE) {
+		logMessage(LOG_ERROR_LEVEL, "CART cache failed: bad frame %d/%d.", cart, frm);
+		return (-1);
+	}
+
+	line = cacheIndex[CACHE_KEY(cart, frm)];
+	if (line != -1) {
+		// Already cached, refresh contents and recency
+		unlinkLine(line);
+	} else if (freeLine < cacheSize) {
+		// Use a line that has never held a frame
+		line = freeLine++;
+	} else {
+		// Evict the least recently used frame, saving it first if modified
+		line = lruTail;
+		if (writebackLine(line) == -1) {
+			return (-1);
+		}
+		unlinkLine(line);
+		if (cacheLines[line].valid) {
+			cacheIndex[CACHE_KEY(cacheLines[line].cartIndex, cacheLines[line].frameIndex)] = -1;
+		}
+	}
+
+	cacheLines[line].valid = 1;
+	cacheLines[line].dirty = dirty;
+	cacheLines[line].cartIndex = cart;
+	cacheLines[line].frameIndex = frm;
+	memcpy(cacheLines[line].data, frame, CART_FRAME_SIZE);
+	cacheIndex[CACHE_KEY(cart, frm)] = line;
+	pushLine(line);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : put_cart_cache
+// Description  : Put an object into the object cache, evicting other items
+//                as necessary
+//
+// Inputs       : cart - the cartridge of the frame
+//                frm - the frame index within the cartridge
+//                frame - the contents of the frame (CART_FRAME_SIZE bytes),
+//                        matching what the controller holds
+// Outputs      : 0 if successful, -1 if failure
+
+int put_cart_cache(CartridgeIndex cart, CartFrameIndex frm, void *frame) {
+	if (cacheLines == NULL) {
+		return (0);
+	}
+	return (storeLine(cart, frm, frame, 0));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dirty_cart_cache
+// Description  : Put a modified frame into the cache.  It is written back
+//                when evicted or flushed, or immediately if the cache is
+//                disabled.
+//
+// Inputs       : cart - the cartridge of the frame
+//                frm - the frame index within the cartridge
+//                frame - the new contents of the frame (CART_FRAME_SIZE bytes)
+// Outputs      : 0 if successful, -1 if failure
+
+int dirty_cart_cache(CartridgeIndex cart, CartFrameIndex frm, void *frame) {
+	if (cacheLines == NULL) {
+		if (writebackFrame == NULL) {
+			return (-1);
+		}
+		return (writebackFrame(cart, frm, frame));
+	}
+	return (storeLine(cart, frm, frame, 1));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : get_cart_cache
+// Description  : Get an object from the cache (and return it)
+//
+// Inputs       : cart - the cartridge of the frame
+//                frm - the frame index within the cartridge
+// Outputs      : pointer to the cached frame or NULL if not found
+
+void * get_cart_cache(CartridgeIndex cart, CartFrameIndex frm) {
+	int line;
+
+	if (cacheLines == NULL || cart >= CART_MAX_CARTRIDGES || frm >= CART_CARTRIDGE_SIZE) {
+		return (NULL);
+	}
+	line = cacheIndex[CACHE_KEY(cart, frm)];
+	if (line == -1) {
+		return (NULL);
+	}
+	unlinkLine(line);
+	pushLine(line);
+	return (cacheLines[line].data);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : flush_cart_cache
+// Description  : Write a frame back to the controller if it is dirty
+//
+// Inputs       : cart - the cartridge of the frame
+//                frm - the frame index within the cartridge
+// Outputs      : 0 if successful, -1 if failure
+
+int flush_cart_cache(CartridgeIndex cart, CartFrameIndex frm) {
+	if (cacheLines == NULL || cart >= CART_MAX_CARTRIDGES || frm >= CART_CARTRIDGE_SIZE) {
+		return (0);
+	}
+	if (cacheIndex[CACHE_KEY(cart, frm)] == -1) {
+		return (0);
+	}
+	return (writebackLine(cacheIndex[CACHE_KEY(cart, frm)]));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : flush_all_cart_cache
+// Description  : Write every dirty frame back to the controller, in
+//                cartridge then frame order so each cartridge is loaded once
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int flush_all_cart_cache(void) {
+	int slot, line;
+
+	if (cacheLines == NULL) {
+		return (0);
+	}
+	for (slot = 0; slot < CART_MAX_CARTRIDGES * CART_CARTRIDGE_SIZE; slot++) {
+		line = cacheIndex[slot];
+		if (line != -1 && writebackLine(line) == -1) {
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : delete_cart_cache
+// Description  : Remove a frame from the cache, discarding any unwritten
+//                changes
+//
+// Inputs       : cart - the cartridge of the frame
+//                frm - the frame index within the cartridge
+// Outputs      : 0 if successful, -1 if the frame was not cached
+
+int delete_cart_cache(CartridgeIndex cart, CartFrameIndex frm) {
+	int line;
+
+	if (cacheLines == NULL || cart >= CART_MAX_CARTRIDGES || frm >= CART_CARTRIDGE_SIZE) {
+		return (-1);
+	}
+	line = cacheIndex[CACHE_KEY(cart, frm)];
+	if (line == -1) {
+		return (-1);
+	}
+	unlinkLine(line);
+	cacheIndex[CACHE_KEY(cart, frm)] = -1;
+	cacheLines[line].valid = 0;
+	cacheLines[line].dirty = 0;
+
+	// Move the emptied line to the LRU end so it is reused first
+	if (lruTail != -1) {
+		cacheLines[lruTail].next = line;
+		cacheLines[line].prev = lruTail;
+	} else {
+		lruHead = line;
+	}
+	lruTail = line;
+	return (0);
+}
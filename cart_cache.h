@@ -0,0 +1,63 @@
+#ifndef CART_CACHE_INCLUDED
+#define CART_CACHE_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_cache.h
+//  Description    : This is the interface for the frame cache for the CART
+//                   memory system driver.
+//
+//  Author         : John Flanigan
+//  Last Modified  : Oct 16 2026
+//
+
+// Includes
+#include <stdint.h>
+
+// Project Includes
+#include <cart_controller.h>
+
+// Defines
+#define DEFAULT_CART_FRAME_CACHE_SIZE 1024  // Default size for cache
+
+// Type definitions
+typedef int (*CartCacheWriteback)(CartridgeIndex cart, CartFrameIndex frm, char *frame);
+	// Called to store a dirty frame on the controller before it leaves the cache
+
+///
+// Cache Interfaces
+
+int set_cart_cache_size(uint32_t max_frames);
+	// Set the size of the cache (must be called before init)
+
+uint32_t get_cart_cache_size(void);
+	// Get the number of frames the cache holds, zero if disabled
+
+int set_cart_cache_writeback(CartCacheWriteback writeback);
+	// Set the function used to write dirty frames back to the controller
+
+int init_cart_cache(void);
+	// Initialize the cache
+
+int close_cart_cache(void);
+	// Clear all of the contents of the cache, cleanup
+
+int put_cart_cache(CartridgeIndex cart, CartFrameIndex frm, void *frame);
+	// Put an object into the object cache, evicting other items as necessary
+
+int dirty_cart_cache(CartridgeIndex cart, CartFrameIndex frm, void *frame);
+	// Put a modified frame into the cache, written back when evicted or flushed
+
+void * get_cart_cache(CartridgeIndex cart, CartFrameIndex frm);
+	// Get an object from the cache (and return it), NULL if not found
+
+int flush_cart_cache(CartridgeIndex cart, CartFrameIndex frm);
+	// Write a frame back to the controller if it is dirty
+
+int flush_all_cart_cache(void);
+	// Write every dirty frame back to the controller
+
+int delete_cart_cache(CartridgeIndex cart, CartFrameIndex frm);
+	// Remove a frame from the cache
+
+#endif
@@ -0,0 +1,402 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_compress.c
+//  Description    : This is the implementation of the frame compressor for
+//                   the CART memory system driver.  A frame is compressed on
+//                   its own: repeated strings are replaced by copies of
+//                   earlier bytes (LZ77), and the literal bytes and copy
+//                   markers are then coded with a Huffman code built for the
+//                   frame.  The compressed frame is a stream of bits, each
+//                   byte filled from its lowest bit:
+//
+//                   header  - one bit per symbol (the 256 byte values, then
+//                             the copy marker) set if the symbol is used,
+//                             then the 4 bit code length of each used symbol
+//                   symbols - until the frame is full, each a literal byte
+//                             or a copy marker followed by a 10 bit offset
+//                             back to copy from and a 4 bit length less
+//                             CART_MIN_MATCH, 15 meaning 10 more length bits
+//                             follow
+//
+//  Author         : John Flanigan
+//  Last Modified  : Oct 16 2026
+//
+
+// Includes
+#include <stdint.h>
+#include <string.h>
+
+// Project Includes
+#include <cart_compress.h>
+
+// Defines
+#define CART_SYMBOLS 257			// Byte values and the copy marker
+#define CART_COPY_SYMBOL 256			// Symbol starting a copy
+#define CART_MAX_CODE_LENGTH 15			// Longest code, the 4 bit length field
+#define CART_MIN_MATCH 5			// Shortest copy worth coding
+#define CART_OFFSET_BITS 10			// Bits in a copy offset, enough for any frame position
+#define CART_LENGTH_BITS 4			// Bits in a short copy length
+#define CART_LONG_LENGTH_BITS 10		// Bits extending a long copy length
+#define CART_HASH_BITS 10			// Match finder table of 2^bits positions
+#define CART_NO_POSITION 0xffff			// Empty match finder slot
+
+// A copy found by the match finder, or a literal when length is zero
+typedef struct {
+	uint16_t offset;			// Distance back to copy from
+	uint16_t length;			// Bytes to copy, zero for a literal
+} CartMatch;
+
+// Bits being written to or read from a compressed frame
+typedef struct {
+	unsigned char *data;			// The compressed bytes
+	int length;				// Bytes available
+	int position;				// Next byte
+	uint32_t bits;				// Bits not yet stored or consumed
+	int count;				// Number of them
+} CartBitStream;
+
+// Implementation
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : putBits
+// Description  : Appends bits to a compressed frame
+//
+// Inputs       : stream - the stream
+//                value - the bits, lowest first
+//                count - number of bits, at most 16
+// Outputs      : 0 if successful, -1 if the frame is out of room
+
+static int putBits(CartBitStream *stream, uint32_t value, int count) {
+	stream->bits |= value << stream->count;
+	stream->count += count;
+	while (stream->count >= 8) {
+		if (stream->position == stream->length) {
+			return (-1);
+		}
+		stream->data[stream->position++] = (unsigned char)stream->bits;
+		stream->bits >>= 8;
+		stream->count -= 8;
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : getBits
+// Description  : Takes bits from a compressed frame
+//
+// Inputs       : stream - the stream
+//                count - number of bits, at most 16
+// Outputs      : the bits, -1 if the frame ends first
+
+static int getBits(CartBitStream *stream, int count) {
+	int value;
+
+	while (stream->count < count) {
+		if (stream->position == stream->length) {
+			return (-1);
+		}
+		stream->bits |= (uint32_t)stream->data[stream->position++] << stream->count;
+		stream->count += 8;
+	}
+	value = stream->bits & ((1u << count) - 1);
+	stream->bits >>= count;
+	stream->count -= count;
+	return (value);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : findMatches
+// Description  : Splits a frame into literals and copies, greedily taking
+//                the copy the match finder offers at each position
+//
+// Inputs       : frame - the frame (CART_FRAME_SIZE bytes)
+//                matches - set to the literals and copies, in order
+// Outputs      : number of literals and copies
+
+static int findMatches(const char *frame, CartMatch *matches) {
+	uint16_t table[1 << CART_HASH_BITS];
+	uint32_t word;
+	int position = 0, count = 0, candidate, length, slot;
+
+	memset(table, 0xff, sizeof(table));
+	while (position < CART_FRAME_SIZE) {
+		length = 0;
+		if (position + CART_MIN_MATCH <= CART_FRAME_SIZE) {
+			memcpy(&word, &frame[position], sizeof(word));
+			slot = (word * 2654435761u) >> (32 - CART_HASH_BITS);
+			candidate = table[slot];
+			table[slot] = position;
+			if (candidate != CART_NO_POSITION) {
+				while (position + length < CART_FRAME_SIZE && frame[candidate + length] == frame[position + length]) {
+					length++;
+				}
+			}
+			if (length >= CART_MIN_MATCH) {
+				matches[count].offset = position - candidate;
+				matches[count++].length = length;
+
+				// Remember the positions the copy covers for later matches
+				for (int i = position + 1; i < position + length && i + CART_MIN_MATCH <= CART_FRAME_SIZE; i++) {
+					memcpy(&word, &frame[i], sizeof(word));
+					table[(word * 2654435761u) >> (32 - CART_HASH_BITS)] = i;
+				}
+				position += length;
+				continue;
+			}
+		}
+		matches[count].offset = 0;
+		matches[count++].length = 0;
+		position++;
+	}
+	return (count);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : buildLengths
+// Description  : Computes Huffman code lengths from symbol frequencies.  A
+//                frame has too few symbols for a code longer than
+//                CART_MAX_CODE_LENGTH.
+//
+// Inputs       : frequency - uses of each symbol
+//                lengths - set to the code length of each symbol, 0 if unused
+// Outputs      : none
+
+static void buildLengths(const int *frequency, int *lengths) {
+	int weight[2 * CART_SYMBOLS], parent[2 * CART_SYMBOLS], leaves[CART_SYMBOLS];
+	int n = 0, nodes, nextLeaf = 0, nextNode, pick[2], i, j;
+
+	// Order the used symbols by frequency, these are the leaves
+	for (i = 0; i < CART_SYMBOLS; i++) {
+		lengths[i] = 0;
+		if (frequency[i] > 0) {
+			for (j = n++; j > 0 && frequency[leaves[j - 1]] > frequency[i]; j--) {
+				leaves[j] = leaves[j - 1];
+			}
+			leaves[j] = i;
+		}
+	}
+	if (n == 1) {
+		lengths[leaves[0]] = 1;
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		weight[i] = frequency[leaves[i]];
+	}
+
+	// Join the two lightest nodes until one is left.  Joined nodes are
+	// made in order of weight, so the lightest is at the head of either
+	// the leaves or the joined nodes.
+	nodes = n;
+	nextNode = n;
+	while (nodes < 2 * n - 1) {
+		for (i = 0; i < 2; i++) {
+			if (nextLeaf < n && (nextNode == nodes || weight[nextLeaf] <= weight[nextNode])) {
+				pick[i] = nextLeaf++;
+			} else {
+				pick[i] = nextNode++;
+			}
+		}
+		weight[nodes] = weight[pick[0]] + weight[pick[1]];
+		parent[pick[0]] = parent[pick[1]] = nodes++;
+	}
+
+	// Depths from the root down, parents always come after their children
+	weight[nodes - 1] = 0;
+	for (i = nodes - 2; i >= 0; i--) {
+		weight[i] = weight[parent[i]] + 1;
+	}
+	for (i = 0; i < n; i++) {
+		lengths[leaves[i]] = weight[i];
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : buildCodes
+// Description  : Assigns canonical Huffman codes from code lengths, shorter
+//                codes first and in symbol order within a length.  The
+//                codes are stored reversed, ready to write lowest bit first.
+//
+// Inputs       : lengths - the code length of each symbol
+//                codes - set to the reversed code of each symbol
+// Outputs      : none
+
+static void buildCodes(const int *lengths, uint32_t *codes) {
+	int count[CART_MAX_CODE_LENGTH + 1] = { 0 }, next[CART_MAX_CODE_LENGTH + 1];
+	uint32_t code = 0, reversed;
+	int i, bit;
+
+	for (i = 0; i < CART_SYMBOLS; i++) {
+		count[lengths[i]]++;
+	}
+	count[0] = 0;
+	for (i = 1; i <= CART_MAX_CODE_LENGTH; i++) {
+		code = (code + count[i - 1]) << 1;
+		next[i] = code;
+	}
+	for (i = 0; i < CART_SYMBOLS; i++) {
+		if (lengths[i] != 0) {
+			code = next[lengths[i]]++;
+			for (reversed = 0, bit = 0; bit < lengths[i]; bit++) {
+				reversed = (reversed << 1) | ((code >> bit) & 1);
+			}
+			codes[i] = reversed;
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : compress_cart_frame
+// Description  : Compresses a frame
+//
+// Inputs       : frame - the frame (CART_FRAME_SIZE bytes)
+//                packed - where to put the compressed bytes
+//                capacity - most bytes the compressed frame may take
+// Outputs      : length of the compressed frame, -1 if it needs more room
+
+int compress_cart_frame(const char *frame, char *packed, int capacity) {
+	CartMatch matches[CART_FRAME_SIZE];
+	CartBitStream stream = { (unsigned char *)packed, capacity, 0, 0, 0 };
+	int frequency[CART_SYMBOLS] = { 0 }, lengths[CART_SYMBOLS];
+	uint32_t codes[CART_SYMBOLS];
+	int count, position, symbol, extra, i;
+
+	count = findMatches(frame, matches);
+	for (i = 0, position = 0; i < count; i++) {
+		if (matches[i].length == 0) {
+			frequency[(unsigned char)frame[position++]]++;
+		} else {
+			frequency[CART_COPY_SYMBOL]++;
+			position += matches[i].length;
+		}
+	}
+	buildLengths(frequency, lengths);
+	buildCodes(lengths, codes);
+
+	// The code lengths, then the symbols
+	for (i = 0; i < CART_SYMBOLS; i++) {
+		if (putBits(&stream, lengths[i] != 0, 1) == -1) {
+			return (-1);
+		}
+	}
+	for (i = 0; i < CART_SYMBOLS; i++) {
+		if (lengths[i] != 0 && putBits(&stream, lengths[i], 4) == -1) {
+			return (-1);
+		}
+	}
+	for (i = 0, position = 0; i < count; i++) {
+		if (matches[i].length == 0) {
+			symbol = (unsigned char)frame[position++];
+			if (putBits(&stream, codes[symbol], lengths[symbol]) == -1) {
+				return (-1);
+			}
+			continue;
+		}
+		extra = matches[i].length - CART_MIN_MATCH;
+		if (putBits(&stream, codes[CART_COPY_SYMBOL], lengths[CART_COPY_SYMBOL]) == -1 ||
+				putBits(&stream, matches[i].offset, CART_OFFSET_BITS) == -1 ||
+				putBits(&stream, (extra < 15) ? extra : 15, CART_LENGTH_BITS) == -1 ||
+				(extra >= 15 && putBits(&stream, extra - 15, CART_LONG_LENGTH_BITS) == -1)) {
+			return (-1);
+		}
+		position += matches[i].length;
+	}
+
+	// Flush the last partial byte
+	if (stream.count > 0 && putBits(&stream, 0, 8 - stream.count) == -1) {
+		return (-1);
+	}
+	return (stream.position);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : decompress_cart_frame
+// Description  : Expands a compressed frame, checking every code, offset
+//                and length against the frame and the input
+//
+// Inputs       : packed - the compressed bytes
+//                length - number of compressed bytes
+//                frame - where to put the frame (CART_FRAME_SIZE bytes)
+// Outputs      : CART_FRAME_SIZE if successful, -1 if the input is corrupt
+
+int decompress_cart_frame(const char *packed, int length, char *frame) {
+	CartBitStream stream = { (unsigned char *)packed, length, 0, 0, 0 };
+	int count[CART_MAX_CODE_LENGTH + 1] = { 0 }, offsets[CART_MAX_CODE_LENGTH + 1];
+	int used[CART_SYMBOLS], lengths[CART_SYMBOLS], symbols[CART_SYMBOLS];
+	int position = 0, code, first, index, symbol, bit, offset, copy, extra, i;
+
+	// Read the code lengths and order the symbols by code
+	for (i = 0; i < CART_SYMBOLS; i++) {
+		if ((used[i] = getBits(&stream, 1)) == -1) {
+			return (-1);
+		}
+	}
+	for (i = 0; i < CART_SYMBOLS; i++) {
+		lengths[i] = 0;
+		if (used[i] && ((lengths[i] = getBits(&stream, 4)) == -1 || lengths[i] == 0)) {
+			return (-1);
+		}
+		count[lengths[i]]++;
+	}
+	count[0] = 0;
+	offsets[1] = 0;
+	for (i = 1; i < CART_MAX_CODE_LENGTH; i++) {
+		offsets[i + 1] = offsets[i] + count[i];
+	}
+	for (i = 0; i < CART_SYMBOLS; i++) {
+		if (lengths[i] != 0) {
+			symbols[offsets[lengths[i]]++] = i;
+		}
+	}
+
+	while (position < CART_FRAME_SIZE) {
+		// Decode a symbol a bit at a time, the codes of each length follow
+		// on from the last code of the length before
+		symbol = -1;
+		for (code = 0, first = 0, index = 0, i = 1; i <= CART_MAX_CODE_LENGTH; i++) {
+			if ((bit = getBits(&stream, 1)) == -1) {
+				return (-1);
+			}
+			code |= bit;
+			if (code - count[i] < first) {
+				symbol = symbols[index + (code - first)];
+				break;
+			}
+			index += count[i];
+			first = (first + count[i]) << 1;
+			code <<= 1;
+		}
+		if (symbol == -1) {
+			return (-1);
+		}
+		if (symbol != CART_COPY_SYMBOL) {
+			frame[position++] = (char)symbol;
+			continue;
+		}
+
+		// A copy, possibly overlapping the bytes it produces
+		if ((offset = getBits(&stream, CART_OFFSET_BITS)) == -1 || (extra = getBits(&stream, CART_LENGTH_BITS)) == -1) {
+			return (-1);
+		}
+		if (extra == 15) {
+			if ((copy = getBits(&stream, CART_LONG_LENGTH_BITS)) == -1) {
+				return (-1);
+			}
+			extra += copy;
+		}
+		copy = extra + CART_MIN_MATCH;
+		if (offset == 0 || offset > position || copy > CART_FRAME_SIZE - position) {
+			return (-1);
+		}
+		for (i = 0; i < copy; i++, position++) {
+			frame[position] = frame[position - offset];
+		}
+	}
+	return (CART_FRAME_SIZE);
+}
@@ -0,0 +1,26 @@
+#ifndef CART_COMPRESS_INCLUDED
+#define CART_COMPRESS_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_compress.h
+//  Description    : This is the interface for the frame compressor for the
+//                   CART memory system driver.
+//
+//  Author         : John Flanigan
+//  Last Modified  : Oct 16 2026
+//
+
+// Project Includes
+#include <cart_controller.h>
+
+///
+// Compression Interfaces
+
+int compress_cart_frame(const char *frame, char *packed, int capacity);
+	// Compress a frame into at most "capacity" bytes, -1 if it does not fit
+
+int decompress_cart_frame(const char *packed, int length, char *frame);
+	// Expand a compressed frame, returns CART_FRAME_SIZE or -1 if it is corrupt
+
+#endif
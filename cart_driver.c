@@ -10,17 +10,60 @@
 
 // Includes
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <pthread.h>
+#include <time.h>
 
 // Project Includes
 #include <cart_driver.h>
 #include <cart_controller.h>
+#include <cart_cache.h>
+#include <cart_compress.h>
+#include <cart_hash.h>
 #include <cmpsc311_log.h>
+#include <cmpsc311_util.h>
 
 // Filesystem
 struct frame {
 	CartridgeIndex cartIndex;
 	CartFrameIndex frameIndex;
+	int packOffset;					// Where a compressed frame starts in the frame
+	int packLength;					// Bytes of compressed frame, zero if stored whole
+};
+
+struct extent {
+	int fileFrame;					// Index in the file of the first frame of the run
+	CartridgeIndex cartIndex;			// Cartridge holding the run
+	CartFrameIndex frameIndex;			// First frame of the run in the cartridge
+	int length;					// Number of consecutive frames in the run
+	uint16_t packOffset;				// A compressed run, where it starts in its first frame
+	uint32_t *packEnds;				// A compressed run, where each frame of it ends,
+							// counted from its start, NULL if stored whole
+};
+
+// Compression, a frame of a file stored compressed and packed into cartridge
+// frames along with the file's other compressed frames.  A compressed frame
+// may continue into the next frame of the cartridge.  Frames of a file
+// packed one after another form a compressed run, which stretches over as
+// many cartridge frames as it fills.
+#define CART_PACK_LIMIT (CART_FRAME_SIZE - CART_FRAME_SIZE / 8)	// Largest compressed frame worth packing
+#define CART_PACK_COMPACT (CART_FRAME_SIZE / 2)	// Packed frames with fewer bytes in use are compacted
+
+// Write buffer, small writes to a file gathered per frame and committed together
+#define CART_COALESCE_FRAMES 64				// Frames a file buffers before committing
+#define CART_COALESCE_WRITE_SIZE 512			// Largest write that is buffered
+#define CART_COALESCE_REACH CART_COALESCE_FRAMES	// Frames a write may land from the buffered ones
+#define CART_COALESCE_EVICT 4				// Frames a full buffer commits, oldest first
+
+struct pendingWrite {
+	int fileFrame;					// Frame of the file the bytes belong to
+	int low;					// First buffered byte in the frame
+	int high;					// One past the last buffered byte
+	int whole;					// One if the frame was past the end of the file,
+							// so the bytes outside the range are zero
+	unsigned int lastWrite;				// The file's write count when last written
+	char data[CART_FRAME_SIZE];			// The frame, valid from low to high
 };
 
 struct file {
@@ -28,204 +71,3902 @@ struct file {
 	char filePath[CART_MAX_PATH_LENGTH];		// File path string
 	int endPosition;				// First empty index in final frame (in bytes)
 	int currentPosition;				// Current position (in bytes)
-	struct frame listOfFrames[CART_CARTRIDGE_SIZE];	// Sorted list of frames that make up file
-							// Sorted such that frames are consecutive
+	struct extent *extents;				// Runs of frames that make up file, sorted
+							// by fileFrame and grown on demand, gaps
+							// between runs are holes reading as zeros
+	int numberOfExtents;				// Number of runs in use
+	int extentCapacity;				// Number of runs allocated
+	int nextInBucket;				// Next file in the same path index bucket, -1 if last
+	int readAheadNext;				// Position a sequential reader reads from next
+	int readAheadWindow;				// Frames fetched ahead, zero until reads are sequential
+	int readAheadFrame;				// First frame of the file not yet fetched ahead
+	struct pendingWrite *pending;			// Buffered writes, allocated on first use
+	int numberOfPending;				// Frames with buffered writes
+	int pendingLow;					// Lowest frame with buffered writes
+	int pendingHigh;				// Highest frame with buffered writes
+	unsigned int writeCount;			// Writes buffered, dates the buffered frames
+	uint32_t generation;				// Bumped on close, so requests queued before it
+							// never run against the handle's next file
+	CartridgeIndex packCart;			// Frame the file's compressed frames are packed
+	CartFrameIndex packFrame;			// into next, CART_NO_CARTRIDGE if none
+	int packUsed;					// Bytes of it already packed
+	int packReleased;				// Compressed frames released since last compacted
+	struct packStaging *packing;			// Packing buffers, allocated on first use
+	char (*staging)[CART_FRAME_SIZE];		// CART_QUEUE_DEPTH frames a read or write is
+							// staged in, allocated on first use
+	pthread_mutex_t lock;				// Guards the fields above once the file is open
+};
+
+// Bus command queue, frame transfers gathered by a caller and issued grouped by cartridge
+#define CART_QUEUE_DEPTH 32				// Most frame transfers in one batch
+
+// Readahead, frames fetched into the cache ahead of a sequential reader
+#define CART_READAHEAD_MIN 4				// Window when a file is first read sequentially
+#define CART_READAHEAD_MAX CART_QUEUE_DEPTH		// Window it doubles up to, one batch
+
+struct busRequest {
+	int op;						// CART_OP_RDFRME or CART_OP_WRFRME
+	CartridgeIndex cartIndex;			// Cartridge holding the frame
+	CartFrameIndex frameIndex;			// Frame to transfer
+	char *buf;					// Frame sized buffer to read into or write from
+	int status;					// 1 while queued, 0 when done, -1 if it failed
+};
+
+struct busQueue {
+	struct busRequest entries[CART_QUEUE_DEPTH];	// Requests in submission order
+	int length;					// Number of requests queued
+};
+
+// A file's packing, the frames of a batch compressed, the cartridge frames
+// the batch filled, waiting to be written, and the one it is filling
+struct packStaging {
+	char compressed[CART_QUEUE_DEPTH][CART_PACK_LIMIT];	// Compressed frames of a batch
+	char filled[CART_QUEUE_DEPTH + 1][CART_FRAME_SIZE];	// Frames filled by the batch
+	struct frame filledAt[CART_QUEUE_DEPTH + 1];	// Where each of them goes
+	int numberFilled;				// Frames filled by the batch
+	char open[CART_FRAME_SIZE];			// The frame being filled
+	int openChanged;				// Non-zero if packed into since it was written
+};
+
+// A frame taking part in a read or write, and where its bytes go in the frame
+struct framePlan {
+	CartridgeIndex cartIndex;			// Cartridge holding the frame
+	CartFrameIndex frameIndex;			// Frame in the cartridge
+	int positionInFrame;				// First byte of the frame involved
+	int bytes;					// Number of bytes of the frame involved
+	int entry;					// Queue entry fetching the frame, -1 if none
+	char *direct;					// Caller memory holding the whole frame, NULL if staged
+};
+
+// Position within an I/O vector while gathering or scattering
+struct ioCursor {
+	const struct iovec *iov;			// The buffers
+	int iovcnt;					// Number of buffers
+	int index;					// Buffer holding the next byte
+	size_t offset;					// Offset of the next byte in that buffer
 };
 
 struct file files[CART_MAX_TOTAL_FILES];
 int numberOfFiles;
+int freeHandles[CART_MAX_TOTAL_FILES];			// Handles of deleted files, reused first
+int numberOfFreeHandles;
+
+// Path index, a chained hash table from path to file handle
+#define CART_PATH_INDEX_SIZE (CART_MAX_TOTAL_FILES * 2)	// Buckets, a power of two
+int pathIndex[CART_PATH_INDEX_SIZE];			// First file in each bucket, -1 if empty
+
+// Free space, one bit per frame set while the frame is in use
+#define CART_MAP_WORDS (CART_CARTRIDGE_SIZE / 64)
+#define CART_MIN_NEW_RUN 32				// Smallest free run a new file is started in
+uint64_t frameMap[CART_MAX_CARTRIDGES][CART_MAP_WORDS];
+int freeFrames[CART_MAX_CARTRIDGES];			// Number of clear bits per cartridge
+int totalFreeFrames;					// Number of clear bits over all cartridges
+CartridgeIndex allocCart;				// Cartridge new files are started in
+
+// Cartridge zeroing state, cartridges are zeroed the first time a frame is allocated in them
+#define CART_STATE_DIRTY 0				// May still hold data from an earlier session
+#define CART_STATE_ZEROED 1				// Zeroed (or otherwise prepared) since power on
+int cartState[CART_MAX_CARTRIDGES];
+
+// Deduplication, file frames with identical contents sharing one cartridge frame.
+// Frames are fingerprinted with generate_md5_signature, which hashes with
+// CMPSC311_HASH_TYPE.
+#define CART_DIGEST_LENGTH 20				// Bytes in a frame digest (CMPSC311_HASH_TYPE)
+#define CART_DIGEST_BUCKETS 65536			// Digest index buckets, a power of two
+#define CART_FRAME_ID(cart, frm) ((cart) * CART_CARTRIDGE_SIZE + (frm))
+#define CART_STORE_WRITE 0				// Frame written where it is
+#define CART_STORE_HOLE 1				// Frame all zero, freed as a hole
+#define CART_STORE_SHARED 2				// Frame matches a stored one and uses it
+#define CART_STORE_COPY 3				// Frame shared, moved to a frame of its own first
+#define CART_STORE_PACK 4				// Frame compressed and packed with others
+
+struct frameDigest {
+	char digest[CART_DIGEST_LENGTH];		// Digest of the frame's contents
+	int indexed;					// One if the frame is in the digest index
+	int next;					// Next frame in the same bucket, -1 if last
+};
+
+// The tables are only allocated once frames can be shared, by turning on
+// deduplication or compression or by mounting shared frames, and are freed at
+// power off.
+uint32_t (*frameShares)[CART_CARTRIDGE_SIZE];		// File frames using a frame, less one
+struct frameDigest *frameDigests;			// Digest of each frame, once deduplicating
+int *digestIndex;					// First frame in each bucket, -1 if empty
+
+// Compressed frames are indexed by the digest of their contents too.  Packed
+// frames are only rewritten once freed, so an entry holds while its frame
+// has not been freed since, even after the compressed frame itself was
+// released.  Stale entries are dropped as lookups pass them.
+#define CART_PACK_DIGESTS_MIN 1024			// Entries first allocated
+
+struct packDigest {
+	char digest[CART_DIGEST_LENGTH];		// Digest of the frame before compression
+	struct frame location;				// Where the compressed frame is packed
+	uint32_t generation;				// frameGenerations of its frame when indexed
+	int next;					// Next entry in the bucket or free list, -1 if last
+};
+
+// Like the share counts, the tables are only allocated once compression is
+// turned on or compressed frames are mounted, and are freed at power off.
+uint32_t (*packLive)[CART_CARTRIDGE_SIZE];		// Bytes of compressed frames in use
+uint32_t (*frameGenerations)[CART_CARTRIDGE_SIZE];	// Times each frame was freed
+struct packDigest *packDigests;				// Entries, grown on demand
+int packDigestCapacity;					// Entries allocated
+int freePackDigests = -1;				// First unused entry, -1 if none
+int *packDigestIndex;					// First entry in each bucket, -1 if empty
+
+// On-cartridge metadata, a superblock followed by the file table at the start of
+// cartridge 0.  A table too long for the reserved frames continues in a chain of
+// free frames, each starting with the frame that follows it.  Every field is
+// stored little endian at a fixed width, whatever the layout of the structures.
+#define CART_META_CART 0				// Cartridge holding the metadata
+#define CART_META_FRAMES 512				// Frames reserved, the superblock and the file table
+#define CART_META_MAGIC 0x43415254			// "CART"
+#define CART_META_VERSION 2
+#define CART_META_NO_FRAME 0xffffffff			// End of the chain (see CART_FRAME_ID)
+#define CART_META_LINK 4				// Bytes naming the next frame of the chain
+#define CART_META_RESERVED_BYTES ((CART_META_FRAMES - 1) * CART_FRAME_SIZE)	// Table held in reserved frames
+#define CART_META_CHAINED_BYTES (CART_FRAME_SIZE - CART_META_LINK)		// Table held in each chained frame
+#define CART_META_EXTENT_BYTES 16			// Serialized struct extent
+#define CART_META_FILE_BYTES 14				// Serialized file, before its path
+#define CART_META_PACK_BYTES 2				// Serialized length of a compressed frame
+uint64_t extentTableBytes;				// Bytes every file's runs take in the file table
+
+struct superblock {
+	uint32_t magic;					// CART_META_MAGIC if the cartridges hold a filesystem
+	uint32_t version;				// Layout of the file table
+	uint32_t tableLength;				// Bytes of file table following the superblock frame
+	uint32_t numberOfFiles;				// File handles in use, including deleted ones
+	uint32_t chainFrame;				// First chained frame, CART_META_NO_FRAME if none
+};
+
+// Each file in the table is its handle (4 bytes), length in bytes (4), number
+// of extents (4) and path length (2), then the path and then each extent's
+// fileFrame (4), cartIndex (2), frameIndex (2), length (4), packOffset (2)
+// and packed (2), one for a compressed run, which is followed by the
+// compressed length of each of its frames (2)
+
+// The file table while it is serialized or read back
+struct metaBuffer {
+	char *data;					// The table
+	uint32_t length;				// Bytes serialized, or read back so far
+	uint32_t capacity;				// Bytes allocated, or available to read back
+};
+
+// Asynchronous requests, run in submission order by a worker thread
+#define CART_ASYNC_FREE 0				// Slot not in use
+#define CART_ASYNC_QUEUED 1				// Waiting for or being run by the worker
+#define CART_ASYNC_DONE 2				// Finished, result not yet collected
+
+// A request handle names a slot and how many times the slot has been used, so
+// a handle kept after its request was collected never matches a later one
+#define CART_ASYNC_GENERATIONS (INT32_MAX / CART_MAX_ASYNC_REQUESTS)
+#define CART_ASYNC_HANDLE(slot, generation) ((generation) * CART_MAX_ASYNC_REQUESTS + (slot))
+
+struct asyncRequest {
+	int state;					// CART_ASYNC_FREE, QUEUED or DONE
+	int32_t generation;				// Uses of the slot, kept across power cycles
+	int write;					// Non-zero for a write, zero for a read
+	int16_t fd;					// File handle
+	uint32_t fileGeneration;			// The file's generation when queued
+	char *buf;					// Caller's buffer
+	int32_t count;					// Bytes to transfer
+	uint32_t position;				// Offset in the file
+	CartAsyncCallback callback;			// Called when done, NULL to poll or wait instead
+	void *arg;					// Passed to the callback
+	int32_t result;					// Bytes transferred, or -1
+	int next;					// Next queued request, -1 if last
+};
+
+struct asyncRequest asyncRequests[CART_MAX_ASYNC_REQUESTS];
+int asyncHead = -1, asyncTail = -1;			// Queue of requests for the worker
+int asyncRunning;					// Non-zero while the worker thread exists
+int asyncStop;						// Set to have the worker exit once idle
+pthread_t asyncWorker;
+pthread_mutex_t asyncLock = PTHREAD_MUTEX_INITIALIZER;	// Guards the request slots and queue
+pthread_cond_t asyncQueued = PTHREAD_COND_INITIALIZER;	// Signalled when a request is queued
+pthread_cond_t asyncDone = PTHREAD_COND_INITIALIZER;	// Signalled when a request finishes
+
+// Driver locks, always taken in this order: the file table, a file, the
+// allocator, then the bus.  A file's lock covers its data and position.
+pthread_mutex_t tableLock = PTHREAD_MUTEX_INITIALIZER;	// File table, path index and free handles
+pthread_mutex_t allocLock = PTHREAD_MUTEX_INITIALIZER;	// Free frame maps and cartridge states
+pthread_mutex_t busLock = PTHREAD_MUTEX_INITIALIZER;	// Controller, loaded cartridge, cache and statistics
+pthread_mutex_t hashLock = PTHREAD_MUTEX_INITIALIZER;	// The hashing library's shared state, taken alone
+
+// Bus state
+CartridgeIndex loadedCart;			// Cartridge currently loaded, CART_NO_CARTRIDGE if none
+CartDriverStatistics driverStats;		// Counts of bus operations issued and avoided
+CartBusStatistics busStats;			// Per-opcode counts and latencies of bus operations
+CartridgeIndex busLastCart;			// Cartridge of the last load, for counting switches
+const char *busOpNames[CART_OP_MAXVAL] = { "INITMS", "BZERO", "LDCART", "RDFRME", "WRFRME", "POWOFF" };
+int writeBackMode;				// Non-zero if modified frames are held in the cache
+int sparseMode;					// Non-zero if all-zero frames are written as holes
+int dedupMode;					// Non-zero if identical frames are shared
+int compressMode;				// Non-zero if frames are stored compressed
+
+// Bus helpers used by the allocator, defined with the other bus functions below
+int zeroCommand(CartridgeIndex cartIndex);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : locatePacked
+// Description  : Finds where a frame of a compressed run is packed
+//
+// Inputs       : ext - the compressed run
+//                offset - index of the frame within the run
+//                location - set to the cartridge frame the compressed frame
+//                           starts in, where in it, and its length
+// Outputs      : none
+
+void locatePacked(const struct extent *ext, int offset, struct frame *location) {
+	uint32_t start = ext->packOffset + ((offset > 0) ? ext->packEnds[offset - 1] : 0);
+
+	location->cartIndex = ext->cartIndex;
+	location->frameIndex = ext->frameIndex + start / CART_FRAME_SIZE;
+	location->packOffset = start % CART_FRAME_SIZE;
+	location->packLength = ext->packEnds[offset] - ((offset > 0) ? ext->packEnds[offset - 1] : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : extentFrames
+// Description  : Counts the cartridge frames a run of a file occupies
+//
+// Inputs       : ext - the run
+// Outputs      : number of cartridge frames, from the run's first
+
+int extentFrames(const struct extent *ext) {
+	if (ext->packEnds == NULL) {
+		return (ext->length);
+	}
+	return ((ext->packOffset + ext->packEnds[ext->length - 1] + CART_FRAME_SIZE - 1) / CART_FRAME_SIZE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : runTableBytes
+// Description  : Counts the bytes a run of a file takes in the file table
+//
+// Inputs       : ext - the run
+// Outputs      : bytes once serialized
+
+uint32_t runTableBytes(const struct extent *ext) {
+	return (CART_META_EXTENT_BYTES + ((ext->packEnds != NULL) ? ext->length * CART_META_PACK_BYTES : 0));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : packEndsCapacity
+// Description  : Sizes the compressed lengths of a run, a power of two
+//                entries so a run can grow a frame at a time
+//
+// Inputs       : length - frames in the run
+// Outputs      : entries to allocate
+
+int packEndsCapacity(int length) {
+	int capacity = 1;
+
+	while (capacity < length) {
+		capacity *= 2;
+	}
+	return (capacity);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dropPackedFront
+// Description  : Takes the first frames off a compressed run, the run then
+//                starting where the next frame is packed
+//
+// Inputs       : ext - the compressed run
+//                frames - number of frames to drop, fewer than its length
+// Outputs      : none
+
+void dropPackedFront(struct extent *ext, int frames) {
+	uint32_t dropped = ext->packEnds[frames - 1], start = ext->packOffset + dropped;
+
+	ext->fileFrame += frames;
+	ext->frameIndex += start / CART_FRAME_SIZE;
+	ext->packOffset = start % CART_FRAME_SIZE;
+	ext->length -= frames;
+	for (int i = 0; i < ext->length; i++) {
+		ext->packEnds[i] = ext->packEnds[i + frames] - dropped;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : freeExtents
+// Description  : Releases a file's run list, without freeing its frames
+//
+// Inputs       : fd - the file handle
+// Outputs      : none
+
+void freeExtents(int fd) {
+	for (int i = 0; i < files[fd].numberOfExtents; i++) {
+		extentTableBytes -= runTableBytes(&files[fd].extents[i]);
+		free(files[fd].extents[i].packEnds);
+	}
+	free(files[fd].extents);
+	files[fd].extents = NULL;
+	files[fd].numberOfExtents = 0;
+	files[fd].extentCapacity = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mapFrame
+// Description  : Finds the cartridge frame backing a frame of a file, along
+//                with how many frames of the file follow it contiguously.  A
+//                compressed frame is followed by none, the frames after it
+//                in its run are not a frame apart.
+//
+// Inputs       : fd - the file handle
+//                fileFrame - index of the frame within the file
+//                location - set to the cartridge and frame holding fileFrame,
+//                           and where in it the frame is if compressed
+// Outputs      : frames in the run starting at fileFrame, -1 if unmapped
+
+int mapFrame(int fd, int fileFrame, struct frame *location) {
+	int low = 0, high = files[fd].numberOfExtents - 1, mid;
+	struct extent *ext;
+
+	// Binary search for the run containing the frame
+	while (low <= high) {
+		mid = (low + high) / 2;
+		ext = &files[fd].extents[mid];
+		if (fileFrame < ext->fileFrame) {
+			high = mid - 1;
+		} else if (fileFrame >= ext->fileFrame + ext->length) {
+			low = mid + 1;
+		} else if (ext->packEnds != NULL) {
+			locatePacked(ext, fileFrame - ext->fileFrame, location);
+			return (1);
+		} else {
+			location->cartIndex = ext->cartIndex;
+			location->frameIndex = ext->frameIndex + (fileFrame - ext->fileFrame);
+			location->packOffset = 0;
+			location->packLength = 0;
+			return (ext->length - (fileFrame - ext->fileFrame));
+		}
+	}
+	return (-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : findExtent
+// Description  : Finds the last run of a file starting at or before a frame
+//
+// Inputs       : fd - the file handle
+//                fileFrame - index of the frame within the file
+// Outputs      : index of the run, -1 if every run starts after the frame
+
+int findExtent(int fd, int fileFrame) {
+	int low = 0, high = files[fd].numberOfExtents - 1, mid;
+
+	while (low <= high) {
+		mid = (low + high) / 2;
+		if (files[fd].extents[mid].fileFrame <= fileFrame) {
+			low = mid + 1;
+		} else {
+			high = mid - 1;
+		}
+	}
+	return (high);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : insertExtentAt
+// Description  : Opens a slot in a file's run list, growing it if it is full
+//
+// Inputs       : fd - the file handle
+//                index - position of the new run in the list
+// Outputs      : the new (uninitialized) run, NULL if failure
+
+struct extent *insertExtentAt(int fd, int index) {
+	struct extent *ext;
+
+	if (files[fd].numberOfExtents == files[fd].extentCapacity) {
+		int capacity = (files[fd].extentCapacity == 0) ? 4 : files[fd].extentCapacity * 2;
+		ext = realloc(files[fd].extents, sizeof(struct extent) * capacity);
+		if (ext == NULL) {
+			logMessage(LOG_ERROR_LEVEL, "CART driver failed: unable to grow extent list.");
+			return (NULL);
+		}
+		files[fd].extents = ext;
+		files[fd].extentCapacity = capacity;
+	}
+	ext = &files[fd].extents[index];
+	memmove(ext + 1, ext, sizeof(struct extent) * (files[fd].numberOfExtents - index));
+	files[fd].numberOfExtents++;
+	return (ext);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : insertExtent
+// Description  : Adds a frame to a file where it has none, extending the run
+//                before or after it when the frame continues that run on the
+//                cartridge.  A compressed frame only extends a compressed run
+//                before it, when it is packed right after the run's last.
+//
+// Inputs       : fd - the file handle
+//                fileFrame - index of the frame within the file
+//                location - the cartridge frame backing it
+// Outputs      : 0 if successful, -1 if failure
+
+int insertExtent(int fd, int fileFrame, struct frame location) {
+	struct extent *prev = NULL, *next = NULL, *ext;
+	uint32_t *ends;
+	int index = findExtent(fd, fileFrame);
+
+	if (index >= 0) {
+		prev = &files[fd].extents[index];
+	}
+	if (index + 1 < files[fd].numberOfExtents) {
+		next = &files[fd].extents[index + 1];
+	}
+	if (location.packLength != 0) {
+		if (prev != NULL && prev->packEnds != NULL && prev->fileFrame + prev->length == fileFrame &&
+				prev->cartIndex == location.cartIndex && (uint32_t)prev->frameIndex * CART_FRAME_SIZE +
+				prev->packOffset + prev->packEnds[prev->length - 1] ==
+				(uint32_t)location.frameIndex * CART_FRAME_SIZE + location.packOffset) {
+			// The lengths fill a power of two entries, so a full list has one
+			if ((prev->length & (prev->length - 1)) == 0) {
+				ends = realloc(prev->packEnds, sizeof(uint32_t) * prev->length * 2);
+				if (ends == NULL) {
+					logMessage(LOG_ERROR_LEVEL, "CART driver failed: unable to grow compressed run.");
+					return (-1);
+				}
+				prev->packEnds = ends;
+			}
+			prev->packEnds[prev->length] = prev->packEnds[prev->length - 1] + location.packLength;
+			prev->length++;
+			extentTableBytes += CART_META_PACK_BYTES;
+			return (0);
+		}
+		prev = NULL;
+		next = NULL;
+	}
+	if (prev != NULL && prev->packEnds != NULL) {
+		prev = NULL;
+	}
+	if (next != NULL && next->packEnds != NULL) {
+		next = NULL;
+	}
+
+	if (prev != NULL && prev->fileFrame + prev->length == fileFrame && prev->cartIndex == location.cartIndex &&
+			prev->frameIndex + prev->length == location.frameIndex) {
+		prev->length++;
+
+		// The frame may close the hole between two runs
+		if (next != NULL && next->fileFrame == fileFrame + 1 && next->cartIndex == location.cartIndex &&
+				next->frameIndex == location.frameIndex + 1) {
+			prev->length += next->length;
+			memmove(next, next + 1, sizeof(struct extent) * (files[fd].numberOfExtents - index - 2));
+			files[fd].numberOfExtents--;
+			extentTableBytes -= CART_META_EXTENT_BYTES;
+		}
+		return (0);
+	}
+	if (next != NULL && next->fileFrame == fileFrame + 1 && next->cartIndex == location.cartIndex &&
+			next->frameIndex == location.frameIndex + 1) {
+		next->fileFrame--;
+		next->frameIndex--;
+		next->length++;
+		return (0);
+	}
+
+	// Start a new run
+	ends = NULL;
+	if (location.packLength != 0 && (ends = malloc(sizeof(uint32_t))) == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: unable to allocate compressed run.");
+		return (-1);
+	}
+	if ((ext = insertExtentAt(fd, index + 1)) == NULL) {
+		free(ends);
+		return (-1);
+	}
+	ext->fileFrame = fileFrame;
+	ext->cartIndex = location.cartIndex;
+	ext->frameIndex = location.frameIndex;
+	ext->length = 1;
+	ext->packOffset = location.packOffset;
+	ext->packEnds = ends;
+	if (ends != NULL) {
+		ends[0] = location.packLength;
+	}
+	extentTableBytes += runTableBytes(ext);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : frameInUse
+// Description  : Checks the free space bitmap for a frame
+//
+// Inputs       : cartIndex - the cartridge of the frame
+//                frameIndex - the frame within the cartridge
+// Outputs      : non-zero if the frame is allocated, 0 if it is free
+
+int frameInUse(CartridgeIndex cartIndex, int frameIndex) {
+	return ((frameMap[cartIndex][frameIndex / 64] >> (frameIndex % 64)) & 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : claimFrame
+// Description  : Marks a free frame as allocated
+//
+// Inputs       : cartIndex - the cartridge of the frame
+//                frameIndex - the frame within the cartridge
+// Outputs      : none
+
+void claimFrame(CartridgeIndex cartIndex, CartFrameIndex frameIndex) {
+	frameMap[cartIndex][frameIndex / 64] |= ((uint64_t)1 << (frameIndex % 64));
+	freeFrames[cartIndex]--;
+	totalFreeFrames--;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : digestBucket
+// Description  : Picks the digest index bucket for a digest
+//
+// Inputs       : digest - the frame digest
+// Outputs      : the bucket
+
+int digestBucket(const char *digest) {
+	uint32_t bits;
+
+	memcpy(&bits, digest, sizeof(bits));	// The digest is already well mixed
+	return (bits & (CART_DIGEST_BUCKETS - 1));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : allocateShares
+// Description  : Allocates the counts of file frames sharing each frame the
+//                first time frames can be shared, every count starting at
+//                none.  Called with the allocation lock held.
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int allocateShares(void) {
+	if (frameShares == NULL &&
+			(frameShares = calloc(CART_MAX_CARTRIDGES, sizeof(*frameShares))) == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: unable to allocate frame share counts.");
+		return (-1);
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : allocateDigests
+// Description  : Allocates the digest index and the share counts the first
+//                time deduplication is turned on.  Called with the
+//                allocation lock held.
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int allocateDigests(void) {
+	if (allocateShares() == -1) {
+		return (-1);
+	}
+	if (digestIndex != NULL) {
+		return (0);
+	}
+	frameDigests = calloc(CART_MAX_CARTRIDGES * CART_CARTRIDGE_SIZE, sizeof(struct frameDigest));
+	digestIndex = malloc(sizeof(int) * CART_DIGEST_BUCKETS);
+	if (frameDigests == NULL || digestIndex == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: unable to allocate digest index.");
+		free(frameDigests);
+		frameDigests = NULL;
+		free(digestIndex);
+		digestIndex = NULL;
+		return (-1);
+	}
+	for (int i = 0; i < CART_DIGEST_BUCKETS; i++) {
+		digestIndex[i] = -1;
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : freeSharing
+// Description  : Releases the digest index and share counts
+//
+// Inputs       : none
+// Outputs      : none
+
+void freeSharing(void) {
+	free(frameShares);
+	frameShares = NULL;
+	free(frameDigests);
+	frameDigests = NULL;
+	free(digestIndex);
+	digestIndex = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : findDigest
+// Description  : Looks up a frame holding contents with a given digest
+//
+// Inputs       : digest - the frame digest
+// Outputs      : the frame (see CART_FRAME_ID), -1 if there is none
+
+int findDigest(const char *digest) {
+	int id;
+
+	for (id = digestIndex[digestBucket(digest)]; id != -1; id = frameDigests[id].next) {
+		if (memcmp(frameDigests[id].digest, digest, CART_DIGEST_LENGTH) == 0) {
+			return (id);
+		}
+	}
+	return (-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : dropDigest
+// Description  : Removes a frame from the digest index, its contents are
+//                about to change or it is being freed
+//
+// Inputs       : id - the frame (see CART_FRAME_ID)
+// Outputs      : none
+
+void dropDigest(int id) {
+	int *link;
+
+	if (frameDigests == NULL || !frameDigests[id].indexed) {
+		return;
+	}
+	link = &digestIndex[digestBucket(frameDigests[id].digest)];
+	while (*link != id) {
+		link = &frameDigests[*link].next;
+	}
+	*link = frameDigests[id].next;
+	frameDigests[id].indexed = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : indexDigest
+// Description  : Records the digest of a frame's contents in the index
+//
+// Inputs       : id - the frame (see CART_FRAME_ID)
+//                digest - digest of its contents
+// Outputs      : none
+
+void indexDigest(int id, const char *digest) {
+	int bucket = digestBucket(digest);
+
+	dropDigest(id);
+	memcpy(frameDigests[id].digest, digest, CART_DIGEST_LENGTH);
+	frameDigests[id].next = digestIndex[bucket];
+	frameDigests[id].indexed = 1;
+	digestIndex[bucket] = id;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : freePackTables
+// Description  : Releases the tables compressed frames are tracked in, and
+//                the compressed frame digests
+//
+// Inputs       : none
+// Outputs      : none
+
+void freePackTables(void) {
+	free(packLive);
+	packLive = NULL;
+	free(frameGenerations);
+	frameGenerations = NULL;
+	free(packDigestIndex);
+	packDigestIndex = NULL;
+	free(packDigests);
+	packDigests = NULL;
+	packDigestCapacity = 0;
+	freePackDigests = -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : allocatePackTables
+// Description  : Allocates the tables compressed frames are tracked in, and
+//                the share counts, the first time frames are compressed.
+//                Called with the allocation lock held.
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int allocatePackTables(void) {
+	if (allocateShares() == -1) {
+		return (-1);
+	}
+	if (packDigestIndex != NULL) {
+		return (0);
+	}
+	packLive = calloc(CART_MAX_CARTRIDGES, sizeof(*packLive));
+	frameGenerations = calloc(CART_MAX_CARTRIDGES, sizeof(*frameGenerations));
+	packDigestIndex = malloc(sizeof(int) * CART_DIGEST_BUCKETS);
+	if (packLive == NULL || frameGenerations == NULL || packDigestIndex == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: unable to allocate compressed frame tables.");
+		freePackTables();
+		return (-1);
+	}
+	for (int i = 0; i < CART_DIGEST_BUCKETS; i++) {
+		packDigestIndex[i] = -1;
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : packDigestStale
+// Description  : Checks whether the frame an indexed compressed frame was
+//                packed in has been freed since
+//
+// Inputs       : entry - the digest entry
+// Outputs      : non-zero if the entry no longer holds
+
+int packDigestStale(const struct packDigest *entry) {
+	return (entry->generation != frameGenerations[entry->location.cartIndex][entry->location.frameIndex]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : findPackDigest
+// Description  : Looks up a compressed frame of a file frame with a given
+//                digest, dropping the stale entries passed on the way
+//
+// Inputs       : digest - digest of the file frame before compression
+//                location - set to where the compressed frame is packed
+// Outputs      : 0 if found, -1 if there is none
+
+int findPackDigest(const char *digest, struct frame *location) {
+	int *link = &packDigestIndex[digestBucket(digest)], entry;
+
+	while ((entry = *link) != -1) {
+		if (packDigestStale(&packDigests[entry])) {
+			*link = packDigests[entry].next;
+			packDigests[entry].next = freePackDigests;
+			freePackDigests = entry;
+		} else if (memcmp(packDigests[entry].digest, digest, CART_DIGEST_LENGTH) == 0) {
+			*location = packDigests[entry].location;
+			return (0);
+		} else {
+			link = &packDigests[entry].next;
+		}
+	}
+	return (-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sweepPackDigests
+// Description  : Drops every stale entry from the compressed frame index
+//
+// Inputs       : none
+// Outputs      : number of entries freed
+
+int sweepPackDigests(void) {
+	int *link, entry, freed = 0;
+
+	for (int i = 0; i < CART_DIGEST_BUCKETS; i++) {
+		link = &packDigestIndex[i];
+		while ((entry = *link) != -1) {
+			if (packDigestStale(&packDigests[entry])) {
+				*link = packDigests[entry].next;
+				packDigests[entry].next = freePackDigests;
+				freePackDigests = entry;
+				freed++;
+			} else {
+				link = &packDigests[entry].next;
+			}
+		}
+	}
+	return (freed);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : indexPackDigest
+// Description  : Records the digest of a compressed frame's contents before
+//                compression.  Only one packed within a single frame is
+//                indexed, so sharing it takes a use of that frame alone.
+//                When out of entries the stale ones are reclaimed, and the
+//                entries doubled if that freed no more than half.
+//
+// Inputs       : digest - digest of the file frame before compression
+//                location - where the compressed frame is packed
+// Outputs      : none
+
+void indexPackDigest(const char *digest, const struct frame *location) {
+	struct packDigest *grown;
+	int bucket = digestBucket(digest), entry, capacity;
+
+	if (location->packOffset + location->packLength > CART_FRAME_SIZE) {
+		return;
+	}
+	if (freePackDigests == -1 && sweepPackDigests() <= packDigestCapacity / 2) {
+		capacity = (packDigestCapacity == 0) ? CART_PACK_DIGESTS_MIN : packDigestCapacity * 2;
+		grown = realloc(packDigests, sizeof(struct packDigest) * capacity);
+		if (grown == NULL) {
+			if (freePackDigests == -1) {
+				return;		// Left unindexed, it is only not shared
+			}
+		} else {
+			for (entry = capacity - 1; entry >= packDigestCapacity; entry--) {
+				grown[entry].next = freePackDigests;
+				freePackDigests = entry;
+			}
+			packDigests = grown;
+			packDigestCapacity = capacity;
+		}
+	}
+
+	entry = freePackDigests;
+	freePackDigests = packDigests[entry].next;
+	memcpy(packDigests[entry].digest, digest, CART_DIGEST_LENGTH);
+	packDigests[entry].location = *location;
+	packDigests[entry].generation = frameGenerations[location->cartIndex][location->frameIndex];
+	packDigests[entry].next = packDigestIndex[bucket];
+	packDigestIndex[bucket] = entry;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : releaseFrame
+// Description  : Drops a file frame's use of a frame.  Once no file frame
+//                uses it, returns it to the free pool, dropping any cached
+//                copy and its digest.
+//
+// Inputs       : cartIndex - the cartridge of the frame
+//                frameIndex - the frame within the cartridge
+// Outputs      : none
+
+void releaseFrame(CartridgeIndex cartIndex, CartFrameIndex frameIndex) {
+	if (frameShares != NULL && frameShares[cartIndex][frameIndex] > 0) {
+		frameShares[cartIndex][frameIndex]--;
+		return;
+	}
+	dropDigest(CART_FRAME_ID(cartIndex, frameIndex));
+	frameMap[cartIndex][frameIndex / 64] &= ~((uint64_t)1 << (frameIndex % 64));
+	freeFrames[cartIndex]++;
+	totalFreeFrames++;
+	if (packLive != NULL) {
+		frameGenerations[cartIndex][frameIndex]++;	// Any compressed frames indexed in it are gone
+		packLive[cartIndex][frameIndex] = 0;
+	}
+	pthread_mutex_lock(&busLock);
+	delete_cart_cache(cartIndex, frameIndex);
+	pthread_mutex_unlock(&busLock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : releaseLocation
+// Description  : Drops a file frame's use of the frames holding it, both
+//                frames when it is compressed and continues into the next.
+//                The bytes it took in them are no longer in use.
+//
+// Inputs       : fd - the file handle
+//                location - where the file frame was stored
+// Outputs      : none
+
+void releaseLocation(int fd, const struct frame *location) {
+	int first = CART_FRAME_SIZE - location->packOffset;
+
+	if (location->packLength != 0) {
+		if (location->packLength > first) {
+			packLive[location->cartIndex][location->frameIndex + 1] -= location->packLength - first;
+			releaseFrame(location->cartIndex, location->frameIndex + 1);
+		} else {
+			first = location->packLength;
+		}
+		packLive[location->cartIndex][location->frameIndex] -= first;
+		files[fd].packReleased++;
+	}
+	releaseFrame(location->cartIndex, location->frameIndex);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : findFreeFrame
+// Description  : Finds the first free frame in a cartridge at or after a
+//                goal frame, wrapping around to the start of the cartridge
+//
+// Inputs       : cartIndex - the cartridge to search
+//                goal - the frame to start searching from
+// Outputs      : the free frame, -1 if the cartridge is full
+
+int findFreeFrame(CartridgeIndex cartIndex, int goal) {
+	uint64_t free;
+	int word, i;
+
+	if (freeFrames[cartIndex] == 0) {
+		return (-1);
+	}
+	for (i = 0; i <= CART_MAP_WORDS; i++) {
+		word = (goal / 64 + i) % CART_MAP_WORDS;
+		free = ~frameMap[cartIndex][word];
+		if (i == 0) {
+			free &= ~(uint64_t)0 << (goal % 64);	// Skip frames before the goal
+		}
+		if (free != 0) {
+			return (word * 64 + __builtin_ctzll(free));
+		}
+	}
+	return (-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : largestFreeRun
+// Description  : Finds a place to start a new run in a cartridge.  This is
+//                the start of its largest free run, or the middle of that
+//                run when it directly follows allocated frames, so the file
+//                before it has room to grow.
+//
+// Inputs       : cartIndex - the cartridge to search
+//                start - set to the frame to start the new run at
+// Outputs      : length of the largest free run
+
+int largestFreeRun(CartridgeIndex cartIndex, int *start) {
+	int frameIndex, runStart = 0, runLength = 0, best = 0, bestStart = 0;
+
+	for (frameIndex = 0; frameIndex <= CART_CARTRIDGE_SIZE; frameIndex++) {
+		if (frameIndex < CART_CARTRIDGE_SIZE && !frameInUse(cartIndex, frameIndex)) {
+			if (runLength++ == 0) {
+				runStart = frameIndex;
+			}
+		} else {
+			if (runLength > best) {
+				best = runLength;
+				bestStart = runStart;
+			}
+			runLength = 0;
+		}
+	}
+
+	*start = (bestStart > 0) ? bestStart + best / 2 : bestStart;
+	return (best);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : pickCartridge
+// Description  : Chooses where to start a run of frames that cannot continue
+//                an existing one.  The current allocation cartridge is kept
+//                while it has a reasonable free run, otherwise the cartridge
+//                with the largest free run is used.
+//
+// Inputs       : location - set to the cartridge and frame to start at
+// Outputs      : 0 if successful, -1 if there are no free frames
+
+int pickCartridge(struct frame *location) {
+	int cartIndex, start, run, bestRun = 0, bestStart = 0, bestCart = -1;
+
+	if (largestFreeRun(allocCart, &start) >= CART_MIN_NEW_RUN) {
+		location->cartIndex = allocCart;
+		location->frameIndex = start;
+		return (0);
+	}
+	for (cartIndex = 0; cartIndex < CART_MAX_CARTRIDGES; cartIndex++) {
+		if (freeFrames[cartIndex] > bestRun) {
+			run = largestFreeRun(cartIndex, &start);
+			if (run > bestRun) {
+				bestRun = run;
+				bestStart = start;
+				bestCart = cartIndex;
+			}
+		}
+	}
+	if (bestCart == -1) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: out of frames.");
+		return (-1);
+	}
+	allocCart = bestCart;
+	location->cartIndex = bestCart;
+	location->frameIndex = bestStart;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : prepareCartridge
+// Description  : Zeros a cartridge the first time anything is allocated in
+//                it.  Called with the allocation lock held.
+//
+// Inputs       : cartIndex - the cartridge about to be allocated in
+// Outputs      : 0 if successful, -1 if failure
+
+int prepareCartridge(CartridgeIndex cartIndex) {
+	int status;
+
+	if (cartState[cartIndex] == CART_STATE_DIRTY) {
+		pthread_mutex_lock(&busLock);
+		status = zeroCommand(cartIndex);
+		pthread_mutex_unlock(&busLock);
+		if (status == -1) {
+			return (-1);
+		}
+		cartState[cartIndex] = CART_STATE_ZEROED;
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : keepTableFrames
+// Description  : Checks a frame can go to a file while leaving enough free
+//                to chain the file table through at power off, once the
+//                table has grown by the given bytes.  Paths change under
+//                the table lock, so every handle is counted with the
+//                longest path.  Called with the allocation lock held.
+//
+// Inputs       : growth - bytes the allocation may add to the file table
+// Outputs      : 0 if the frame can be allocated, -1 if it is kept
+
+int keepTableFrames(uint32_t growth) {
+	uint64_t length;
+	int chained = 0;
+
+	length = (uint64_t)CART_MAX_TOTAL_FILES * (CART_META_FILE_BYTES + CART_MAX_PATH_LENGTH) +
+		extentTableBytes + growth;
+	if (length > CART_META_RESERVED_BYTES) {
+		chained = (length - CART_META_RESERVED_BYTES + CART_META_CHAINED_BYTES - 1) / CART_META_CHAINED_BYTES;
+	}
+	if (totalFreeFrames <= chained) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: out of frames, the rest hold the file table.");
+		return (-1);
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : allocateFrames
+// Description  : Allocates the frames a file is missing in a range, leaving
+//                the frames it already has alone.  Each frame is taken where
+//                it would continue the run before it when free, otherwise
+//                from the same cartridge, and only then from another
+//                cartridge.  Frames the file table needs are left free.
+//
+// Inputs       : fd - the file handle
+//                firstFileFrame - the first frame of the file that must exist
+//                lastFileFrame - the last frame of the file that must exist
+// Outputs      : 0 if successful, -1 if failure
+
+int allocateFrames(int fd, int firstFileFrame, int lastFileFrame) {
+	struct extent *ext;
+	struct frame location;
+	int fileFrame, frameIndex, index, runLength;
+
+	pthread_mutex_lock(&allocLock);
+	for (fileFrame = firstFileFrame; fileFrame <= lastFileFrame; fileFrame++) {
+		if ((runLength = mapFrame(fd, fileFrame, &location)) != -1) {
+			fileFrame += runLength - 1;	// Skip the run it already has
+			continue;
+		}
+
+		if (keepTableFrames(CART_META_EXTENT_BYTES) == -1) {
+			pthread_mutex_unlock(&allocLock);
+			return (-1);
+		}
+		frameIndex = -1;
+		if ((index = findExtent(fd, fileFrame)) != -1) {
+			// Continue the run before it, or stay on its cartridge
+			ext = &files[fd].extents[index];
+			frameIndex = findFreeFrame(ext->cartIndex,
+				(ext->frameIndex + fileFrame - ext->fileFrame) % CART_CARTRIDGE_SIZE);
+			location.cartIndex = ext->cartIndex;
+			location.frameIndex = frameIndex;
+		}
+		if ((frameIndex == -1 && pickCartridge(&location) == -1) || prepareCartridge(location.cartIndex) == -1) {
+			pthread_mutex_unlock(&allocLock);
+			return (-1);
+		}
+
+		location.packOffset = 0;
+		location.packLength = 0;
+		claimFrame(location.cartIndex, location.frameIndex);
+		if (insertExtent(fd, fileFrame, location) == -1) {
+			releaseFrame(location.cartIndex, location.frameIndex);
+			pthread_mutex_unlock(&allocLock);
+			return (-1);
+		}
+	}
+	pthread_mutex_unlock(&allocLock);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : closePack
+// Description  : Drops the file's use of the frame it was packing its
+//                compressed frames into.  If they are still in use and the
+//                frame was packed into since it was last written, it joins
+//                the frames waiting to be written.  Called with the
+//                allocation lock held.
+//
+// Inputs       : fd - the file handle
+// Outputs      : none
+
+void closePack(int fd) {
+	struct packStaging *packing = files[fd].packing;
+	CartridgeIndex cartIndex = files[fd].packCart;
+	CartFrameIndex frameIndex = files[fd].packFrame;
+
+	if (cartIndex == CART_NO_CARTRIDGE) {
+		return;
+	}
+	files[fd].packCart = CART_NO_CARTRIDGE;
+	releaseFrame(cartIndex, frameIndex);
+	if (packing->openChanged && frameInUse(cartIndex, frameIndex)) {
+		memcpy(packing->filled[packing->numberFilled], packing->open, CART_FRAME_SIZE);
+		packing->filledAt[packing->numberFilled].cartIndex = cartIndex;
+		packing->filledAt[packing->numberFilled].frameIndex = frameIndex;
+		packing->numberFilled++;
+	}
+	packing->openChanged = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : openPack
+// Description  : Moves the file on to packing its compressed frames into a
+//                free frame, which it holds a use of until it moves on
+//                again.  Nothing is in the frame yet, so it is filled from
+//                zeros without being read.  Called with the allocation lock
+//                held.
+//
+// Inputs       : fd - the file handle
+//                cartIndex - the cartridge of the frame, already prepared
+//                frameIndex - the free frame
+// Outputs      : none
+
+void openPack(int fd, CartridgeIndex cartIndex, CartFrameIndex frameIndex) {
+	closePack(fd);
+	claimFrame(cartIndex, frameIndex);
+	files[fd].packCart = cartIndex;
+	files[fd].packFrame = frameIndex;
+	files[fd].packUsed = 0;
+	memset(files[fd].packing->open, 0x0, CART_FRAME_SIZE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : reservePack
+// Description  : Packs a compressed frame of a file after the last one it
+//                packed, continuing its compressed run.  When that frame is
+//                full the compressed frame continues into the next frame of
+//                the cartridge if it is free, otherwise it goes at the start
+//                of a new frame near the last.  It takes a use of each frame
+//                it lands in, leaving the frames the file table needs.
+//                Called with the allocation lock held.
+//
+// Inputs       : fd - the file handle, its packing buffers allocated
+//                blob - the compressed frame
+//                length - bytes of compressed frame, at most CART_PACK_LIMIT
+//                location - set to where the compressed frame goes
+// Outputs      : 0 if successful, -1 if failure
+
+int reservePack(int fd, const char *blob, int length, struct frame *location) {
+	struct packStaging *packing = files[fd].packing;
+	CartridgeIndex cartIndex = files[fd].packCart;
+	CartFrameIndex frameIndex = files[fd].packFrame;
+	int goal, first;
+
+	if (keepTableFrames(CART_META_EXTENT_BYTES + CART_META_PACK_BYTES) == -1) {
+		return (-1);
+	}
+	if (cartIndex == CART_NO_CARTRIDGE || (files[fd].packUsed + length > CART_FRAME_SIZE &&
+			(frameIndex + 1 == CART_CARTRIDGE_SIZE || frameInUse(cartIndex, frameIndex + 1)))) {
+		// Stay near the frames the file packed last
+		goal = -1;
+		if (cartIndex != CART_NO_CARTRIDGE) {
+			location->cartIndex = cartIndex;
+			location->frameIndex = goal = findFreeFrame(cartIndex, (frameIndex + 1) % CART_CARTRIDGE_SIZE);
+		}
+		if ((goal == -1 && pickCartridge(location) == -1) || prepareCartridge(location->cartIndex) == -1) {
+			return (-1);
+		}
+		openPack(fd, location->cartIndex, location->frameIndex);
+	} else if (files[fd].packUsed == CART_FRAME_SIZE) {
+		// Full, the run carries on at the start of the next frame
+		openPack(fd, cartIndex, frameIndex + 1);
+	}
+	cartIndex = files[fd].packCart;
+	frameIndex = files[fd].packFrame;
+
+	location->cartIndex = cartIndex;
+	location->frameIndex = frameIndex;
+	location->packOffset = files[fd].packUsed;
+	location->packLength = length;
+	frameShares[cartIndex][frameIndex]++;
+	first = CART_FRAME_SIZE - files[fd].packUsed;
+	if (first > length) {
+		first = length;
+	}
+	memcpy(&packing->open[files[fd].packUsed], blob, first);
+	packLive[cartIndex][frameIndex] += first;
+	files[fd].packUsed += first;
+	packing->openChanged = 1;
+
+	// The part spilling over goes at the start of the next frame
+	if (first < length) {
+		openPack(fd, cartIndex, frameIndex + 1);
+		frameShares[cartIndex][frameIndex + 1]++;
+		memcpy(packing->open, &blob[first], length - first);
+		packLive[cartIndex][frameIndex + 1] += length - first;
+		files[fd].packUsed = length - first;
+		packing->openChanged = 1;
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : packSparse
+// Description  : Checks whether a compressed frame sits in a frame mostly
+//                holding compressed frames no longer in use, and so would be
+//                better packed again.  The frame the file is packing into is
+//                still filling, so it never is.  Called with the allocation
+//                lock held.
+//
+// Inputs       : fd - the file handle
+//                location - where the compressed frame is packed
+// Outputs      : non-zero if it should be packed again
+
+int packSparse(int fd, const struct frame *location) {
+	int frames = (location->packOffset + location->packLength > CART_FRAME_SIZE) ? 2 : 1, sparse = 0;
+
+	for (int run = 0; run < frames; run++) {
+		if (files[fd].packCart == location->cartIndex && files[fd].packFrame == location->frameIndex + run) {
+			return (0);
+		}
+		if (packLive[location->cartIndex][location->frameIndex + run] < CART_PACK_COMPACT) {
+			sparse = 1;
+		}
+	}
+	return (sparse);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unmapFrame
+// Description  : Takes one frame out of a file's runs, leaving a hole.  The
+//                frame itself is not released.  Called with the allocation
+//                lock held.
+//
+// Inputs       : fd - the file handle
+//                fileFrame - index of the frame within the file
+//                location - set to the cartridge frame that backed it
+// Outputs      : 1 if a frame was taken out, 0 if already a hole, -1 if failure
+
+int unmapFrame(int fd, int fileFrame, struct frame *location) {
+	struct extent *ext, *tail;
+	uint32_t *ends = NULL, start;
+	int index, offset;
+
+	index = findExtent(fd, fileFrame);
+	if (index == -1 || fileFrame >= files[fd].extents[index].fileFrame + files[fd].extents[index].length) {
+		return (0);
+	}
+	ext = &files[fd].extents[index];
+	offset = fileFrame - ext->fileFrame;
+	if (ext->packEnds != NULL) {
+		locatePacked(ext, offset, location);
+	} else {
+		location->cartIndex = ext->cartIndex;
+		location->frameIndex = ext->frameIndex + offset;
+		location->packOffset = 0;
+		location->packLength = 0;
+	}
+
+	if (ext->length == 1) {
+		// That was all of the run
+		extentTableBytes -= runTableBytes(ext);
+		free(ext->packEnds);
+		memmove(ext, ext + 1, sizeof(struct extent) * (files[fd].numberOfExtents - index - 1));
+		files[fd].numberOfExtents--;
+	} else if (offset == 0) {
+		// Trim the front of the run
+		if (ext->packEnds != NULL) {
+			dropPackedFront(ext, 1);
+			extentTableBytes -= CART_META_PACK_BYTES;
+		} else {
+			ext->fileFrame++;
+			ext->frameIndex++;
+			ext->length--;
+		}
+	} else if (offset == ext->length - 1) {
+		extentTableBytes -= (ext->packEnds != NULL) ? CART_META_PACK_BYTES : 0;
+		ext->length--;
+	} else {
+		// Split the run around the frame
+		if (ext->packEnds != NULL &&
+				(ends = malloc(sizeof(uint32_t) * packEndsCapacity(ext->length - offset - 1))) == NULL) {
+			logMessage(LOG_ERROR_LEVEL, "CART driver failed: unable to split compressed run.");
+			return (-1);
+		}
+		if ((tail = insertExtentAt(fd, index + 1)) == NULL) {
+			free(ends);
+			return (-1);
+		}
+		ext = &files[fd].extents[index];
+		tail->fileFrame = fileFrame + 1;
+		tail->cartIndex = ext->cartIndex;
+		tail->length = ext->length - offset - 1;
+		tail->packEnds = ends;
+		if (ends != NULL) {
+			start = ext->packOffset + ext->packEnds[offset];
+			tail->frameIndex = ext->frameIndex + start / CART_FRAME_SIZE;
+			tail->packOffset = start % CART_FRAME_SIZE;
+			for (int i = 0; i < tail->length; i++) {
+				ends[i] = ext->packEnds[offset + 1 + i] - ext->packEnds[offset];
+			}
+		} else {
+			tail->frameIndex = location->frameIndex + 1;
+			tail->packOffset = 0;
+		}
+		extentTableBytes += CART_META_EXTENT_BYTES - ((ends != NULL) ? CART_META_PACK_BYTES : 0);
+		ext->length = offset;
+	}
+	return (1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : punchFrame
+// Description  : Frees one frame of a file, leaving a hole that reads as
+//                zeros
+//
+// Inputs       : fd - the file handle
+//                fileFrame - index of the frame within the file
+// Outputs      : 0 if successful, -1 if failure
+
+int punchFrame(int fd, int fileFrame) {
+	struct frame location;
+	int status;
+
+	pthread_mutex_lock(&allocLock);
+	if ((status = unmapFrame(fd, fileFrame, &location)) == 1) {
+		releaseLocation(fd, &location);
+	}
+	pthread_mutex_unlock(&allocLock);
+	return ((status == -1) ? -1 : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : releaseFrames
+// Description  : Frees every frame of a file from a given frame onwards and
+//                drops them from its extent list
+//
+// Inputs       : fd - the file handle
+//                firstFileFrame - the first frame of the file to release
+// Outputs      : none
+
+void releaseFrames(int fd, int firstFileFrame) {
+	struct extent *ext;
+	struct frame location;
+	int keep;
+
+	pthread_mutex_lock(&allocLock);
+	while (files[fd].numberOfExtents > 0) {
+		ext = &files[fd].extents[files[fd].numberOfExtents - 1];
+		if (ext->fileFrame + ext->length <= firstFileFrame) {
+			break;
+		}
+
+		// Release the tail of the run past the cut
+		keep = (firstFileFrame > ext->fileFrame) ? firstFileFrame - ext->fileFrame : 0;
+		if (ext->packEnds != NULL) {
+			for (int run = keep; run < ext->length; run++) {
+				locatePacked(ext, run, &location);
+				releaseLocation(fd, &location);
+			}
+		} else {
+			for (int run = keep; run < ext->length; run++) {
+				releaseFrame(ext->cartIndex, ext->frameIndex + run);
+			}
+		}
+		extentTableBytes -= runTableBytes(ext);
+		ext->length = keep;
+		if (keep > 0) {
+			extentTableBytes += runTableBytes(ext);
+			break;
+		}
+		free(ext->packEnds);
+		files[fd].numberOfExtents--;
+	}
+	pthread_mutex_unlock(&allocLock);
+}
+
+// Implementation
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : create_cart_opcode
+// Description  : Packs a 64 bit cart register and returns the packed register
+//
+// Inputs       : ky1 - indicates the cart opcode (8 bits)
+//                ky2 - unused currently (8 bits)
+//                rt1 - single bit to indicate return success or failure (1 bit)
+//                ct1 - cart index
+//                fm1 - frame index
+// Outputs      : regstate - a packed register
+
+CartXferRegister create_cart_opcode(CartXferRegister ky1, CartXferRegister ky2, CartXferRegister rt1, CartXferRegister ct1, CartXferRegister fm1) {
+	CartXferRegister regstate = 0x0, tempKY1, tempKY2, tempRT1, tempCT1, tempFM1, unused;
+	tempKY1 = (ky1&0xff) << 56;
+	tempKY2 = (ky2&0xff) << 48;
+	tempRT1 = (rt1&0x1) << 47;
+	tempCT1 = (ct1&0xffff) << 31;
+	tempFM1 = (fm1&0xffff) << 15;
+	unused = 0x0;
+	regstate = tempKY1|tempKY2|tempRT1|tempCT1|tempFM1|unused;
+	return (regstate);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : extract_cart_opcode
+// Description  : Unpacks a packed register and puts each value into its own index
+//                in an array
+//
+// Inputs       : regstate - a packed register containing operating arguments
+//                oregstate - an array of CartXferRegister allocated for 5 elements
+// Outputs      : 0 if successful
+
+int extract_cart_opcode(CartXferRegister regstate, CartXferRegister* oregstate) {	
+	oregstate[CART_REG_KY1] = (regstate&0xff00000000000000) >> 56;
+	oregstate[CART_REG_KY2] = (regstate&0x00ff000000000000) >> 48;
+	oregstate[CART_REG_RT1] = (regstate&0x0000800000000000) >> 47;
+	oregstate[CART_REG_CT1] = (regstate&0x00007FFF80000000) >> 31;
+	oregstate[CART_REG_FM1] = (regstate&0x000000007FFF8000) >> 15;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : busCommand
+// Description  : Sends a register to the controller with cart_io_bus,
+//                recording the count, latency and bytes moved by opcode
+//
+// Inputs       : regstate - the packed register to send
+//                buf - the frame buffer of a read or write, NULL otherwise
+// Outputs      : the register returned by the controller
+
+CartXferRegister busCommand(CartXferRegister regstate, void *buf) {
+	CartXferRegister result;
+	struct timespec start, stop;
+	uint64_t nanoseconds;
+	int op, cartIndex, bucket;
+
+	op = (regstate >> 56) & 0xff;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	result = cart_io_bus(regstate, buf);
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	if (op >= CART_OP_MAXVAL) {
+		return (result);
+	}
+
+	nanoseconds = (stop.tv_sec - start.tv_sec) * 1000000000ULL + stop.tv_nsec - start.tv_nsec;
+	bucket = 63 - __builtin_clzll(nanoseconds | 1);
+	if (bucket >= CART_BUS_LATENCY_BUCKETS) {
+		bucket = CART_BUS_LATENCY_BUCKETS - 1;
+	}
+	busStats.count[op]++;
+	busStats.nanoseconds[op] += nanoseconds;
+	busStats.latency[op][bucket]++;
+	if (result & 0x0000800000000000) {
+		busStats.failures[op]++;
+		return (result);
+	}
+
+	if (op == CART_OP_LDCART) {
+		cartIndex = (regstate >> 31) & 0xffff;
+		if (busLastCart != CART_NO_CARTRIDGE && busLastCart != cartIndex) {
+			busStats.cartridgeSwitches++;
+		}
+		busLastCart = cartIndex;
+	} else if (op == CART_OP_RDFRME) {
+		busStats.bytesRead += CART_FRAME_SIZE;
+	} else if (op == CART_OP_WRFRME) {
+		busStats.bytesWritten += CART_FRAME_SIZE;
+	}
+	return (result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : logBusStatistics
+// Description  : Logs a summary of the bus operations since power on, with
+//                the mean and the 99th percentile latency (as the upper
+//                bound of its histogram bucket) of each opcode
+//
+// Inputs       : none
+// Outputs      : none
+
+void logBusStatistics(void) {
+	uint64_t seen;
+	int op, bucket;
+
+	for (op = 0; op < CART_OP_MAXVAL; op++) {
+		if (busStats.count[op] == 0) {
+			continue;
+		}
+		seen = 0;
+		for (bucket = 0; bucket < CART_BUS_LATENCY_BUCKETS - 1; bucket++) {
+			seen += busStats.latency[op][bucket];
+			if (seen * 100 >= busStats.count[op] * 99) {
+				break;
+			}
+		}
+		logMessage(LOG_OUTPUT_LEVEL, "CART bus %s: %lu ops (%lu failed), mean %lu ns, p99 < %lu ns.",
+			busOpNames[op], busStats.count[op], busStats.failures[op],
+			busStats.nanoseconds[op] / busStats.count[op], 2UL << bucket);
+	}
+	logMessage(LOG_OUTPUT_LEVEL, "CART bus: %lu cartridge switches, %lu bytes read, %lu bytes written.",
+		busStats.cartridgeSwitches, busStats.bytesRead, busStats.bytesWritten);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : loadCommand
+// Description  : Loads a cartridge using the cart_io_bus, unless it is
+//                already the loaded cartridge
+//
+// Inputs       : cartIndex - the index of the cart to be loaded
+// Outputs      : 0 if successful, -1 if failure
+
+int loadCommand(CartridgeIndex cartIndex) {
+	CartXferRegister regstate = 0x0, ky1, ky2, rt1, fm1;
+	CartXferRegister oregstate[5];
+
+	// Nothing to do if the cartridge is already in place
+	if (cartIndex == loadedCart) {
+		driverStats.loadsAvoided++;
+		return (0);
+	}
+	
+	ky1 = CART_OP_LDCART;
+	ky2 = 0;
+	rt1 = 0;
+	fm1 = 0;
+	regstate = create_cart_opcode(ky1, ky2, rt1, cartIndex, fm1);
+	regstate = busCommand(regstate, NULL);
+
+	extract_cart_opcode(regstate, oregstate);
+	if (oregstate[CART_REG_RT1] != 0) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: failed to load cartridge %d.", cartIndex);
+		loadedCart = CART_NO_CARTRIDGE;
+		return (-1);
+	}
+	driverStats.loads++;
+	loadedCart = cartIndex;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : readCommand
+// Description  : Reads a frame from the currently loaded cartridge
+//                using the cart_io_bus 
+//
+// Inputs       : frameIndex - the index of the frame to be read
+//                tempBuf - a character pointer allocated for the size of one frame.
+//                          contents of frame will be written to address
+// Outputs      : 0 if successful, -1 if failure
+
+int readCommand(CartFrameIndex frameIndex, char *tempBuf) {
+	CartXferRegister regstate = 0x0, ky1, ky2, rt1, ct1;
+	CartXferRegister oregstate[5];
+	
+	ky1 = CART_OP_RDFRME;
+	ky2 = 0;
+	rt1 = 0;
+	ct1 = 0;
+	regstate = create_cart_opcode(ky1, ky2, rt1, ct1, frameIndex);
+	regstate = busCommand(regstate, tempBuf);
+
+	extract_cart_opcode(regstate, oregstate);
+	if (oregstate[CART_REG_RT1] != 0) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: failed to read frame %d.", frameIndex);
+		return (-1);
+	}
+	driverStats.reads++;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : writeCommand
+// Description  : Writes a frame to the currently loaded cartridge
+//                using the cart_io_bus 
+//
+// Inputs       : frameIndex - the index of the frame to be written to
+//                tempBuf - a character pointer allocated for the size of one frame.
+//                          contains the characters to be written
+// Outputs      : 0 if successful, -1 if failure
+
+int writeCommand(CartFrameIndex frameIndex, char *tempBuf) {
+	CartXferRegister regstate = 0x0, ky1, ky2, rt1, ct1;
+	CartXferRegister oregstate[5];
+
+	ky1 = CART_OP_WRFRME;
+	ky2 = 0;
+	rt1 = 0;
+	ct1 = 0;
+	regstate = create_cart_opcode(ky1, ky2, rt1, ct1, frameIndex);
+	regstate = busCommand(regstate, tempBuf);
+
+	extract_cart_opcode(regstate, oregstate);
+	if (oregstate[CART_REG_RT1] != 0) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: failed to write frame %d.", frameIndex);
+		return (-1);
+	}
+	driverStats.writes++;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : zeroCommand
+// Description  : Zeros a cartridge using the cart_io_bus
+//
+// Inputs       : cartIndex - the index of the cart to be zeroed
+// Outputs      : 0 if successful, -1 if failure
+
+int zeroCommand(CartridgeIndex cartIndex) {
+	CartXferRegister regstate = 0x0, ky1, ky2, rt1, ct1, fm1;
+	CartXferRegister oregstate[5];
+
+	if (loadCommand(cartIndex) == -1) {
+		return (-1);
+	}
+
+	ky1 = CART_OP_BZERO;
+	ky2 = 0;
+	rt1 = 0;
+	ct1 = 0;
+	fm1 = 0;
+	regstate = create_cart_opcode(ky1, ky2, rt1, ct1, fm1);
+	regstate = busCommand(regstate, NULL);
+
+	extract_cart_opcode(regstate, oregstate);
+	if (oregstate[CART_REG_RT1] != 0) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: failed to zero cartridge %d.", cartIndex);
+		return (-1);
+	}
+	driverStats.zeroes++;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : readFrame
+// Description  : Reads a frame through the frame cache, going to the
+//                cart_io_bus only on a cache miss
+//
+// Inputs       : cartIndex - the cartridge holding the frame
+//                frameIndex - the index of the frame to be read
+//                tempBuf - a character pointer allocated for the size of one frame.
+//                          contents of frame will be written to address
+// Outputs      : 0 if successful, -1 if failure
+
+int readFrame(CartridgeIndex cartIndex, CartFrameIndex frameIndex, char *tempBuf) {
+	char *cached = get_cart_cache(cartIndex, frameIndex);
+
+	if (cached != NULL) {
+		memcpy(tempBuf, cached, CART_FRAME_SIZE);
+		return (0);
+	}
+	if (loadCommand(cartIndex) == -1) {
+		return (-1);
+	}
+	if (readCommand(frameIndex, tempBuf) == -1) {
+		return (-1);
+	}
+	return (put_cart_cache(cartIndex, frameIndex, tempBuf));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : readFileFrame
+// Description  : Reads the contents of a frame of a file through the frame
+//                cache, expanding it if it is stored compressed
+//
+// Inputs       : location - where the frame of the file is stored
+//                tempBuf - a character pointer allocated for the size of one frame.
+//                          contents of the file frame will be written to address
+// Outputs      : 0 if successful, -1 if failure
+
+int readFileFrame(const struct frame *location, char *tempBuf) {
+	char packed[2 * CART_FRAME_SIZE];
+
+	if (location->packLength == 0) {
+		return (readFrame(location->cartIndex, location->frameIndex, tempBuf));
+	}
+	if (readFrame(location->cartIndex, location->frameIndex, packed) == -1 ||
+			(location->packOffset + location->packLength > CART_FRAME_SIZE &&
+			readFrame(location->cartIndex, location->frameIndex + 1, &packed[CART_FRAME_SIZE]) == -1)) {
+		return (-1);
+	}
+	if (decompress_cart_frame(&packed[location->packOffset], location->packLength, tempBuf) == -1) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: corrupt compressed frame %d/%d.",
+			location->cartIndex, location->frameIndex);
+		return (-1);
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : storeFrame
+// Description  : Writes a frame to the controller, bypassing the cache.  This
+//                is also how the cache writes back dirty frames.
+//
+// Inputs       : cartIndex - the cartridge holding the frame
+//                frameIndex - the index of the frame to be written to
+//                tempBuf - a character pointer allocated for the size of one frame.
+//                          contains the characters to be written
+// Outputs      : 0 if successful, -1 if failure
+
+int storeFrame(CartridgeIndex cartIndex, CartFrameIndex frameIndex, char *tempBuf) {
+	if (loadCommand(cartIndex) == -1) {
+		return (-1);
+	}
+	return (writeCommand(frameIndex, tempBuf));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : writeFrame
+// Description  : Writes a frame and keeps the cached copy of the frame
+//                current.  In write-back mode the controller is only updated
+//                when the frame is flushed or evicted.
+//
+// Inputs       : cartIndex - the cartridge holding the frame
+//                frameIndex - the index of the frame to be written to
+//                tempBuf - a character pointer allocated for the size of one frame.
+//                          contains the characters to be written
+// Outputs      : 0 if successful, -1 if failure
+
+int writeFrame(CartridgeIndex cartIndex, CartFrameIndex frameIndex, char *tempBuf) {
+	if (writeBackMode) {
+		return (dirty_cart_cache(cartIndex, frameIndex, tempBuf));
+	}
+	if (storeFrame(cartIndex, frameIndex, tempBuf) == -1) {
+		return (-1);
+	}
+	return (put_cart_cache(cartIndex, frameIndex, tempBuf));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : initQueue
+// Description  : Empties a bus command queue
+//
+// Inputs       : queue - the queue
+// Outputs      : none
+
+void initQueue(struct busQueue *queue) {
+	queue->length = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : queueFrame
+// Description  : Adds a frame transfer to a bus command queue
+//
+// Inputs       : queue - the queue
+//                op - CART_OP_RDFRME or CART_OP_WRFRME
+//                cartIndex - the cartridge holding the frame
+//                frameIndex - the frame to transfer
+//                buf - frame sized buffer to read into or write from
+// Outputs      : the entry of the request, -1 if the queue is full
+
+int queueFrame(struct busQueue *queue, int op, CartridgeIndex cartIndex, CartFrameIndex frameIndex, char *buf) {
+	struct busRequest *request;
+
+	if (queue->length == CART_QUEUE_DEPTH) {
+		return (-1);
+	}
+	request = &queue->entries[queue->length];
+	request->op = op;
+	request->cartIndex = cartIndex;
+	request->frameIndex = frameIndex;
+	request->buf = buf;
+	request->status = 1;
+	return (queue->length++);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : submitQueue
+// Description  : Issues every request in a bus command queue as one batch.
+//                Requests are grouped by cartridge, the loaded cartridge
+//                first, so each cartridge is loaded at most once.  The sort
+//                is stable, so requests for the same frame keep their order.
+//
+// Inputs       : queue - the queue, each entry's status is set
+// Outputs      : 0 if every request succeeded, -1 if any failed
+
+int submitQueue(struct busQueue *queue) {
+	int order[CART_QUEUE_DEPTH], i, j, key, failed = 0;
+	struct busRequest *request;
+
+	if (queue->length == 0) {
+		return (0);
+	}
+	driverStats.batches++;
+
+	// Insertion sort by cartridge, the loaded cartridge sorting first
+	for (i = 0; i < queue->length; i++) {
+		key = (queue->entries[i].cartIndex == loadedCart) ? -1 : queue->entries[i].cartIndex;
+		for (j = i; j > 0; j--) {
+			request = &queue->entries[order[j - 1]];
+			if (((request->cartIndex == loadedCart) ? -1 : request->cartIndex) <= key) {
+				break;
+			}
+			order[j] = order[j - 1];
+		}
+		order[j] = i;
+	}
+
+	for (i = 0; i < queue->length; i++) {
+		request = &queue->entries[order[i]];
+		if (loadCommand(request->cartIndex) == -1) {
+			request->status = -1;
+		} else if (request->op == CART_OP_RDFRME) {
+			request->status = readCommand(request->frameIndex, request->buf);
+		} else {
+			request->status = writeCommand(request->frameIndex, request->buf);
+		}
+		if (request->status == -1) {
+			failed = 1;
+		}
+	}
+	return (failed ? -1 : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hashPath
+// Description  : Computes the path index bucket of a path (FNV-1a)
+//
+// Inputs       : path - the file path
+// Outputs      : the bucket for the path
+
+unsigned int hashPath(const char *path) {
+	return (cart_hash_string(path) & (CART_PATH_INDEX_SIZE - 1));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : findFile
+// Description  : Looks up the file handle of a path in the path index
+//
+// Inputs       : path - the file path
+// Outputs      : file handle if the file exists, -1 if it does not
+
+int findFile(const char *path) {
+	int fd;
+
+	for (fd = pathIndex[hashPath(path)]; fd != -1; fd = files[fd].nextInBucket) {
+		if (strcmp(files[fd].filePath, path) == 0) {
+			return (fd);
+		}
+	}
+	return (-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : encodeField
+// Description  : Stores a metadata field little endian at a fixed width
+//
+// Inputs       : at - where the field goes
+//                value - the value of the field
+//                width - bytes in the field, at most 4
+// Outputs      : none
+
+void encodeField(char *at, uint32_t value, int width) {
+	for (int i = 0; i < width; i++) {
+		at[i] = (char)(value >> (8 * i));
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : decodeField
+// Description  : Loads a metadata field stored by encodeField
+//
+// Inputs       : at - where the field is
+//                width - bytes in the field, at most 4
+// Outputs      : the value of the field
+
+uint32_t decodeField(const char *at, int width) {
+	uint32_t value = 0;
+
+	for (int i = 0; i < width; i++) {
+		value |= (uint32_t)(unsigned char)at[i] << (8 * i);
+	}
+	return (value);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : putMetaBytes
+// Description  : Appends bytes to the file table being serialized, growing
+//                it as needed
+//
+// Inputs       : meta - the file table
+//                bytes - the bytes to append
+//                length - the number of bytes
+// Outputs      : 0 if successful, -1 if failure
+
+int putMetaBytes(struct metaBuffer *meta, const void *bytes, uint32_t length) {
+	uint32_t capacity;
+	char *grown;
+
+	if (length > meta->capacity - meta->length) {
+		capacity = (meta->capacity == 0) ? CART_FRAME_SIZE * 8 : meta->capacity;
+		while (length > capacity - meta->length) {
+			capacity *= 2;
+		}
+		grown = realloc(meta->data, capacity);
+		if (grown == NULL) {
+			logMessage(LOG_ERROR_LEVEL, "CART driver failed: unable to allocate metadata buffer.");
+			return (-1);
+		}
+		meta->data = grown;
+		meta->capacity = capacity;
+	}
+	memcpy(&meta->data[meta->length], bytes, length);
+	meta->length += length;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : putMetaField
+// Description  : Appends a fixed width field to the file table being serialized
+//
+// Inputs       : meta - the file table
+//                value - the value of the field
+//                width - bytes in the field, at most 4
+// Outputs      : 0 if successful, -1 if failure
+
+int putMetaField(struct metaBuffer *meta, uint32_t value, int width) {
+	char field[sizeof(uint32_t)];
+
+	encodeField(field, value, width);
+	return (putMetaBytes(meta, field, width));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : getMetaBytes
+// Description  : Takes the next bytes of the file table being read back
+//
+// Inputs       : meta - the file table
+//                bytes - where the bytes go
+//                length - the number of bytes
+// Outputs      : 0 if successful, -1 if the table ends first
+
+int getMetaBytes(struct metaBuffer *meta, void *bytes, uint32_t length) {
+	if (length > meta->capacity - meta->length) {
+		return (-1);
+	}
+	memcpy(bytes, &meta->data[meta->length], length);
+	meta->length += length;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : getMetaField
+// Description  : Takes the next fixed width field of the file table being
+//                read back
+//
+// Inputs       : meta - the file table
+//                value - set to the value of the field
+//                width - bytes in the field, at most 4
+// Outputs      : 0 if successful, -1 if the table ends first
+
+int getMetaField(struct metaBuffer *meta, uint32_t *value, int width) {
+	char field[sizeof(uint32_t)];
+
+	if (getMetaBytes(meta, field, width) == -1) {
+		return (-1);
+	}
+	*value = decodeField(field, width);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : serializeFile
+// Description  : Appends a file's record, path and extents to the file table
+//
+// Inputs       : meta - the file table
+//                fd - the file handle
+// Outputs      : 0 if successful, -1 if failure
+
+int serializeFile(struct metaBuffer *meta, int fd) {
+	struct extent *ext;
+	uint32_t pathLength = strlen(files[fd].filePath);
+
+	if (putMetaField(meta, fd, 4) == -1 || putMetaField(meta, files[fd].endPosition, 4) == -1 ||
+			putMetaField(meta, files[fd].numberOfExtents, 4) == -1 ||
+			putMetaField(meta, pathLength, 2) == -1 ||
+			putMetaBytes(meta, files[fd].filePath, pathLength) == -1) {
+		return (-1);
+	}
+	for (int i = 0; i < files[fd].numberOfExtents; i++) {
+		ext = &files[fd].extents[i];
+		if (putMetaField(meta, ext->fileFrame, 4) == -1 || putMetaField(meta, ext->cartIndex, 2) == -1 ||
+				putMetaField(meta, ext->frameIndex, 2) == -1 || putMetaField(meta, ext->length, 4) == -1 ||
+				putMetaField(meta, ext->packOffset, 2) == -1 || putMetaField(meta, ext->packEnds != NULL, 2) == -1) {
+			return (-1);
+		}
+		for (int run = 0; ext->packEnds != NULL && run < ext->length; run++) {
+			if (putMetaField(meta, ext->packEnds[run] - ((run > 0) ? ext->packEnds[run - 1] : 0), 2) == -1) {
+				return (-1);
+			}
+		}
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : claimChainFrame
+// Description  : Claims a free frame to continue the file table in, next to
+//                the previous one of the chain when possible
+//
+// Inputs       : location - set to the frame claimed
+//                previous - the previous frame of the chain, NULL if none
+// Outputs      : 0 if successful, -1 if there are no free frames
+
+int claimChainFrame(struct frame *location, const struct frame *previous) {
+	int frameIndex;
+
+	if (previous != NULL) {
+		frameIndex = findFreeFrame(previous->cartIndex, previous->frameIndex + 1);
+		if (frameIndex != -1) {
+			location->cartIndex = previous->cartIndex;
+			location->frameIndex = frameIndex;
+			claimFrame(location->cartIndex, location->frameIndex);
+			return (0);
+		}
+	}
+	if (pickCartridge(location) == -1) {
+		return (-1);
+	}
+	claimFrame(location->cartIndex, location->frameIndex);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : queueMetaFrame
+// Description  : Adds a metadata frame transfer to a queue, first issuing the
+//                queue if it is full
+//
+// Inputs       : queue - the queue
+//                op - CART_OP_RDFRME or CART_OP_WRFRME
+//                cartIndex - the cartridge holding the frame
+//                frameIndex - the frame to transfer
+//                buf - frame sized buffer to read into or write from
+// Outputs      : 0 if successful, -1 if failure
+
+int queueMetaFrame(struct busQueue *queue, int op, CartridgeIndex cartIndex, CartFrameIndex frameIndex, char *buf) {
+	if (queue->length == CART_QUEUE_DEPTH) {
+		if (submitQueue(queue) == -1) {
+			return (-1);
+		}
+		initQueue(queue);
+	}
+	queueFrame(queue, op, cartIndex, frameIndex, buf);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : saveMetadata
+// Description  : Writes the file table to the metadata frames, chaining on
+//                through free frames once the reserved ones are full, and
+//                then the superblock.  If the table cannot be placed the
+//                superblock is cleared, so that a mount fails rather than
+//                reading back a table that no longer matches the frames.
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int saveMetadata(void) {
+	struct metaBuffer meta = { NULL, 0, 0 };
+	struct busQueue queue;
+	struct frame *chain = NULL;
+	char *frames, *image;
+	uint32_t reserved, chained = 0, copied, length;
+	int fd, i, status = 0;
+
+	// Serialize each file, its path and then its extents
+	for (fd = 0; fd < numberOfFiles; fd++) {
+		if (files[fd].filePath[0] != '\0' && serializeFile(&meta, fd) == -1) {
+			free(meta.data);
+			return (-1);
+		}
+	}
+
+	// Lay the table out over the reserved frames and then the chain
+	reserved = (meta.length + CART_FRAME_SIZE - 1) / CART_FRAME_SIZE;
+	if (meta.length > CART_META_RESERVED_BYTES) {
+		reserved = CART_META_FRAMES - 1;
+		chained = (meta.length - CART_META_RESERVED_BYTES + CART_META_CHAINED_BYTES - 1) / CART_META_CHAINED_BYTES;
+		chain = malloc(chained * sizeof(struct frame));
+	}
+	frames = calloc(1 + reserved + chained, CART_FRAME_SIZE);
+	if (frames == NULL || (chained > 0 && chain == NULL)) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: unable to allocate metadata buffer.");
+		free(meta.data);
+		free(chain);
+		free(frames);
+		return (-1);
+	}
+	for (i = 0; i < chained; i++) {
+		if (claimChainFrame(&chain[i], (i > 0) ? &chain[i - 1] : NULL) == -1) {
+			logMessage(LOG_ERROR_LEVEL, "CART driver failed: no free frames left for the file table.");
+			chained = 0;
+			status = -1;
+			break;
+		}
+	}
+
+	if (status == 0) {
+		copied = (meta.length < CART_META_RESERVED_BYTES) ? meta.length : CART_META_RESERVED_BYTES;
+		if (copied > 0) {
+			memcpy(&frames[CART_FRAME_SIZE], meta.data, copied);
+		}
+		for (i = 0; i < chained; i++) {
+			image = &frames[(1 + reserved + i) * CART_FRAME_SIZE];
+			encodeField(image, (i + 1 < chained) ?
+				CART_FRAME_ID(chain[i + 1].cartIndex, chain[i + 1].frameIndex) : CART_META_NO_FRAME, CART_META_LINK);
+			length = meta.length - copied;
+			if (length > CART_META_CHAINED_BYTES) {
+				length = CART_META_CHAINED_BYTES;
+			}
+			memcpy(&image[CART_META_LINK], &meta.data[copied], length);
+			copied += length;
+		}
+
+		// Superblock, which only names the table once every frame of it is written
+		encodeField(&frames[0], CART_META_MAGIC, 4);
+		encodeField(&frames[4], CART_META_VERSION, 4);
+		encodeField(&frames[8], meta.length, 4);
+		encodeField(&frames[12], numberOfFiles, 4);
+		encodeField(&frames[16], (chained > 0) ?
+			CART_FRAME_ID(chain[0].cartIndex, chain[0].frameIndex) : CART_META_NO_FRAME, 4);
+	}
+
+	initQueue(&queue);
+	for (i = 0; status == 0 && i < reserved + chained; i++) {
+		if (i < reserved) {
+			status = queueMetaFrame(&queue, CART_OP_WRFRME, CART_META_CART, 1 + i, &frames[(1 + i) * CART_FRAME_SIZE]);
+		} else {
+			status = queueMetaFrame(&queue, CART_OP_WRFRME, chain[i - reserved].cartIndex,
+				chain[i - reserved].frameIndex, &frames[(1 + i) * CART_FRAME_SIZE]);
+		}
+	}
+	if (status == 0 && submitQueue(&queue) == -1) {
+		status = -1;
+	}
+	if (status == -1) {
+		memset(frames, 0x0, CART_FRAME_SIZE);	// Leave no superblock naming a partial table
+	}
+	initQueue(&queue);
+	queueFrame(&queue, CART_OP_WRFRME, CART_META_CART, 0, frames);
+	if (submitQueue(&queue) == -1) {
+		status = -1;
+	}
+	free(meta.data);
+	free(chain);
+	free(frames);
+	return (status);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : restoreFile
+// Description  : Rebuilds a file from its record, path and extents in the
+//                file table, marking the frames it uses as allocated
+//
+// Inputs       : meta - the file table, positioned at the record
+// Outputs      : 0 if successful, -1 if the record is corrupt or failure
+
+int restoreFile(struct metaBuffer *meta) {
+	struct extent *ext;
+	struct frame location;
+	uint32_t fd, endPosition, numberOfExtents, pathLength, value[6], packLength;
+	int i, run, frames, frame, low, high, bucket;
+
+	if (getMetaField(meta, &fd, 4) == -1 || getMetaField(meta, &endPosition, 4) == -1 ||
+			getMetaField(meta, &numberOfExtents, 4) == -1 || getMetaField(meta, &pathLength, 2) == -1 ||
+			fd >= numberOfFiles || files[fd].filePath[0] != '\0' || pathLength == 0 ||
+			pathLength >= CART_MAX_PATH_LENGTH || endPosition > INT32_MAX ||
+			numberOfExtents > (meta->capacity - meta->length) / CART_META_EXTENT_BYTES ||
+			getMetaBytes(meta, files[fd].filePath, pathLength) == -1) {
+		return (-1);
+	}
+	files[fd].filePath[pathLength] = '\0';
+	files[fd].endPosition = endPosition;
+	if (numberOfExtents > 0) {
+		files[fd].extents = malloc(numberOfExtents * sizeof(struct extent));
+		if (files[fd].extents == NULL) {
+			logMessage(LOG_ERROR_LEVEL, "CART driver failed: unable to allocate extent list.");
+			return (-1);
+		}
+		files[fd].extentCapacity = numberOfExtents;
+	}
+
+	// Mark its frames as in use, their cartridges must not be zeroed.  Each
+	// compressed frame uses every frame it is packed in.
+	for (i = 0; i < numberOfExtents; i++) {
+		if (getMetaField(meta, &value[0], 4) == -1 || getMetaField(meta, &value[1], 2) == -1 ||
+				getMetaField(meta, &value[2], 2) == -1 || getMetaField(meta, &value[3], 4) == -1 ||
+				getMetaField(meta, &value[4], 2) == -1 || getMetaField(meta, &value[5], 2) == -1) {
+			return (-1);
+		}
+		ext = &files[fd].extents[files[fd].numberOfExtents++];
+		ext->packEnds = NULL;
+		if (value[0] > INT32_MAX || value[1] >= CART_MAX_CARTRIDGES || value[3] == 0 || value[5] > 1 ||
+				(value[5] == 0 && value[3] > CART_CARTRIDGE_SIZE) || (value[5] == 1 &&
+				(value[3] > (meta->capacity - meta->length) / 2 || value[4] >= CART_FRAME_SIZE))) {
+			logMessage(LOG_ERROR_LEVEL, "CART driver failed: corrupt extent in [%s].", files[fd].filePath);
+			return (-1);
+		}
+		ext->fileFrame = value[0];
+		ext->cartIndex = value[1];
+		ext->frameIndex = value[2];
+		ext->length = value[3];
+		ext->packOffset = value[4];
+		if (value[5] == 1) {
+			if ((ext->packEnds = malloc(sizeof(uint32_t) * packEndsCapacity(ext->length))) == NULL) {
+				logMessage(LOG_ERROR_LEVEL, "CART driver failed: unable to allocate compressed run.");
+				return (-1);
+			}
+			for (run = 0; run < ext->length; run++) {
+				if (getMetaField(meta, &packLength, 2) == -1) {
+					return (-1);
+				}
+				ext->packEnds[run] = packLength + ((run > 0) ? ext->packEnds[run - 1] : 0);
+				if (packLength == 0 || packLength > CART_PACK_LIMIT ||
+						ext->packEnds[run] > CART_CARTRIDGE_SIZE * CART_FRAME_SIZE) {
+					logMessage(LOG_ERROR_LEVEL, "CART driver failed: corrupt extent in [%s].", files[fd].filePath);
+					return (-1);
+				}
+			}
+		}
+		if (ext->frameIndex + extentFrames(ext) > CART_CARTRIDGE_SIZE) {
+			logMessage(LOG_ERROR_LEVEL, "CART driver failed: corrupt extent in [%s].", files[fd].filePath);
+			return (-1);
+		}
+		extentTableBytes += runTableBytes(ext);
+		if (ext->packEnds != NULL && allocatePackTables() == -1) {
+			return (-1);
+		}
+
+		for (run = 0; run < ext->length; run++) {
+			location.cartIndex = ext->cartIndex;
+			location.frameIndex = ext->frameIndex + run;
+			location.packOffset = 0;
+			location.packLength = CART_FRAME_SIZE;
+			if (ext->packEnds != NULL) {
+				locatePacked(ext, run, &location);
+			}
+			for (frames = 0; location.packOffset + location.packLength > frames * CART_FRAME_SIZE; frames++) {
+				frame = location.frameIndex + frames;
+				if (frameInUse(ext->cartIndex, frame)) {
+					if (allocateShares() == -1) {
+						return (-1);
+					}
+					frameShares[ext->cartIndex][frame]++;	// Shared or packed
+				} else {
+					claimFrame(ext->cartIndex, frame);
+				}
+				if (ext->packEnds != NULL) {
+					// The bytes of the compressed frame packed in this frame
+					low = (frames == 0) ? location.packOffset : CART_FRAME_SIZE;
+					high = location.packOffset + location.packLength;
+					if (high > (frames + 1) * CART_FRAME_SIZE) {
+						high = (frames + 1) * CART_FRAME_SIZE;
+					}
+					packLive[ext->cartIndex][frame] += high - low;
+				}
+			}
+		}
+		cartState[ext->cartIndex] = CART_STATE_ZEROED;
+	}
+
+	bucket = hashPath(files[fd].filePath);
+	files[fd].nextInBucket = pathIndex[bucket];
+	pathIndex[bucket] = fd;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : loadMetadata
+// Description  : Reads the superblock and file table back from the metadata
+//                frames and the chain following them, and rebuilds the file
+//                table, path index and free space bitmap from them
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int loadMetadata(void) {
+	struct superblock super;
+	struct metaBuffer meta = { NULL, 0, 0 };
+	struct busQueue queue;
+	char frame[CART_FRAME_SIZE];
+	uint32_t reserved, copied, length, next;
+	int fd, i;
+
+	// Check the superblock before reading any further
+	if (loadCommand(CART_META_CART) == -1 || readCommand(0, frame) == -1) {
+		return (-1);
+	}
+	super.magic = decodeField(&frame[0], 4);
+	super.version = decodeField(&frame[4], 4);
+	super.tableLength = decodeField(&frame[8], 4);
+	super.numberOfFiles = decodeField(&frame[12], 4);
+	super.chainFrame = decodeField(&frame[16], 4);
+	if (super.magic != CART_META_MAGIC || super.version != CART_META_VERSION) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: no filesystem to mount (magic %08x, version %u).",
+			super.magic, super.version);
+		return (-1);
+	}
+	if (super.tableLength > CART_META_RESERVED_BYTES +
+			(uint32_t)CART_MAX_CARTRIDGES * CART_CARTRIDGE_SIZE * CART_META_CHAINED_BYTES ||
+			super.numberOfFiles > CART_MAX_TOTAL_FILES) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: corrupt superblock.");
+		return (-1);
+	}
+
+	// The reserved frames are read in batches, the chain a frame at a time
+	reserved = (super.tableLength + CART_FRAME_SIZE - 1) / CART_FRAME_SIZE;
+	if (reserved > CART_META_FRAMES - 1) {
+		reserved = CART_META_FRAMES - 1;
+	}
+	length = reserved * CART_FRAME_SIZE;
+	meta.data = malloc(((length > super.tableLength) ? length : super.tableLength) + 1);
+	if (meta.data == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: unable to allocate metadata buffer.");
+		return (-1);
+	}
+	initQueue(&queue);
+	for (i = 0; i < reserved; i++) {
+		if (queueMetaFrame(&queue, CART_OP_RDFRME, CART_META_CART, 1 + i, &meta.data[i * CART_FRAME_SIZE]) == -1) {
+			free(meta.data);
+			return (-1);
+		}
+	}
+	if (submitQueue(&queue) == -1) {
+		free(meta.data);
+		return (-1);
+	}
+	copied = reserved * CART_FRAME_SIZE;
+	for (next = super.chainFrame; copied < super.tableLength; next = decodeField(frame, CART_META_LINK)) {
+		if (next >= CART_MAX_CARTRIDGES * CART_CARTRIDGE_SIZE ||
+				(next / CART_CARTRIDGE_SIZE == CART_META_CART && next % CART_CARTRIDGE_SIZE < CART_META_FRAMES)) {
+			logMessage(LOG_ERROR_LEVEL, "CART driver failed: corrupt file table chain.");
+			free(meta.data);
+			return (-1);
+		}
+		if (loadCommand(next / CART_CARTRIDGE_SIZE) == -1 || readCommand(next % CART_CARTRIDGE_SIZE, frame) == -1) {
+			free(meta.data);
+			return (-1);
+		}
+		length = super.tableLength - copied;
+		if (length > CART_META_CHAINED_BYTES) {
+			length = CART_META_CHAINED_BYTES;
+		}
+		memcpy(&meta.data[copied], &frame[CART_META_LINK], length);
+		copied += length;
+	}
+	meta.capacity = super.tableLength;
+
+	// Rebuild each file from its record
+	numberOfFiles = super.numberOfFiles;
+	while (meta.length < meta.capacity) {
+		if (restoreFile(&meta) == -1) {
+			logMessage(LOG_ERROR_LEVEL, "CART driver failed: corrupt file table.");
+			free(meta.data);
+			return (-1);
+		}
+	}
+	free(meta.data);
+
+	// Handles below the high water mark without a file were deleted
+	for (fd = numberOfFiles - 1; fd >= 0; fd--) {
+		if (files[fd].filePath[0] == '\0') {
+			freeHandles[numberOfFreeHandles++] = fd;
+		}
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : checkFileHandle
+// Description  : Determines whether the file handle is invalid or closed
+//
+// Inputs       : fd - the file handle
+// Outputs      : 0 if file handle is valid, -1 if it is invalid
+
+int checkFileHandle(int16_t fd) {
+	// Invalid file handle
+	if (fd < 0 || fd >= CART_MAX_TOTAL_FILES) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: bad file handle.");
+		return (-1);
+	}
+	// If file was already closed
+	if (files[fd].openFlag == 0) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: file is closed.");
+		return (-1);
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lockFile
+// Description  : Takes a file's lock, then checks the handle is still open
+//
+// Inputs       : fd - the file handle
+// Outputs      : 0 with the lock held if successful, -1 if failure
+
+int lockFile(int16_t fd) {
+	if (fd < 0 || fd >= CART_MAX_TOTAL_FILES) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: bad file handle.");
+		return (-1);
+	}
+	pthread_mutex_lock(&files[fd].lock);
+	if (checkFileHandle(fd) == -1) {
+		pthread_mutex_unlock(&files[fd].lock);
+		return (-1);
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : vectorLength
+// Description  : Totals the lengths of an I/O vector
+//
+// Inputs       : iov - the buffers
+//                iovcnt - number of buffers
+// Outputs      : total length in bytes, -1 if the vector is invalid
+
+int32_t vectorLength(const struct iovec *iov, int iovcnt) {
+	int64_t total = 0;
+
+	if (iovcnt < 0 || (iovcnt > 0 && iov == NULL)) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: bad I/O vector.");
+		return (-1);
+	}
+	for (int i = 0; i < iovcnt; i++) {
+		total += iov[i].iov_len;
+		if ((int32_t)iov[i].iov_len < 0 || total > INT32_MAX) {
+			logMessage(LOG_ERROR_LEVEL, "CART driver failed: I/O vector too long.");
+			return (-1);
+		}
+	}
+	return ((int32_t)total);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : gatherBytes
+// Description  : Copies the next bytes of an I/O vector out to a buffer
+//
+// Inputs       : cursor - position in the vector, advanced past the bytes
+//                dst - buffer to copy to
+//                length - number of bytes to copy
+// Outputs      : none
+
+void gatherBytes(struct ioCursor *cursor, char *dst, int length) {
+	int chunk;
+
+	while (length > 0) {
+		chunk = cursor->iov[cursor->index].iov_len - cursor->offset;
+		if (chunk > length) {
+			chunk = length;
+		}
+		memcpy(dst, (char *)cursor->iov[cursor->index].iov_base + cursor->offset, chunk);
+		dst += chunk;
+		length -= chunk;
+		cursor->offset += chunk;
+		if (cursor->offset == cursor->iov[cursor->index].iov_len) {
+			cursor->index++;
+			cursor->offset = 0;
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : scatterBytes
+// Description  : Copies bytes from a buffer into the next bytes of an I/O
+//                vector
+//
+// Inputs       : cursor - position in the vector, advanced past the bytes
+//                src - buffer to copy from
+//                length - number of bytes to copy
+// Outputs      : none
+
+void scatterBytes(struct ioCursor *cursor, const char *src, int length) {
+	int chunk;
+
+	while (length > 0) {
+		chunk = cursor->iov[cursor->index].iov_len - cursor->offset;
+		if (chunk > length) {
+			chunk = length;
+		}
+		memcpy((char *)cursor->iov[cursor->index].iov_base + cursor->offset, src, chunk);
+		src += chunk;
+		length -= chunk;
+		cursor->offset += chunk;
+		if (cursor->offset == cursor->iov[cursor->index].iov_len) {
+			cursor->index++;
+			cursor->offset = 0;
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : frameIsZero
+// Description  : Checks whether a frame holds nothing but zeros
+//
+// Inputs       : frame - the frame (CART_FRAME_SIZE bytes)
+// Outputs      : 1 if every byte is zero, 0 otherwise
+
+int frameIsZero(const char *frame) {
+	// Each byte equals the next and the first is zero
+	return (frame[0] == 0 && memcmp(frame, frame + 1, CART_FRAME_SIZE - 1) == 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : directBytes
+// Description  : Finds whether the next bytes of an I/O vector lie in one
+//                buffer, so a frame can be transferred there without staging
+//
+// Inputs       : cursor - position in the vector, advanced past the bytes
+//                length - number of bytes to take
+// Outputs      : the caller memory for the bytes, NULL if they span buffers
+
+char *directBytes(struct ioCursor *cursor, int length) {
+	char *dst = NULL;
+	int chunk;
+
+	if (cursor->index < cursor->iovcnt && cursor->iov[cursor->index].iov_len - cursor->offset >= (size_t)length) {
+		dst = (char *)cursor->iov[cursor->index].iov_base + cursor->offset;
+	}
+	while (length > 0) {
+		chunk = cursor->iov[cursor->index].iov_len - cursor->offset;
+		if (chunk > length) {
+			chunk = length;
+		}
+		length -= chunk;
+		cursor->offset += chunk;
+		if (cursor->offset == cursor->iov[cursor->index].iov_len) {
+			cursor->index++;
+			cursor->offset = 0;
+		}
+	}
+	return (dst);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : allocateStaging
+// Description  : Makes sure a file has the frames its reads and writes are
+//                staged in, allocating them the first time they are needed
+//
+// Inputs       : fd - the file handle
+// Outputs      : 0 if successful, -1 if failure
+
+int allocateStaging(int fd) {
+	if (files[fd].staging == NULL) {
+		files[fd].staging = malloc(CART_QUEUE_DEPTH * CART_FRAME_SIZE);
+		if (files[fd].staging == NULL) {
+			logMessage(LOG_ERROR_LEVEL, "CART driver failed: unable to allocate staging frames.");
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : allocatePacking
+// Description  : Makes sure a file has the buffers its compressed frames are
+//                packed in, allocating them the first time they are needed
+//
+// Inputs       : fd - the file handle
+// Outputs      : 0 if successful, -1 if failure
+
+int allocatePacking(int fd) {
+	if (files[fd].packing == NULL) {
+		files[fd].packing = malloc(sizeof(struct packStaging));
+		if (files[fd].packing == NULL) {
+			logMessage(LOG_ERROR_LEVEL, "CART driver failed: unable to allocate packing frames.");
+			return (-1);
+		}
+		files[fd].packing->numberFilled = 0;
+		files[fd].packing->openChanged = 0;
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : findPending
+// Description  : Finds the buffered writes to a frame of a file
+//
+// Inputs       : fd - the file handle
+//                fileFrame - index of the frame within the file
+// Outputs      : the buffered frame, NULL if nothing is buffered for it
+
+struct pendingWrite *findPending(int fd, int fileFrame) {
+	for (int i = 0; i < files[fd].numberOfPending; i++) {
+		if (files[fd].pending[i].fileFrame == fileFrame) {
+			return (&files[fd].pending[i]);
+		}
+	}
+	return (NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : readAhead
+// Description  : Follows the reads of a file and, while they are sequential,
+//                fetches the frames after them on the same cartridge into
+//                the cache.  The window doubles each time the reader gets
+//                halfway through the frames already fetched.  Called with
+//                the bus lock held.
+//
+// Inputs       : fd - the file handle
+//                position - offset in the file the read started at
+//                bytes - number of bytes read
+// Outputs      : 0 if successful, -1 if failure
+
+int readAhead(int fd, uint32_t position, int bytes) {
+	struct busQueue queue;
+	struct frame location, fetched[CART_READAHEAD_MAX];
+	struct pendingWrite *pending;
+	char (*frames)[CART_FRAME_SIZE] = files[fd].staging;	// Set up by readFile
+	int lastFrame, fileFrame, endFrame, window, limit, runLength, touched, n, i;
+	CartridgeIndex cartIndex;
+
+	// A read anywhere but where the last one stopped ends the stream
+	if (position != files[fd].readAheadNext) {
+		files[fd].readAheadNext = position + bytes;
+		files[fd].readAheadWindow = 0;
+		files[fd].readAheadFrame = 0;
+		return (0);
+	}
+	files[fd].readAheadNext = position + bytes;
+
+	// Keep the window to a quarter of the cache so it cannot evict itself
+	limit = get_cart_cache_size() / 4;
+	if (limit > CART_READAHEAD_MAX) {
+		limit = CART_READAHEAD_MAX;
+	}
+	lastFrame = (position + bytes - 1) / CART_FRAME_SIZE;
+	if (bytes == 0 || limit == 0 || files[fd].readAheadFrame - lastFrame > files[fd].readAheadWindow / 2) {
+		return (0);
+	}
+	window = (files[fd].readAheadWindow == 0) ? CART_READAHEAD_MIN : files[fd].readAheadWindow * 2;
+	if (window > limit) {
+		window = limit;
+	}
+	files[fd].readAheadWindow = window;
+
+	// Fetch the uncached frames past the read, stopping at another cartridge.
+	// A new frame in the write buffer is all there, the controller holds zeros.
+	// Compressed frames packed together are fetched once.
+	fileFrame = lastFrame + 1;
+	if (fileFrame < files[fd].readAheadFrame) {
+		fileFrame = files[fd].readAheadFrame;
+	}
+	endFrame = (files[fd].endPosition + CART_FRAME_SIZE - 1) / CART_FRAME_SIZE;
+	if (endFrame > lastFrame + 1 + window) {
+		endFrame = lastFrame + 1 + window;
+	}
+	if (mapFrame(fd, lastFrame, &location) == -1) {
+		return (0);	// Ended in a hole, nothing to follow
+	}
+	cartIndex = location.cartIndex;
+	initQueue(&queue);
+	for (n = 0, runLength = 0; fileFrame < endFrame && n < CART_READAHEAD_MAX; fileFrame++) {
+		if (runLength == 0) {
+			runLength = mapFrame(fd, fileFrame, &location);
+			if (runLength == -1) {
+				runLength = 0;	// A hole, nothing to fetch
+				continue;
+			}
+			if (location.cartIndex != cartIndex) {
+				break;
+			}
+		}
+		pending = findPending(fd, fileFrame);
+		touched = (location.packOffset + location.packLength > CART_FRAME_SIZE) ? 2 : 1;
+		for (i = 0; i < touched && n < CART_READAHEAD_MAX && (pending == NULL || !pending->whole); i++) {
+			if (get_cart_cache(location.cartIndex, location.frameIndex + i) == NULL && (n == 0 ||
+					fetched[n - 1].cartIndex != location.cartIndex || fetched[n - 1].frameIndex != location.frameIndex + i)) {
+				fetched[n] = location;
+				fetched[n].frameIndex += i;
+				queueFrame(&queue, CART_OP_RDFRME, fetched[n].cartIndex, fetched[n].frameIndex, frames[n]);
+				n++;
+			}
+		}
+		location.frameIndex++;
+		runLength--;
+	}
+	files[fd].readAheadFrame = fileFrame;
+	if (n == 0) {
+		return (0);
+	}
+	if (submitQueue(&queue) == -1) {
+		return (-1);
+	}
+	driverStats.readAheads += n;
+	for (i = 0; i < n; i++) {
+		if (put_cart_cache(fetched[i].cartIndex, fetched[i].frameIndex, frames[i]) == -1) {
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : readFile
+// Description  : Reads from a file at a position into an I/O vector, taking
+//                each frame the request touches once. Whole frames that land
+//                in one caller buffer are read straight into it, only the
+//                partial head and tail frames go through a staging frame
+//
+// Inputs       : fd - the file handle
+//                position - offset in the file to read from
+//                iov - the buffers to fill, in order
+//                iovcnt - number of buffers
+// Outputs      : bytes read if successful, -1 if failure
+
+int32_t readFile(int fd, uint32_t position, const struct iovec *iov, int iovcnt) {
+	struct ioCursor cursor = { iov, iovcnt, 0, 0 }, target;
+	struct busQueue queue;
+	struct framePlan plan[CART_QUEUE_DEPTH];
+	struct pendingWrite *pending;
+	char (*frames)[CART_FRAME_SIZE];
+	char *dst;
+	int hole, count, bytesToRead, bytesRead, planned, offset, runLength, n, i;
+	struct frame location, stored;
+	char *cached;
+
+	count = vectorLength(iov, iovcnt);
+	if (count == -1 || allocateStaging(fd) == -1) {
+		return (-1);
+	}
+	frames = files[fd].staging;
+
+	// Stop at the end of file
+	bytesToRead = 0;
+	if (position < files[fd].endPosition) {
+		bytesToRead = files[fd].endPosition - position;
+	}
+	if (count < bytesToRead) {
+		bytesToRead = count;
+	}
+
+	bytesRead = 0;
+	runLength = 0;
+	while (bytesRead < bytesToRead) {
+		// Plan a batch of frames, queueing reads for those not in the cache.
+		// Holes and new frames in the write buffer read as zeros.
+		pthread_mutex_lock(&busLock);
+		initQueue(&queue);
+		target = cursor;
+		for (n = 0, planned = 0; n < CART_QUEUE_DEPTH && bytesRead + planned < bytesToRead; n++) {
+			offset = position + bytesRead + planned;
+			hole = 0;
+			if (runLength == 0 && (runLength = mapFrame(fd, offset / CART_FRAME_SIZE, &location)) == -1) {
+				runLength = 0;
+				hole = 1;
+			}
+			if (!hole) {
+				stored = location;
+				plan[n].cartIndex = location.cartIndex;
+				plan[n].frameIndex = location.frameIndex++;
+				runLength--;
+			}
+			plan[n].positionInFrame = offset % CART_FRAME_SIZE;
+			plan[n].bytes = CART_FRAME_SIZE - plan[n].positionInFrame;
+			if (plan[n].bytes > bytesToRead - bytesRead - planned) {
+				plan[n].bytes = bytesToRead - bytesRead - planned;
+			}
+			planned += plan[n].bytes;
+
+			// A whole frame in one buffer skips the staging frame
+			plan[n].direct = directBytes(&target, plan[n].bytes);
+			if (plan[n].bytes != CART_FRAME_SIZE) {
+				plan[n].direct = NULL;
+			}
+			dst = (plan[n].direct != NULL) ? plan[n].direct : frames[n];
+
+			plan[n].entry = -1;
+			pending = findPending(fd, offset / CART_FRAME_SIZE);
+			if (hole || (pending != NULL && pending->whole)) {
+				memset(dst, 0x0, CART_FRAME_SIZE);
+			} else if (stored.packLength != 0) {
+				// A compressed frame is expanded from the frames holding it
+				if (readFileFrame(&stored, dst) == -1) {
+					pthread_mutex_unlock(&busLock);
+					return (-1);
+				}
+			} else if ((cached = get_cart_cache(plan[n].cartIndex, plan[n].frameIndex)) != NULL) {
+				memcpy(dst, cached, CART_FRAME_SIZE);
+			} else {
+				plan[n].entry = queueFrame(&queue, CART_OP_RDFRME, plan[n].cartIndex, plan[n].frameIndex, dst);
+			}
+		}
+		if (submitQueue(&queue) == -1) {
+			pthread_mutex_unlock(&busLock);
+			return (-1);
+		}
+
+		// Keep what was read, then copy the staged bytes out in order
+		for (i = 0; i < n; i++) {
+			if (plan[i].entry != -1 && put_cart_cache(plan[i].cartIndex, plan[i].frameIndex, (plan[i].direct != NULL) ? plan[i].direct : frames[i]) == -1) {
+				pthread_mutex_unlock(&busLock);
+				return (-1);
+			}
+		}
+		pthread_mutex_unlock(&busLock);
+		for (i = 0; i < n; i++) {
+			// Buffered writes are newer than what the controller holds
+			dst = (plan[i].direct != NULL) ? plan[i].direct : frames[i];
+			pending = findPending(fd, (position + bytesRead) / CART_FRAME_SIZE + i);
+			if (pending != NULL) {
+				memcpy(&dst[pending->low], &pending->data[pending->low], pending->high - pending->low);
+			}
+			if (plan[i].direct != NULL) {
+				directBytes(&cursor, plan[i].bytes);
+			} else {
+				scatterBytes(&cursor, &frames[i][plan[i].positionInFrame], plan[i].bytes);
+			}
+		}
+		bytesRead += planned;
+	}
+
+	// Fetch ahead of a sequential reader, the read itself has already succeeded
+	pthread_mutex_lock(&busLock);
+	readAhead(fd, position, bytesRead);
+	pthread_mutex_unlock(&busLock);
+
+	// Return successfully
+	return (bytesRead);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : flushStores
+// Description  : Issues the frame writes gathered in a bus command queue and
+//                caches the frames written, leaving the queue empty.  Called
+//                with the bus lock held.
+//
+// Inputs       : queue - the queue of writes
+// Outputs      : 0 if successful, -1 if failure
+
+int flushStores(struct busQueue *queue) {
+	if (submitQueue(queue) == -1) {
+		return (-1);
+	}
+	for (int i = 0; i < queue->length; i++) {
+		if (put_cart_cache(queue->entries[i].cartIndex, queue->entries[i].frameIndex, queue->entries[i].buf) == -1) {
+			return (-1);
+		}
+	}
+	initQueue(queue);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : queueStore
+// Description  : Writes a frame in the current write mode, holding it dirty
+//                in the cache with write back on, otherwise gathering it in
+//                a bus command queue, which is issued whenever it fills.
+//                Called with the bus lock held.
+//
+// Inputs       : queue - the queue of writes
+//                cartIndex - the cartridge holding the frame
+//                frameIndex - the frame to write
+//                buf - its new contents, unchanged until the queue is issued
+// Outputs      : 0 if successful, -1 if failure
+
+int queueStore(struct busQueue *queue, CartridgeIndex cartIndex, CartFrameIndex frameIndex, char *buf) {
+	if (writeBackMode) {
+		return (dirty_cart_cache(cartIndex, frameIndex, buf));
+	}
+	if (queue->length == CART_QUEUE_DEPTH && flushStores(queue) == -1) {
+		return (-1);
+	}
+	queueFrame(queue, CART_OP_WRFRME, cartIndex, frameIndex, buf);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : storeFrames
+// Description  : Stores the new contents of frames of a file.  A frame left
+//                all zero becomes a hole when sparse files are on.  With
+//                deduplication on, a frame matching one already stored, whole
+//                or compressed, is pointed at it instead of written.  With
+//                compression on, a frame that compresses well is packed after
+//                the file's last compressed frame, and the frames it packs
+//                into are written along with the rest of the batch.  A frame
+//                shared with other file frames is copied before it is
+//                overwritten.
+//
+// Inputs       : fd - the file handle
+//                fileFrames - the frames of the file, all already allocated
+//                contents - the new contents of each (CART_FRAME_SIZE bytes)
+//                n - number of frames, at most CART_QUEUE_DEPTH
+// Outputs      : 0 if successful, -1 if failure
+
+int storeFrames(int fd, const int *fileFrames, char **contents, int n) {
+	struct busQueue queue;
+	struct packStaging *packing = NULL;
+	struct frame location[CART_QUEUE_DEPTH], old, packed;
+	char digest[CART_QUEUE_DEPTH][CART_DIGEST_LENGTH];
+	int action[CART_QUEUE_DEPTH], hashed[CART_QUEUE_DEPTH], packedLength[CART_QUEUE_DEPTH];
+	int sparse, dedup, compress, shared, elided = 0, deduplicated = 0, compressed = 0, i;
+	uint32_t digestLength;
+
+	pthread_mutex_lock(&busLock);
+	sparse = sparseMode;
+	dedup = dedupMode;
+	compress = compressMode;
+	pthread_mutex_unlock(&busLock);
+	if (compress) {
+		if (allocatePacking(fd) == -1) {
+			return (-1);
+		}
+		packing = files[fd].packing;
+	}
+
+	for (i = 0; i < n; i++) {
+		action[i] = CART_STORE_WRITE;
+		hashed[i] = 0;
+		packedLength[i] = 0;
+		if (sparse && frameIsZero(contents[i])) {
+			action[i] = CART_STORE_HOLE;
+			elided++;
+			continue;
+		}
+		if (dedup) {
+			// A frame that cannot be fingerprinted is just written.  The
+			// library hashes through a single handle, so one at a time.
+			digestLength = CART_DIGEST_LENGTH;
+			pthread_mutex_lock(&hashLock);
+			hashed[i] = (generate_md5_signature(contents[i], CART_FRAME_SIZE, digest[i], &digestLength) == 0 &&
+				digestLength == CART_DIGEST_LENGTH);
+			pthread_mutex_unlock(&hashLock);
+		}
+		if (compress &&
+				(packedLength[i] = compress_cart_frame(contents[i], packing->compressed[i], CART_PACK_LIMIT)) == -1) {
+			packedLength[i] = 0;	// Too little to gain, stored whole
+		}
+	}
+
+	// Share identical frames, and find the shared frames about to change
+	pthread_mutex_lock(&allocLock);
+	for (i = 0; i < n; i++) {
+		if (action[i] == CART_STORE_HOLE) {
+			continue;
+		}
+		if (mapFrame(fd, fileFrames[i], &location[i]) == -1) {
+			pthread_mutex_unlock(&allocLock);
+			logMessage(LOG_ERROR_LEVEL, "CART driver failed: file has no frame %d.", fileFrames[i]);
+			return (-1);
+		}
+		if (hashed[i] && (shared = findDigest(digest[i])) != -1) {
+			if (location[i].packLength != 0 || shared != CART_FRAME_ID(location[i].cartIndex, location[i].frameIndex)) {
+				if (unmapFrame(fd, fileFrames[i], &old) == -1) {
+					pthread_mutex_unlock(&allocLock);
+					return (-1);
+				}
+				releaseLocation(fd, &old);
+				location[i].cartIndex = shared / CART_CARTRIDGE_SIZE;
+				location[i].frameIndex = shared % CART_CARTRIDGE_SIZE;
+				location[i].packOffset = 0;
+				location[i].packLength = 0;
+				frameShares[location[i].cartIndex][location[i].frameIndex]++;
+				if (insertExtent(fd, fileFrames[i], location[i]) == -1) {
+					pthread_mutex_unlock(&allocLock);
+					return (-1);
+				}
+			}
+			action[i] = CART_STORE_SHARED;
+			deduplicated++;
+		} else if (hashed[i] && packedLength[i] != 0 && findPackDigest(digest[i], &packed) == 0 &&
+				!packSparse(fd, &packed)) {
+			if (location[i].cartIndex != packed.cartIndex || location[i].frameIndex != packed.frameIndex ||
+					location[i].packOffset != packed.packOffset) {
+				// Take the use of the frame first, the old one may be in it
+				frameShares[packed.cartIndex][packed.frameIndex]++;
+				packLive[packed.cartIndex][packed.frameIndex] += packed.packLength;
+				if (unmapFrame(fd, fileFrames[i], &old) == -1) {
+					pthread_mutex_unlock(&allocLock);
+					return (-1);
+				}
+				releaseLocation(fd, &old);
+				location[i] = packed;
+				if (insertExtent(fd, fileFrames[i], location[i]) == -1) {
+					pthread_mutex_unlock(&allocLock);
+					return (-1);
+				}
+			}
+			action[i] = CART_STORE_SHARED;
+			deduplicated++;
+		} else if (packedLength[i] != 0) {
+			if (unmapFrame(fd, fileFrames[i], &old) == -1) {
+				pthread_mutex_unlock(&allocLock);
+				return (-1);
+			}
+			releaseLocation(fd, &old);
+			if (reservePack(fd, packing->compressed[i], packedLength[i], &location[i]) == -1 ||
+					insertExtent(fd, fileFrames[i], location[i]) == -1) {
+				pthread_mutex_unlock(&allocLock);
+				return (-1);
+			}
+			action[i] = CART_STORE_PACK;
+			compressed++;
+		} else if (location[i].packLength != 0 ||
+				(frameShares != NULL && frameShares[location[i].cartIndex][location[i].frameIndex] > 0)) {
+			action[i] = CART_STORE_COPY;
+		} else {
+			dropDigest(CART_FRAME_ID(location[i].cartIndex, location[i].frameIndex));
+		}
+	}
+	pthread_mutex_unlock(&allocLock);
+
+	// Give a file frame overwriting a shared or compressed frame a frame of its own
+	for (i = 0; i < n; i++) {
+		if (action[i] == CART_STORE_COPY) {
+			if (punchFrame(fd, fileFrames[i]) == -1 || allocateFrames(fd, fileFrames[i], fileFrames[i]) == -1 ||
+					mapFrame(fd, fileFrames[i], &location[i]) == -1) {
+				return (-1);
+			}
+			action[i] = CART_STORE_WRITE;
+		}
+	}
+
+	// Write the frames that still need it, then the frames the compressed
+	// ones were packed into, each filled in memory and written once
+	pthread_mutex_lock(&busLock);
+	initQueue(&queue);
+	for (i = 0; i < n; i++) {
+		if (action[i] == CART_STORE_WRITE &&
+				queueStore(&queue, location[i].cartIndex, location[i].frameIndex, contents[i]) == -1) {
+			pthread_mutex_unlock(&busLock);
+			return (-1);
+		}
+	}
+	for (i = 0; packing != NULL && i < packing->numberFilled; i++) {
+		if (queueStore(&queue, packing->filledAt[i].cartIndex, packing->filledAt[i].frameIndex,
+				packing->filled[i]) == -1) {
+			pthread_mutex_unlock(&busLock);
+			return (-1);
+		}
+	}
+	if (packing != NULL && packing->openChanged &&
+			queueStore(&queue, files[fd].packCart, files[fd].packFrame, packing->open) == -1) {
+		pthread_mutex_unlock(&busLock);
+		return (-1);
+	}
+	if (flushStores(&queue) == -1) {
+		pthread_mutex_unlock(&busLock);
+		return (-1);
+	}
+	if (packing != NULL) {
+		packing->numberFilled = 0;
+		packing->openChanged = 0;
+	}
+	driverStats.elided += elided;
+	driverStats.deduplicated += deduplicated;
+	driverStats.compressed += compressed;
+	pthread_mutex_unlock(&busLock);
+
+	// Index the frames just written, then free the ones left all zero
+	if (dedup) {
+		pthread_mutex_lock(&allocLock);
+		for (i = 0; i < n; i++) {
+			if (action[i] == CART_STORE_WRITE && hashed[i]) {
+				indexDigest(CART_FRAME_ID(location[i].cartIndex, location[i].frameIndex), digest[i]);
+			} else if (action[i] == CART_STORE_PACK && hashed[i]) {
+				indexPackDigest(digest[i], &location[i]);
+			}
+		}
+		pthread_mutex_unlock(&allocLock);
+	}
+	for (i = 0; i < n; i++) {
+		if (action[i] == CART_STORE_HOLE && punchFrame(fd, fileFrames[i]) == -1) {
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : commitOldest
+// Description  : Writes the file's least recently written buffered frames to
+//                the controller as whole frames, reading the old contents
+//                only of frames the buffer does not cover, and keeps the rest
+//                buffered
+//
+// Inputs       : fd - the file handle
+//                count - number of frames to commit
+// Outputs      : 0 if successful, -1 if failure
+
+int commitOldest(int fd, int count) {
+	struct busQueue queue;
+	struct pendingWrite *pending;
+	struct frame location[CART_QUEUE_DEPTH];
+	char (*frames)[CART_FRAME_SIZE];
+	char *cached, *contents[CART_QUEUE_DEPTH];
+	char committed[CART_COALESCE_FRAMES];
+	int order[CART_COALESCE_FRAMES];
+	int first, n, i, j, remaining, fileFrames[CART_QUEUE_DEPTH];
+	unsigned int age;
+
+	if (count == 0) {
+		return (0);
+	}
+	if (allocateStaging(fd) == -1) {
+		return (-1);
+	}
+	frames = files[fd].staging;
+
+	// Order the buffered frames oldest first, by writes since each was written
+	for (i = 0; i < files[fd].numberOfPending; i++) {
+		age = files[fd].writeCount - files[fd].pending[i].lastWrite;
+		for (j = i; j > 0 && files[fd].writeCount - files[fd].pending[order[j - 1]].lastWrite < age; j--) {
+			order[j] = order[j - 1];
+		}
+		order[j] = i;
+		committed[i] = 0;
+	}
+
+	for (first = 0; first < count; first += n) {
+		n = count - first;
+		if (n > CART_QUEUE_DEPTH) {
+			n = CART_QUEUE_DEPTH;
+		}
+
+		// Fetch the frames the buffered bytes only partly cover
+		pthread_mutex_lock(&busLock);
+		initQueue(&queue);
+		for (i = 0; i < n; i++) {
+			pending = &files[fd].pending[order[first + i]];
+			if (mapFrame(fd, pending->fileFrame, &location[i]) == -1) {
+				pthread_mutex_unlock(&busLock);
+				logMessage(LOG_ERROR_LEVEL, "CART driver failed: file has no frame %d.", pending->fileFrame);
+				return (-1);
+			}
+			if (pending->whole || (pending->low == 0 && pending->high == CART_FRAME_SIZE)) {
+				driverStats.readsAvoided++;
+			} else if (location[i].packLength != 0) {
+				if (readFileFrame(&location[i], frames[i]) == -1) {
+					pthread_mutex_unlock(&busLock);
+					return (-1);
+				}
+			} else if ((cached = get_cart_cache(location[i].cartIndex, location[i].frameIndex)) != NULL) {
+				memcpy(frames[i], cached, CART_FRAME_SIZE);
+			} else {
+				queueFrame(&queue, CART_OP_RDFRME, location[i].cartIndex, location[i].frameIndex, frames[i]);
+			}
+		}
+		if (submitQueue(&queue) == -1) {
+			pthread_mutex_unlock(&busLock);
+			return (-1);
+		}
+
+		// Merge in the buffered bytes, then store the frames
+		for (i = 0; i < n; i++) {
+			pending = &files[fd].pending[order[first + i]];
+			fileFrames[i] = pending->fileFrame;
+			contents[i] = pending->data;
+			if (!pending->whole && (pending->low != 0 || pending->high != CART_FRAME_SIZE)) {
+				memcpy(&frames[i][pending->low], &pending->data[pending->low], pending->high - pending->low);
+				contents[i] = frames[i];
+			}
+			committed[order[first + i]] = 1;
+		}
+		pthread_mutex_unlock(&busLock);
+		if (storeFrames(fd, fileFrames, contents, n) == -1) {
+			return (-1);
+		}
+	}
+
+	// Close the gaps the committed frames left with frames from the end
+	remaining = files[fd].numberOfPending - count;
+	for (i = 0, j = files[fd].numberOfPending - 1; i < remaining; i++) {
+		if (committed[i]) {
+			while (committed[j]) {
+				j--;
+			}
+			files[fd].pending[i] = files[fd].pending[j--];
+		}
+	}
+	files[fd].numberOfPending = remaining;
+	for (i = 0; i < remaining; i++) {
+		if (i == 0 || files[fd].pending[i].fileFrame < files[fd].pendingLow) {
+			files[fd].pendingLow = files[fd].pending[i].fileFrame;
+		}
+		if (i == 0 || files[fd].pending[i].fileFrame > files[fd].pendingHigh) {
+			files[fd].pendingHigh = files[fd].pending[i].fileFrame;
+		}
+	}
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : commitWrites
+// Description  : Writes all of a file's buffered frames to the controller
+//
+// Inputs       : fd - the file handle
+// Outputs      : 0 if successful, -1 if failure
+
+int commitWrites(int fd) {
+	return (commitOldest(fd, files[fd].numberOfPending));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fillPending
+// Description  : Reads the rest of a buffered frame from the controller so
+//                the whole frame is held in the buffer
+//
+// Inputs       : fd - the file handle
+//                pending - the buffered frame
+// Outputs      : 0 if successful, -1 if failure
+
+int fillPending(int fd, struct pendingWrite *pending) {
+	struct frame location;
+	char frame[CART_FRAME_SIZE];
+	int status = -1;
+
+	pthread_mutex_lock(&busLock);
+	if (mapFrame(fd, pending->fileFrame, &location) != -1) {
+		status = readFileFrame(&location, frame);
+	}
+	pthread_mutex_unlock(&busLock);
+	if (status == -1) {
+		return (-1);
+	}
+	memcpy(&frame[pending->low], &pending->data[pending->low], pending->high - pending->low);
+	memcpy(pending->data, frame, CART_FRAME_SIZE);
+	pending->low = 0;
+	pending->high = CART_FRAME_SIZE;
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bufferWrite
+// Description  : Copies a small write into the file's write buffer, merging
+//                it with the bytes already buffered for the same frames.
+//                The buffer is committed first when the write lands far
+//                from every buffered frame, and its oldest frames when it
+//                is full.
+//
+// Inputs       : fd - the file handle
+//                position - offset in the file to write at
+//                iov - the buffers to write, in order
+//                iovcnt - number of buffers
+//                count - total length of the buffers
+// Outputs      : bytes written if successful, -1 if failure
+
+int32_t bufferWrite(int fd, uint32_t position, const struct iovec *iov, int iovcnt, int count) {
+	struct ioCursor cursor = { iov, iovcnt, 0, 0 };
+	struct pendingWrite *pending;
+	struct frame location;
+	int offset, fileFrame, positionInFrame, bytes, written, hole;
+
+	if (count == 0) {
+		return (0);
+	}
+	// A write far from every buffered frame ends the burst
+	fileFrame = position / CART_FRAME_SIZE;
+	if (files[fd].numberOfPending > 0 && (fileFrame < files[fd].pendingLow - CART_COALESCE_REACH ||
+			fileFrame > files[fd].pendingHigh + CART_COALESCE_REACH)) {
+		if (commitWrites(fd) == -1) {
+			return (-1);
+		}
+	}
+
+	if (files[fd].pending == NULL) {
+		files[fd].pending = malloc(sizeof(struct pendingWrite) * CART_COALESCE_FRAMES);
+		if (files[fd].pending == NULL) {
+			logMessage(LOG_ERROR_LEVEL, "CART driver failed: unable to allocate write buffer.");
+			return (-1);
+		}
+	}
 
-CartridgeIndex firstFreeCart;
-CartFrameIndex firstFreeFrame;
+	for (written = 0; written < count; written += bytes) {
+		offset = position + written;
+		fileFrame = offset / CART_FRAME_SIZE;
+		positionInFrame = offset % CART_FRAME_SIZE;
+		bytes = CART_FRAME_SIZE - positionInFrame;
+		if (bytes > count - written) {
+			bytes = count - written;
+		}
 
-int allocateFrame(int fd, int bytesToWrite) {
-	int listEnd = files[fd].endPosition / 1024;
-	int newListEnd = (files[fd].endPosition + bytesToWrite) / 1024;
-	
-	listEnd++;
-	while (listEnd <= newListEnd) {
-		files[fd].listOfFrames[listEnd].cartIndex = firstFreeCart;
-		files[fd].listOfFrames[listEnd].frameIndex = firstFreeFrame;
-		if (firstFreeFrame >= CART_CARTRIDGE_SIZE) {
-			firstFreeCart += 1;
-			firstFreeFrame = 0;
-		} else {
-			firstFreeFrame++;	
+		// A write leaving unknown bytes between it and the buffered ones
+		// fills the frame in from the controller first
+		pending = findPending(fd, fileFrame);
+		if (pending != NULL && !pending->whole &&
+				(positionInFrame > pending->high || positionInFrame + bytes < pending->low)) {
+			if (fillPending(fd, pending) == -1) {
+				return (-1);
+			}
+		}
+		if (pending == NULL) {
+			if (files[fd].numberOfPending == CART_COALESCE_FRAMES &&
+					commitOldest(fd, CART_COALESCE_EVICT) == -1) {
+				return (-1);
+			}
+
+			// Make sure the frame exists, a hole or a frame past the end
+			// of the file starts out zeroed
+			hole = (mapFrame(fd, fileFrame, &location) == -1);
+			if (hole && allocateFrames(fd, fileFrame, fileFrame) == -1) {
+				return (-1);
+			}
+			if (files[fd].numberOfPending == 0 || fileFrame < files[fd].pendingLow) {
+				files[fd].pendingLow = fileFrame;
+			}
+			if (files[fd].numberOfPending == 0 || fileFrame > files[fd].pendingHigh) {
+				files[fd].pendingHigh = fileFrame;
+			}
+			pending = &files[fd].pending[files[fd].numberOfPending++];
+			pending->fileFrame = fileFrame;
+			pending->low = positionInFrame;
+			pending->high = positionInFrame + bytes;
+			pending->whole = (hole || fileFrame * CART_FRAME_SIZE >= files[fd].endPosition);
+			if (pending->whole) {
+				memset(pending->data, 0x0, CART_FRAME_SIZE);
+			}
+		}
+		gatherBytes(&cursor, &pending->data[positionInFrame], bytes);
+		pending->lastWrite = files[fd].writeCount;
+		if (positionInFrame < pending->low) {
+			pending->low = positionInFrame;
+		}
+		if (positionInFrame + bytes > pending->high) {
+			pending->high = positionInFrame + bytes;
+		}
+		if (files[fd].endPosition < offset + bytes) {
+			files[fd].endPosition = offset + bytes;
 		}
-		listEnd++;
 	}
-	return (0);
-}
 
-// Implementation
+	files[fd].writeCount++;
+	pthread_mutex_lock(&busLock);
+	driverStats.writesCoalesced++;
+	pthread_mutex_unlock(&busLock);
+	return (count);
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : create_cart_opcode
-// Description  : Packs a 64 bit cart register and returns the packed register
+// Function     : writeFile
+// Description  : Writes an I/O vector to a file at a position, taking each
+//                frame the request touches once. Small writes go to the
+//                file's write buffer instead.
 //
-// Inputs       : ky1 - indicates the cart opcode (8 bits)
-//                ky2 - unused currently (8 bits)
-//                rt1 - single bit to indicate return success or failure (1 bit)
-//                ct1 - cart index
-//                fm1 - frame index
-// Outputs      : regstate - a packed register
+// Inputs       : fd - the file handle
+//                position - offset in the file to write at
+//                iov - the buffers to write, in order
+//                iovcnt - number of buffers
+// Outputs      : bytes written if successful, -1 if failure
 
-CartXferRegister create_cart_opcode(CartXferRegister ky1, CartXferRegister ky2, CartXferRegister rt1, CartXferRegister ct1, CartXferRegister fm1) {
-	CartXferRegister regstate = 0x0, tempKY1, tempKY2, tempRT1, tempCT1, tempFM1, unused;
-	tempKY1 = (ky1&0xff) << 56;
-	tempKY2 = (ky2&0xff) << 48;
-	tempRT1 = (rt1&0x1) << 47;
-	tempCT1 = (ct1&0xffff) << 31;
-	tempFM1 = (fm1&0xffff) << 15;
-	unused = 0x0;
-	regstate = tempKY1|tempKY2|tempRT1|tempCT1|tempFM1|unused;
-	return (regstate);
+int32_t writeFile(int fd, uint32_t position, const struct iovec *iov, int iovcnt) {
+	struct ioCursor cursor = { iov, iovcnt, 0, 0 };
+	struct busQueue queue;
+	struct framePlan plan[CART_QUEUE_DEPTH];
+	char (*frames)[CART_FRAME_SIZE];
+	int count, bytesWritten, planned, offset, frameStart, runLength, n, i;
+	int firstFrame, lastFrame, firstHole, lastHole, batchFrame, batchLast, fileFrames[CART_QUEUE_DEPTH];
+	struct frame location, stored;
+	char *cached, *contents[CART_QUEUE_DEPTH];
+
+	count = vectorLength(iov, iovcnt);
+	if (count == -1) {
+		return (-1);
+	}
+	if ((int64_t)position + count > INT32_MAX) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: write exceeds largest file length.");
+		return (-1);
+	}
+
+	// Small writes are merged in the write buffer, larger ones go past it
+	if (count <= CART_COALESCE_WRITE_SIZE) {
+		return (bufferWrite(fd, position, iov, iovcnt, count));
+	}
+	if (commitWrites(fd) == -1 || allocateStaging(fd) == -1) {
+		return (-1);
+	}
+	frames = files[fd].staging;
+
+	// Note whether the partial first and last frames were holes
+	firstFrame = position / CART_FRAME_SIZE;
+	lastFrame = (position + count - 1) / CART_FRAME_SIZE;
+	firstHole = (mapFrame(fd, firstFrame, &location) == -1);
+	lastHole = (mapFrame(fd, lastFrame, &location) == -1);
+
+	bytesWritten = 0;
+	runLength = 0;
+	while (bytesWritten < count) {
+		// Make sure the frames of the batch exist.  Allocating a batch at a
+		// time, a long run of zeros in a sparse file holds a batch of
+		// frames at most before they are freed as holes.
+		batchFrame = (position + bytesWritten) / CART_FRAME_SIZE;
+		batchLast = batchFrame + CART_QUEUE_DEPTH - 1;
+		if (batchLast > lastFrame) {
+			batchLast = lastFrame;
+		}
+		if (allocateFrames(fd, batchFrame, batchLast) == -1) {
+			return (-1);
+		}
+
+		// Plan a batch of frames. Only a partial write into a frame holding
+		// file data needs the old contents. Whole frames are overwritten, and
+		// holes and frames past the end of the file start out zeroed.
+		pthread_mutex_lock(&busLock);
+		initQueue(&queue);
+		for (n = 0, planned = 0; n < CART_QUEUE_DEPTH && bytesWritten + planned < count; n++) {
+			offset = position + bytesWritten + planned;
+			if (runLength == 0) {
+				runLength = mapFrame(fd, offset / CART_FRAME_SIZE, &location);
+				if (runLength == -1) {
+					pthread_mutex_unlock(&busLock);
+					logMessage(LOG_ERROR_LEVEL, "CART driver failed: file has no frame at %d.", offset);
+					return (-1);
+				}
+			}
+			stored = location;
+			plan[n].cartIndex = location.cartIndex;
+			plan[n].frameIndex = location.frameIndex++;
+			runLength--;
+			plan[n].positionInFrame = offset % CART_FRAME_SIZE;
+			plan[n].bytes = CART_FRAME_SIZE - plan[n].positionInFrame;
+			if (plan[n].bytes > count - bytesWritten - planned) {
+				plan[n].bytes = count - bytesWritten - planned;
+			}
+			frameStart = offset - plan[n].positionInFrame;
+			planned += plan[n].bytes;
+
+			plan[n].entry = -1;
+			if (plan[n].bytes == CART_FRAME_SIZE) {
+				driverStats.readsAvoided++;
+			} else if (frameStart >= files[fd].endPosition || (frameStart == firstFrame * CART_FRAME_SIZE && firstHole) ||
+					(frameStart == lastFrame * CART_FRAME_SIZE && lastHole)) {
+				memset(frames[n], 0x0, CART_FRAME_SIZE);
+				driverStats.readsAvoided++;
+			} else if (stored.packLength != 0) {
+				if (readFileFrame(&stored, frames[n]) == -1) {
+					pthread_mutex_unlock(&busLock);
+					return (-1);
+				}
+			} else if ((cached = get_cart_cache(plan[n].cartIndex, plan[n].frameIndex)) != NULL) {
+				memcpy(frames[n], cached, CART_FRAME_SIZE);
+			} else {
+				plan[n].entry = queueFrame(&queue, CART_OP_RDFRME, plan[n].cartIndex, plan[n].frameIndex, frames[n]);
+			}
+		}
+		if (submitQueue(&queue) == -1) {
+			pthread_mutex_unlock(&busLock);
+			return (-1);
+		}
+
+		// Merge in the new bytes, then store the batch
+		for (i = 0; i < n; i++) {
+			gatherBytes(&cursor, &frames[i][plan[i].positionInFrame], plan[i].bytes);
+			fileFrames[i] = (position + bytesWritten) / CART_FRAME_SIZE + i;
+			contents[i] = frames[i];
+		}
+		pthread_mutex_unlock(&busLock);
+		if (storeFrames(fd, fileFrames, contents, n) == -1) {
+			return (-1);
+		}
+
+		bytesWritten += planned;
+		if (files[fd].endPosition < position + bytesWritten) {
+			files[fd].endPosition = position + bytesWritten;
+		}
+	}
+
+	// Return successfully
+	return (bytesWritten);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : extract_cart_opcode
-// Description  : Unpacks a packed register and puts each value into its own index
-//                in an array
+// Function     : compactPacks
+// Description  : Packs again the compressed frames of a file left in frames
+//                mostly holding released ones, so those frames are freed.
+//                Only done once the file has released compressed frames
+//                since it was last compacted, with compression on.
 //
-// Inputs       : regstate - a packed register containing operating arguments
-//                oregstate - an array of CartXferRegister allocated for 5 elements
-// Outputs      : 0 if successful
+// Inputs       : fd - the file handle, its writes already committed
+// Outputs      : 0 if successful, -1 if failure
 
-int extract_cart_opcode(CartXferRegister regstate, CartXferRegister* oregstate) {	
-	oregstate[CART_REG_KY1] = (regstate&0xff00000000000000) >> 56;
-	oregstate[CART_REG_KY2] = (regstate&0x00ff000000000000) >> 48;
-	oregstate[CART_REG_RT1] = (regstate&0x0000800000000000) >> 47;
-	oregstate[CART_REG_CT1] = (regstate&0x00007FFF80000000) >> 31;
-	oregstate[CART_REG_FM1] = (regstate&0x000000007FFF8000) >> 15;
+int compactPacks(int fd) {
+	struct extent *ext;
+	struct frame location;
+	char *contents[CART_QUEUE_DEPTH];
+	int fileFrames[CART_QUEUE_DEPTH], fileFrame = 0, compress, index, n, i;
+
+	pthread_mutex_lock(&busLock);
+	compress = compressMode;
+	pthread_mutex_unlock(&busLock);
+	if (files[fd].packReleased == 0 || !compress) {
+		return (0);
+	}
+	if (allocateStaging(fd) == -1) {
+		return (-1);
+	}
+
+	do {
+		// Gather the next batch of them, in file order
+		n = 0;
+		pthread_mutex_lock(&allocLock);
+		index = findExtent(fd, fileFrame);
+		for (index = (index < 0) ? 0 : index; index < files[fd].numberOfExtents && n < CART_QUEUE_DEPTH; index++) {
+			ext = &files[fd].extents[index];
+			if (ext->packEnds == NULL) {
+				continue;
+			}
+			for (i = (fileFrame > ext->fileFrame) ? fileFrame - ext->fileFrame : 0; i < ext->length &&
+					n < CART_QUEUE_DEPTH; i++) {
+				locatePacked(ext, i, &location);
+				if (packSparse(fd, &location)) {
+					fileFrames[n++] = ext->fileFrame + i;
+				}
+			}
+		}
+		pthread_mutex_unlock(&allocLock);
+
+		// Read them back, then store them as if written again
+		pthread_mutex_lock(&busLock);
+		for (i = 0; i < n; i++) {
+			contents[i] = files[fd].staging[i];
+			if (mapFrame(fd, fileFrames[i], &location) == -1 || readFileFrame(&location, contents[i]) == -1) {
+				pthread_mutex_unlock(&busLock);
+				return (-1);
+			}
+		}
+		pthread_mutex_unlock(&busLock);
+		if (n > 0) {
+			if (storeFrames(fd, fileFrames, contents, n) == -1) {
+				return (-1);
+			}
+			fileFrame = fileFrames[n - 1] + 1;
+		}
+	} while (n == CART_QUEUE_DEPTH);
+	files[fd].packReleased = 0;
 	return (0);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : loadCommand
-// Description  : Loads a cartridge using the cart_io_bus 
+// Function     : flushFile
+// Description  : Commits a file's buffered writes and compacts its
+//                compressed frames, then writes any of its frames held dirty
+//                in the cache back to the controller
 //
-// Inputs       : cartIndex - the index of the cart to be loaded
+// Inputs       : fd - the file handle, already checked
 // Outputs      : 0 if successful, -1 if failure
 
-int loadCommand(CartridgeIndex cartIndex) {
-	CartXferRegister regstate = 0x0, ky1, ky2, rt1, fm1;
-	CartXferRegister oregstate[5];
-	
-	ky1 = CART_OP_LDCART;
-	ky2 = 0;
-	rt1 = 0;
-	fm1 = 0;
-	regstate = create_cart_opcode(ky1, ky2, rt1, cartIndex, fm1);
-	cart_io_bus(regstate, NULL);
+int flushFile(int fd) {
+	struct extent *ext;
+	int length;
 
-	extract_cart_opcode(regstate, oregstate);
-	if (oregstate[CART_REG_RT1] == -1) {
-		logMessage(LOG_ERROR_LEVEL, "CART driver failed: failed to load cartridge %d.", cartIndex);
+	if (commitWrites(fd) == -1 || compactPacks(fd) == -1) {
 		return (-1);
 	}
+	pthread_mutex_lock(&busLock);
+	for (int i = 0; i < files[fd].numberOfExtents; i++) {
+		ext = &files[fd].extents[i];
+		length = extentFrames(ext);
+		for (int run = 0; run < length; run++) {
+			if (flush_cart_cache(ext->cartIndex, ext->frameIndex + run) == -1) {
+				pthread_mutex_unlock(&busLock);
+				return (-1);
+			}
+		}
+	}
+	pthread_mutex_unlock(&busLock);
 	return (0);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : readCommand
-// Description  : Reads a frame from the currently loaded cartridge
-//                using the cart_io_bus 
+// Function     : asyncWorkerMain
+// Description  : Body of the worker thread.  Takes queued requests in order,
+//                runs each inside the driver, then reports its completion.
+//                Exits once asked to stop and the queue is empty.
 //
-// Inputs       : frameIndex - the index of the frame to be read
-//                tempBuf - a character pointer allocated for the size of one frame.
-//                          contents of frame will be written to address
-// Outputs      : 0 if successful, -1 if failure
+// Inputs       : unused - thread argument
+// Outputs      : NULL
 
-int readCommand(CartFrameIndex frameIndex, char *tempBuf) {
-	CartXferRegister regstate = 0x0, ky1, ky2, rt1, ct1;
-	CartXferRegister oregstate[5];
-	
-	ky1 = CART_OP_RDFRME;
-	ky2 = 0;
-	rt1 = 0;
-	ct1 = 0;
-	regstate = create_cart_opcode(ky1, ky2, rt1, ct1, frameIndex);
-	cart_io_bus(regstate, tempBuf);
+void *asyncWorkerMain(void *unused) {
+	struct asyncRequest *request;
+	struct iovec iov;
+	int32_t handle;
 
-	extract_cart_opcode(regstate, oregstate);
-	if (oregstate[CART_REG_RT1] == -1) {
-		logMessage(LOG_ERROR_LEVEL, "CART driver failed: failed to read frame %d.", frameIndex);
-		return (-1);
+	pthread_mutex_lock(&asyncLock);
+	for (;;) {
+		while (asyncHead == -1 && !asyncStop) {
+			pthread_cond_wait(&asyncQueued, &asyncLock);
+		}
+		if (asyncHead == -1) {
+			break;
+		}
+		request = &asyncRequests[asyncHead];
+		handle = CART_ASYNC_HANDLE(asyncHead, request->generation);
+		asyncHead = request->next;
+		if (asyncHead == -1) {
+			asyncTail = -1;
+		}
+		pthread_mutex_unlock(&asyncLock);
+
+		// Run the request as the synchronous call would
+		iov.iov_base = request->buf;
+		iov.iov_len = request->count;
+		if (lockFile(request->fd) == -1) {
+			request->result = -1;
+		} else if (files[request->fd].generation != request->fileGeneration) {
+			pthread_mutex_unlock(&files[request->fd].lock);
+			logMessage(LOG_ERROR_LEVEL, "CART driver failed: file closed before its asynchronous request ran.");
+			request->result = -1;
+		} else {
+			if (request->write) {
+				request->result = writeFile(request->fd, request->position, &iov, 1);
+			} else {
+				request->result = readFile(request->fd, request->position, &iov, 1);
+			}
+			pthread_mutex_unlock(&files[request->fd].lock);
+		}
+
+		// Hand the result to the callback, or keep it for cart_poll/cart_wait
+		if (request->callback != NULL) {
+			request->callback(handle, request->result, request->arg);
+			pthread_mutex_lock(&asyncLock);
+			request->state = CART_ASYNC_FREE;
+		} else {
+			pthread_mutex_lock(&asyncLock);
+			request->state = CART_ASYNC_DONE;
+		}
+		pthread_cond_broadcast(&asyncDone);
 	}
-	return (0);
+	pthread_mutex_unlock(&asyncLock);
+	return (NULL);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : writeCommand
-// Description  : Writes a frame to the currently loaded cartridge
-//                using the cart_io_bus 
+// Function     : queueRequest
+// Description  : Queues an asynchronous read or write for the worker thread,
+//                starting the thread on first use
 //
-// Inputs       : frameIndex - the index of the frame to be written to
-//                tempBuf - a character pointer allocated for the size of one frame.
-//                          contains the characters to be written
-// Outputs      : 0 if successful, -1 if failure
+// Inputs       : write - non-zero for a write
+//                fd - the file handle
+//                buf - the caller's buffer
+//                count - bytes to transfer
+//                loc - offset in the file
+//                callback - called on completion, NULL to poll or wait instead
+//                arg - passed to the callback
+// Outputs      : request handle if successful, -1 if failure
 
-int writeCommand(CartFrameIndex frameIndex, char *tempBuf) {
-	CartXferRegister regstate = 0x0, ky1, ky2, rt1, ct1;
-	CartXferRegister oregstate[5];
+int32_t queueRequest(int write, int16_t fd, void *buf, int32_t count, uint32_t loc, CartAsyncCallback callback, void *arg) {
+	struct asyncRequest *request;
+	uint32_t generation;
+	int slot;
 
-	ky1 = CART_OP_WRFRME;
-	ky2 = 0;
-	rt1 = 0;
-	ct1 = 0;
-	regstate = create_cart_opcode(ky1, ky2, rt1, ct1, frameIndex);
-	cart_io_bus(regstate, tempBuf);
+	if (buf == NULL || count < 0) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: bad asynchronous request buffer.");
+		return (-1);
+	}
+	// Tie the request to the file as it is open now
+	if (lockFile(fd) == -1) {
+		return (-1);
+	}
+	generation = files[fd].generation;
+	pthread_mutex_unlock(&files[fd].lock);
 
-	extract_cart_opcode(regstate, oregstate);
-	if (oregstate[CART_REG_RT1] == -1) {
-		logMessage(LOG_ERROR_LEVEL, "CART driver failed: failed to write frame %d.", frameIndex);
+	pthread_mutex_lock(&asyncLock);
+	for (slot = 0; slot < CART_MAX_ASYNC_REQUESTS && asyncRequests[slot].state != CART_ASYNC_FREE; slot++);
+	if (slot == CART_MAX_ASYNC_REQUESTS) {
+		pthread_mutex_unlock(&asyncLock);
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: too many asynchronous requests.");
 		return (-1);
 	}
-	return (0);
+	if (!asyncRunning) {
+		asyncStop = 0;
+		if (pthread_create(&asyncWorker, NULL, asyncWorkerMain, NULL) != 0) {
+			pthread_mutex_unlock(&asyncLock);
+			logMessage(LOG_ERROR_LEVEL, "CART driver failed: unable to start worker thread.");
+			return (-1);
+		}
+		asyncRunning = 1;
+	}
+
+	request = &asyncRequests[slot];
+	request->state = CART_ASYNC_QUEUED;
+	request->generation = (request->generation + 1) % CART_ASYNC_GENERATIONS;
+	request->write = write;
+	request->fd = fd;
+	request->fileGeneration = generation;
+	request->buf = buf;
+	request->count = count;
+	request->position = loc;
+	request->callback = callback;
+	request->arg = arg;
+	request->result = -1;
+	request->next = -1;
+	if (asyncTail == -1) {
+		asyncHead = slot;
+	} else {
+		asyncRequests[asyncTail].next = slot;
+	}
+	asyncTail = slot;
+	pthread_cond_signal(&asyncQueued);
+	pthread_mutex_unlock(&asyncLock);
+	return (CART_ASYNC_HANDLE(slot, request->generation));
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : checkFileHandle
-// Description  : Determines whether the file handle is invalid or closed
+// Function     : findRequest
+// Description  : Finds the request a handle names, called with the
+//                asynchronous request lock held
 //
-// Inputs       : fd - the file handle
-// Outputs      : 0 if file handle is valid, -1 if it is invalid
+// Inputs       : handle - the request handle
+// Outputs      : the request, NULL if it has been collected or never existed
 
-int checkFileHandle(int16_t fd) {
-	// Invalid file handle
-	if (fd < 0 || fd >= CART_MAX_TOTAL_FILES) {
-		logMessage(LOG_ERROR_LEVEL, "CART driver failed: bad file handle.");
-		return (-1);
+struct asyncRequest *findRequest(int32_t handle) {
+	struct asyncRequest *request;
+
+	if (handle < 0) {
+		return (NULL);
 	}
-	// If file was already closed
-	if (files[fd].openFlag == 0) {
-		logMessage(LOG_ERROR_LEVEL, "CART driver failed: file is closed.");
+	request = &asyncRequests[handle % CART_MAX_ASYNC_REQUESTS];
+	if (request->state == CART_ASYNC_FREE || request->generation != handle / CART_MAX_ASYNC_REQUESTS) {
+		return (NULL);
+	}
+	return (request);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : onWorker
+// Description  : Checks whether the caller is the worker thread, as it is
+//                when a completion callback calls back into the driver.
+//                Called with the asynchronous request lock held.
+//
+// Inputs       : none
+// Outputs      : non-zero if called from the worker thread
+
+int onWorker(void) {
+	return (asyncRunning && pthread_equal(pthread_self(), asyncWorker));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : stopWorker
+// Description  : Lets the worker thread finish every queued request, then
+//                waits for it to exit.  The worker cannot wait for itself,
+//                so this fails when called from a completion callback.
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int stopWorker(void) {
+	pthread_mutex_lock(&asyncLock);
+	if (!asyncRunning) {
+		pthread_mutex_unlock(&asyncLock);
+		return (0);
+	}
+	if (onWorker()) {
+		pthread_mutex_unlock(&asyncLock);
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: cannot stop the worker from a completion callback.");
 		return (-1);
 	}
+	asyncStop = 1;
+	pthread_cond_signal(&asyncQueued);
+	pthread_mutex_unlock(&asyncLock);
+
+	pthread_join(asyncWorker, NULL);
+	asyncRunning = 0;
 	return (0);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : cart_poweron
-// Description  : Startup up the CART interface, initialize filesystem
+// Function     : powerOn
+// Description  : Startup up the CART interface, then either initialize an
+//                empty filesystem or mount the one stored on the cartridges
 //
-// Inputs       : none
+// Inputs       : mount - non-zero to mount the stored filesystem
 // Outputs      : 0 if successful, -1 if failure
 
-int32_t cart_poweron(void) {
+int32_t powerOn(int mount) {
 	// Create log
 	initializeLogWithFilename(LOG_SERVICE_NAME);
 	enableLogLevels(DEFAULT_LOG_LEVEL);
 
-	CartXferRegister regstate = 0x0, ky1, ky2, rt1, ct1, fm1, index;
+	CartXferRegister regstate = 0x0, ky1, ky2, rt1, ct1, fm1;
 	CartXferRegister oregstate[5];
+	// Nothing is loaded until the first LDCART
+	memset(&driverStats, 0x0, sizeof(CartDriverStatistics));
+	memset(&busStats, 0x0, sizeof(CartBusStatistics));
+	loadedCart = CART_NO_CARTRIDGE;
+	busLastCart = CART_NO_CARTRIDGE;
+
 	// Initialize memory system
 	ky1 = CART_OP_INITMS;
 	ky2 = 0x0;
@@ -233,49 +3974,109 @@ int32_t cart_poweron(void) {
 	ct1 = 0x0;
 	fm1 = 0x0;
 	regstate = create_cart_opcode(ky1, ky2, rt1, ct1, fm1);
-	cart_io_bus(regstate, NULL);
+	regstate = busCommand(regstate, NULL);
 	// Check return value
 	extract_cart_opcode(regstate, oregstate);
-	if (oregstate[CART_REG_RT1] == -1) {
+	if (oregstate[CART_REG_RT1] != 0) {
 		logMessage(LOG_ERROR_LEVEL, "CART driver failed: failed to power on.");
 		return (-1);
 	}
 
-	// Load and zero all cartridges
-	for (index = 0x0; index < CART_MAX_CARTRIDGES; index++) {
-		// Load cartridge
-		if (loadCommand(index) == -1) {
-			return (-1);
-		}
-
-		// Zero current cartridge
-		ky1 = CART_OP_BZERO;
-		regstate = create_cart_opcode(ky1, ky2, rt1, ct1, fm1);
-		cart_io_bus(regstate, NULL);
-		extract_cart_opcode(regstate, oregstate);
-		if (oregstate[CART_REG_RT1] == -1) {
-			return (-1);
-		}
-	}
-
 	// Initialize file system
 	numberOfFiles = 0;
+	for (int i = 0; i < CART_PATH_INDEX_SIZE; i++) {
+		pathIndex[i] = -1;
+	}
 	for (int i = 0; i < CART_MAX_TOTAL_FILES; i++) {
 		files[i].openFlag = 0;
 		files[i].filePath[0] = '\0';
 		files[i].endPosition = 0;
 		files[i].currentPosition = 0;
-		//for (int j = 0; j < CART_CARTRIDGE_SIZE; j++) {
-		//	files[i].listOfFrames[j].cartIndex = 0;
-		//	files[i].listOfFrames[j].frameIndex = 0;
-		//}		
+		freeExtents(i);
+		files[i].nextInBucket = -1;
+		files[i].readAheadNext = 0;
+		files[i].readAheadWindow = 0;
+		files[i].readAheadFrame = 0;
+		free(files[i].pending);
+		files[i].pending = NULL;
+		files[i].numberOfPending = 0;
+		free(files[i].staging);
+		files[i].staging = NULL;
+		free(files[i].packing);
+		files[i].packing = NULL;
+		files[i].packCart = CART_NO_CARTRIDGE;
+		files[i].packReleased = 0;
+		pthread_mutex_init(&files[i].lock, NULL);
+	}
+
+	// Every frame starts out free and unshared
+	memset(frameMap, 0x0, sizeof(frameMap));
+	freeSharing();
+	freePackTables();
+	if ((dedupMode && allocateDigests() == -1) || (compressMode && allocatePackTables() == -1)) {
+		return (-1);
+	}
+	totalFreeFrames = CART_MAX_CARTRIDGES * CART_CARTRIDGE_SIZE;
+	extentTableBytes = 0;
+	for (int i = 0; i < CART_MAX_CARTRIDGES; i++) {
+		freeFrames[i] = CART_CARTRIDGE_SIZE;
+		cartState[i] = CART_STATE_DIRTY;	// Zeroed on first use, not here
+	}
+	allocCart = 0;
+	numberOfFreeHandles = 0;
+	for (int i = 0; i < CART_MAX_ASYNC_REQUESTS; i++) {
+		asyncRequests[i].state = CART_ASYNC_FREE;
+	}
+
+	// Reserve the metadata frames, they are only written at power off
+	for (int i = 0; i < CART_META_FRAMES; i++) {
+		claimFrame(CART_META_CART, i);
+	}
+
+	// Read back the filesystem when mounting, otherwise start empty.  A
+	// mounted cartridge 0 must never be zeroed under the file table, but
+	// when formatting it is zeroed on first use like the others.
+	if (mount) {
+		if (loadMetadata() == -1) {
+			return (-1);
+		}
+		cartState[CART_META_CART] = CART_STATE_ZEROED;
+	}
+
+	// Set up the frame cache
+	if (init_cart_cache() == -1) {
+		return (-1);
 	}
+	set_cart_cache_writeback(storeFrame);
+
+	// Return successfully
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_poweron
+// Description  : Startup up the CART interface, initialize filesystem
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_poweron(void) {
+	return (powerOn(0));
+}
 
-	firstFreeCart = 0;
-	firstFreeFrame = 0;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_mount
+// Description  : Startup up the CART interface, mounting the filesystem saved
+//                by the last power off.  Fails if the cartridges hold none,
+//                cart_poweron formats instead.
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
 
-	// Return successfully
-	return(0);
+int32_t cart_mount(void) {
+	return (powerOn(1));
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -289,6 +4090,60 @@ int32_t cart_poweron(void) {
 int32_t cart_poweroff(void) {
 	CartXferRegister regstate = 0x0, ky1, ky2, rt1, ct1, fm1;
 	CartXferRegister oregstate[5];
+	int status = 0;
+
+	// Let the worker finish the queued requests first, which a completion
+	// callback running on the worker cannot do
+	if (stopWorker() == -1) {
+		return (-1);
+	}
+
+	// From here on a failure is reported, but the files are still released
+	// and the controller still powered off.  Commit the writes still
+	// buffered in files left open.
+	for (int i = 0; i < numberOfFiles; i++) {
+		if (commitWrites(i) == -1 || compactPacks(i) == -1) {
+			logMessage(LOG_ERROR_LEVEL, "CART driver failed: unable to commit buffered writes on shut down.");
+			status = -1;
+		}
+	}
+
+	// Write back any frames still held in the cache, then release it
+	if (flush_all_cart_cache() == -1) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: unable to flush cache on shut down.");
+		status = -1;
+	}
+	close_cart_cache();
+
+	// Save the filesystem so it can be mounted at the next power on
+	if (saveMetadata() == -1) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: unable to save filesystem metadata.");
+		status = -1;
+	}
+
+	// Release the file metadata
+	for (int i = 0; i < numberOfFiles; i++) {
+		freeExtents(i);
+		free(files[i].pending);
+		files[i].pending = NULL;
+		files[i].numberOfPending = 0;
+		free(files[i].staging);
+		files[i].staging = NULL;
+		free(files[i].packing);
+		files[i].packing = NULL;
+		files[i].packCart = CART_NO_CARTRIDGE;
+		files[i].packReleased = 0;
+	}
+	freeSharing();
+	freePackTables();
+
+	// Report the bus traffic for this session
+	logMessage(LOG_OUTPUT_LEVEL, "CART driver bus operations: %lu loads (%lu avoided), "
+		"%lu reads (%lu avoided, %lu ahead), %lu writes (%lu coalesced, %lu elided, %lu deduplicated, "
+		"%lu compressed), %lu zeroes, %lu batches.", driverStats.loads, driverStats.loadsAvoided, driverStats.reads,
+		driverStats.readsAvoided, driverStats.readAheads, driverStats.writes, driverStats.writesCoalesced,
+		driverStats.elided, driverStats.deduplicated, driverStats.compressed, driverStats.zeroes, driverStats.batches);
+
 	// Power off the memory system
 	ky1 = CART_OP_POWOFF;
 	ky2 = 0x0;
@@ -296,14 +4151,53 @@ int32_t cart_poweroff(void) {
 	ct1 = 0x0;
 	fm1 = 0x0;
 	regstate = create_cart_opcode(ky1, ky2, rt1, ct1, fm1);
-	cart_io_bus(regstate, NULL);
+	regstate = busCommand(regstate, NULL);
 	extract_cart_opcode(regstate, oregstate);
-	if (oregstate[CART_REG_RT1] == -1) {
+	logBusStatistics();
+	if (oregstate[CART_REG_RT1] != 0) {
 		logMessage(LOG_ERROR_LEVEL, "CART driver failed: failed to shut down.");
 		return (-1);
 	}
-	// Return successfully
-	return(0);
+
+	// Return successfully unless saving the filesystem failed
+	return (status);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_get_statistics
+// Description  : Copies out the bus operation counters since power on
+//
+// Inputs       : stats - structure to fill in
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_get_statistics(CartDriverStatistics *stats) {
+	if (stats == NULL) {
+		return (-1);
+	}
+	pthread_mutex_lock(&busLock);
+	*stats = driverStats;
+	pthread_mutex_unlock(&busLock);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_get_bus_statistics
+// Description  : Copies out the per-opcode bus counts, latency histograms,
+//                cartridge switches and bytes moved since power on
+//
+// Inputs       : stats - structure to fill in
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_get_bus_statistics(CartBusStatistics *stats) {
+	if (stats == NULL) {
+		return (-1);
+	}
+	pthread_mutex_lock(&busLock);
+	*stats = busStats;
+	pthread_mutex_unlock(&busLock);
+	return (0);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -316,41 +4210,64 @@ int32_t cart_poweroff(void) {
 
 int16_t cart_open(char *path) {
 	int length = strlen(path) + 1; // Plus 1 so it includes null character
+	int fd, bucket;
+
+	if (length > CART_MAX_PATH_LENGTH) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: path too long [%s].", path);
+		return (-1);
+	}
+	pthread_mutex_lock(&tableLock);
 
 	// Check if file with path name exists
-	for (int i = 0; i < numberOfFiles; i++) {
-		// If it exists
-		if (strncmp(files[i].filePath, path, length) == 0) {
-			// Check if file already open. If it is, return -1. Else, open file.
-			if (files[i].openFlag == 1) {
-				return (-1);
-			} else {
-				files[i].openFlag = 1;
-				files[i].currentPosition = 0;
-				return (i); // Return file handle
-			}
+	fd = findFile(path);
+	if (fd != -1) {
+		// Check if file already open. If it is, return -1. Else, open file.
+		pthread_mutex_lock(&files[fd].lock);
+		if (files[fd].openFlag == 1) {
+			pthread_mutex_unlock(&files[fd].lock);
+			pthread_mutex_unlock(&tableLock);
+			return (-1);
 		}
+		files[fd].openFlag = 1;
+		files[fd].currentPosition = 0;
+		files[fd].readAheadNext = 0;
+		files[fd].readAheadWindow = 0;
+		files[fd].readAheadFrame = 0;
+		pthread_mutex_unlock(&files[fd].lock);
+		pthread_mutex_unlock(&tableLock);
+		return (fd); // Return file handle
+	}
+	if (numberOfFreeHandles == 0 && numberOfFiles >= CART_MAX_TOTAL_FILES) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: too many files.");
+		pthread_mutex_unlock(&tableLock);
+		return (-1);
 	}
 	
-	// Create file
-	numberOfFiles++;
-	files[numberOfFiles].openFlag = 1;
-	strncpy(files[numberOfFiles].filePath, path, length);
-	files[numberOfFiles].endPosition = 0;
-	files[numberOfFiles].currentPosition = 0;
-	// Allocate a frame
-	files[numberOfFiles].listOfFrames[0].cartIndex = firstFreeCart;
-	files[numberOfFiles].listOfFrames[0].frameIndex = firstFreeFrame;
-	if (firstFreeFrame >= CART_CARTRIDGE_SIZE) {
-		firstFreeCart += 1;
-		firstFreeFrame = 0;
+	// Create file, reusing the handle of a deleted file if there is one
+	if (numberOfFreeHandles > 0) {
+		fd = freeHandles[--numberOfFreeHandles];
 	} else {
-		firstFreeFrame++;	
+		fd = numberOfFiles++;
 	}
+	pthread_mutex_lock(&files[fd].lock);
+	files[fd].openFlag = 1;
+	strncpy(files[fd].filePath, path, length);
+	files[fd].endPosition = 0;
+	files[fd].currentPosition = 0;
+	files[fd].numberOfExtents = 0;	// Frames are allocated as the file is written
+	files[fd].readAheadNext = 0;
+	files[fd].readAheadWindow = 0;
+	files[fd].readAheadFrame = 0;
+	pthread_mutex_unlock(&files[fd].lock);
 
-	// Returns the file handle. If it reaches this point it is because the file
-	// had to be created and therefore its file handle will be the number of files
-	return (numberOfFiles);
+	// Add the file to the path index
+	bucket = hashPath(path);
+	files[fd].nextInBucket = pathIndex[bucket];
+	pathIndex[bucket] = fd;
+
+	// Return the file handle
+	pthread_mutex_unlock(&tableLock);
+	return (fd);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -362,13 +4279,29 @@ int16_t cart_open(char *path) {
 // Outputs      : 0 if successful, -1 if failure
 
 int16_t cart_close(int16_t fd) {
-	if (checkFileHandle(fd) == -1) {
+	if (lockFile(fd) == -1) {
+		return (-1);
+	}
+	// Write back anything the file left in the cache
+	if (flushFile(fd) == -1) {
+		pthread_mutex_unlock(&files[fd].lock);
 		return (-1);
 	}
-	// Set flag to closed
+	// Stop packing into the frame the file was filling
+	pthread_mutex_lock(&allocLock);
+	closePack(fd);
+	pthread_mutex_unlock(&allocLock);
+	// Set flag to closed, the staging and packing frames are only needed while open,
+	// and requests still queued for the file must not run once its handle is reused
 	files[fd].openFlag = 0;
+	files[fd].generation++;
+	free(files[fd].staging);
+	files[fd].staging = NULL;
+	free(files[fd].packing);
+	files[fd].packing = NULL;
 
 	// Return successfully
+	pthread_mutex_unlock(&files[fd].lock);
 	return (0);
 }
 
@@ -384,145 +4317,491 @@ int16_t cart_close(int16_t fd) {
 // Outputs      : bytes read if successful, -1 if failure
 
 int32_t cart_read(int16_t fd, void *buf, int32_t count) {
-	if (checkFileHandle(fd) == -1) {
+	struct iovec iov = { buf, count };
+	int32_t bytesRead;
+
+	if (lockFile(fd) == -1) {
 		return (-1);
 	}
+	bytesRead = readFile(fd, files[fd].currentPosition, &iov, 1);
+	if (bytesRead > 0) {
+		files[fd].currentPosition += bytesRead;
+	}
+	pthread_mutex_unlock(&files[fd].lock);
+	return (bytesRead);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_write
+// Description  : Writes "count" bytes to the file handle "fh" from the 
+//                buffer  "buf"
+//
+// Inputs       : fd - filename of the file to write to
+//                buf - pointer to buffer to write from
+//                count - number of bytes to write
+// Outputs      : bytes written if successful, -1 if failure
 
-	// Calculate bytes until end of file
-	int bytesLeft, bytesToRead;
-	bytesLeft = files[fd].endPosition - files[fd].currentPosition;
+int32_t cart_write(int16_t fd, void *buf, int32_t count) {
+	struct iovec iov = { buf, count };
+	int32_t bytesWritten;
 
-	// If not enough bytes are left in file, set bytesToRead to bytesLeft
-	if (count > bytesLeft) {
-		bytesToRead = bytesLeft;
-	} else {
-		bytesToRead = count;
+	if (lockFile(fd) == -1) {
+		return (-1);
 	}
-	
-	int positionInFrame, listIndex, bytesRemaining;
-	char tempBuf[CART_FRAME_SIZE];
+	bytesWritten = writeFile(fd, files[fd].currentPosition, &iov, 1);
+	if (bytesWritten > 0) {
+		files[fd].currentPosition += bytesWritten;
+	}
+	pthread_mutex_unlock(&files[fd].lock);
+	return (bytesWritten);
+}
 
-	bytesRemaining = bytesToRead;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_readv
+// Description  : Reads from the current position into a list of buffers,
+//                in one pass over the frames involved
+//
+// Inputs       : fd - the file handle to read from
+//                iov - the buffers to fill, in order
+//                iovcnt - number of buffers
+// Outputs      : bytes read if successful, -1 if failure
 
-	while (bytesRemaining > 0) {
-		positionInFrame = files[fd].currentPosition % CART_FRAME_SIZE;	// Position in current frame
-		listIndex = files[fd].currentPosition / CART_FRAME_SIZE;	// Location in frame list
+int32_t cart_readv(int16_t fd, const struct iovec *iov, int iovcnt) {
+	int32_t bytesRead;
 
-		// Load cartridge of frame
-		if (loadCommand(files[fd].listOfFrames[listIndex].cartIndex) == -1) {
-			return (-1);
-		}
-		// Read frame
-		if (readCommand(files[fd].listOfFrames[listIndex].frameIndex, tempBuf) == -1) {
-			return (-1);
-		}
+	if (lockFile(fd) == -1) {
+		return (-1);
+	}
+	bytesRead = readFile(fd, files[fd].currentPosition, iov, iovcnt);
+	if (bytesRead > 0) {
+		files[fd].currentPosition += bytesRead;
+	}
+	pthread_mutex_unlock(&files[fd].lock);
+	return (bytesRead);
+}
 
-		int bytesFromFrame;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_writev
+// Description  : Writes a list of buffers at the current position, in one
+//                pass over the frames involved
+//
+// Inputs       : fd - the file handle to write to
+//                iov - the buffers to write, in order
+//                iovcnt - number of buffers
+// Outputs      : bytes written if successful, -1 if failure
 
-		if (bytesRemaining == bytesToRead) {		// First read needs to be copied into buf
-			if (bytesToRead < CART_FRAME_SIZE) {		// Read only requires one frame
-				bytesFromFrame = bytesToRead;
-			} else {				// Read requires subsequent frames
-				bytesFromFrame = CART_FRAME_SIZE - positionInFrame;
-			}
-			memcpy(buf, &tempBuf[positionInFrame], bytesFromFrame);
-		} else if (bytesRemaining < CART_FRAME_SIZE) {		// Last read
-			bytesFromFrame = bytesRemaining;
-			strncat(buf, tempBuf, bytesFromFrame);
-		} else {					// Entire frame copied
-			bytesFromFrame = CART_FRAME_SIZE;
-			strncat(buf, tempBuf, bytesFromFrame);
-		}
+int32_t cart_writev(int16_t fd, const struct iovec *iov, int iovcnt) {
+	int32_t bytesWritten;
 
-		bytesRemaining -= bytesFromFrame;
-		files[fd].currentPosition += bytesFromFrame;
+	if (lockFile(fd) == -1) {
+		return (-1);
+	}
+	bytesWritten = writeFile(fd, files[fd].currentPosition, iov, iovcnt);
+	if (bytesWritten > 0) {
+		files[fd].currentPosition += bytesWritten;
 	}
+	pthread_mutex_unlock(&files[fd].lock);
+	return (bytesWritten);
+}
 
-	// Return successfully
-	return (bytesToRead);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_pread
+// Description  : Reads "count" bytes at offset "loc" without moving the
+//                file position
+//
+// Inputs       : fd - the file handle to read from
+//                buf - pointer to buffer to read into
+//                count - number of bytes to read
+//                loc - offset in the file to read from
+// Outputs      : bytes read if successful, -1 if failure
+
+int32_t cart_pread(int16_t fd, void *buf, int32_t count, uint32_t loc) {
+	struct iovec iov = { buf, count };
+	int32_t bytesRead;
+
+	if (lockFile(fd) == -1) {
+		return (-1);
+	}
+	bytesRead = readFile(fd, loc, &iov, 1);
+	pthread_mutex_unlock(&files[fd].lock);
+	return (bytesRead);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : cart_write
-// Description  : Writes "count" bytes to the file handle "fh" from the 
-//                buffer  "buf"
+// Function     : cart_pwrite
+// Description  : Writes "count" bytes at offset "loc" without moving the
+//                file position
 //
-// Inputs       : fd - filename of the file to write to
+// Inputs       : fd - the file handle to write to
 //                buf - pointer to buffer to write from
 //                count - number of bytes to write
+//                loc - offset in the file to write at
 // Outputs      : bytes written if successful, -1 if failure
 
-int32_t cart_write(int16_t fd, void *buf, int32_t count) {
-	if (checkFileHandle(fd) == -1) {
+int32_t cart_pwrite(int16_t fd, void *buf, int32_t count, uint32_t loc) {
+	struct iovec iov = { buf, count };
+	int32_t bytesWritten;
+
+	if (lockFile(fd) == -1) {
 		return (-1);
 	}
-	
-	char tempBuf[CART_FRAME_SIZE];
-	int bytesRemaining, bytesToWrite, positionInFrame, listIndex, locationInBuf;
-	bytesRemaining = count;
-	locationInBuf = 0;
+	bytesWritten = writeFile(fd, loc, &iov, 1);
+	pthread_mutex_unlock(&files[fd].lock);
+	return (bytesWritten);
+}
 
-	allocateFrame(fd, count);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_read_async
+// Description  : Queues a read of "count" bytes at offset "loc" and returns
+//                at once.  The buffer must stay valid until the request
+//                finishes.  Requests run in the order they are queued.
+//
+// Inputs       : fd - the file handle to read from
+//                buf - pointer to buffer to read into
+//                count - number of bytes to read
+//                loc - offset in the file to read from
+//                callback - called with the result when done, or NULL to
+//                           collect it with cart_poll or cart_wait
+//                arg - passed to the callback
+// Outputs      : request handle if successful, -1 if failure
 
-	while (bytesRemaining > 0) {
-		positionInFrame = files[fd].currentPosition % CART_FRAME_SIZE;	// Position in current frame
-		listIndex = files[fd].currentPosition / CART_FRAME_SIZE; 	// Location in frame list
+int32_t cart_read_async(int16_t fd, void *buf, int32_t count, uint32_t loc, CartAsyncCallback callback, void *arg) {
+	return (queueRequest(0, fd, buf, count, loc, callback, arg));
+}
 
-		if (bytesRemaining + positionInFrame >= CART_FRAME_SIZE) {
-			bytesToWrite = CART_FRAME_SIZE - positionInFrame;
-		} else if ((bytesRemaining + positionInFrame) % CART_FRAME_SIZE != 0) {
-			bytesToWrite = bytesRemaining % CART_FRAME_SIZE;
-		} else {
-			bytesToWrite = CART_FRAME_SIZE;
-		}
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_write_async
+// Description  : Queues a write of "count" bytes at offset "loc" and returns
+//                at once.  The buffer must stay valid until the request
+//                finishes.  Requests run in the order they are queued.
+//
+// Inputs       : fd - the file handle to write to
+//                buf - pointer to buffer to write from
+//                count - number of bytes to write
+//                loc - offset in the file to write at
+//                callback - called with the result when done, or NULL to
+//                           collect it with cart_poll or cart_wait
+//                arg - passed to the callback
+// Outputs      : request handle if successful, -1 if failure
+
+int32_t cart_write_async(int16_t fd, void *buf, int32_t count, uint32_t loc, CartAsyncCallback callback, void *arg) {
+	return (queueRequest(1, fd, buf, count, loc, callback, arg));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_poll
+// Description  : Checks on a request queued without a callback.  Once it
+//                has finished its result is returned and the handle released.
+//
+// Inputs       : request - the request handle
+// Outputs      : the request's result, CART_ASYNC_PENDING if unfinished,
+//                -1 if there is no such request
+
+int32_t cart_poll(int32_t request) {
+	struct asyncRequest *found;
+	int32_t result = -1;
+
+	pthread_mutex_lock(&asyncLock);
+	found = findRequest(request);
+	if (found != NULL && found->state == CART_ASYNC_DONE) {
+		result = found->result;
+		found->state = CART_ASYNC_FREE;
+	} else if (found != NULL && found->callback == NULL) {
+		result = CART_ASYNC_PENDING;
+	}
+	pthread_mutex_unlock(&asyncLock);
+	return (result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_wait
+// Description  : Waits for a request queued without a callback to finish,
+//                then returns its result and releases the handle.  A
+//                completion callback cannot wait, as the request it would
+//                wait for runs on its own thread.
+//
+// Inputs       : request - the request handle
+// Outputs      : the request's result, -1 if there is no such request
+
+int32_t cart_wait(int32_t request) {
+	struct asyncRequest *found;
+	int32_t result = -1;
+
+	pthread_mutex_lock(&asyncLock);
+	found = findRequest(request);
+	if (found != NULL && found->state == CART_ASYNC_QUEUED && onWorker()) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: cannot wait from a completion callback.");
+		found = NULL;
+	}
+	while (found != NULL && found->callback == NULL && found->state == CART_ASYNC_QUEUED) {
+		pthread_cond_wait(&asyncDone, &asyncLock);
+		found = findRequest(request);	// Another thread may have collected it
+	}
+	if (found != NULL && found->callback == NULL && found->state == CART_ASYNC_DONE) {
+		result = found->result;
+		found->state = CART_ASYNC_FREE;
+	}
+	pthread_mutex_unlock(&asyncLock);
+	return (result);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_seek
+// Description  : Seek to specific point in the file
+//
+// Inputs       : fd - filename of the file to write to
+//                loc - offfset of file in relation to beginning of file
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_seek(int16_t fd, uint32_t loc) {
+	if (lockFile(fd) == -1) {
+		return (-1);
+	}
+	if (loc > INT32_MAX) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: offset exceeds largest file length.");
+		pthread_mutex_unlock(&files[fd].lock);
+		return (-1);
+	}
+	files[fd].currentPosition = loc;	// Past the end leaves a hole once written
+
+	// Return successfully
+	pthread_mutex_unlock(&files[fd].lock);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_flush
+// Description  : Writes any of the file's frames held dirty in the cache
+//                back to the controller
+//
+// Inputs       : fd - the file handle of the file to flush
+// Outputs      : 0 if successful, -1 if failure
 
-		// Load cartridge
-		if (loadCommand(files[fd].listOfFrames[listIndex].cartIndex) == -1) {
+int32_t cart_flush(int16_t fd) {
+	int32_t status;
+
+	if (lockFile(fd) == -1) {
+		return (-1);
+	}
+	status = flushFile(fd);
+	pthread_mutex_unlock(&files[fd].lock);
+	return (status);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_set_write_back
+// Description  : Turns write-back buffering on or off.  While on, modified
+//                frames stay in the cache until a flush, eviction, close or
+//                power off.  Turning it off flushes everything.
+//
+// Inputs       : enable - non-zero to buffer writes, zero to write through
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_set_write_back(int enable) {
+	pthread_mutex_lock(&busLock);
+	if (writeBackMode && !enable) {
+		if (flush_all_cart_cache() == -1) {
+			pthread_mutex_unlock(&busLock);
 			return (-1);
 		}
-		// Read frame
-		if (readCommand(files[fd].listOfFrames[listIndex].frameIndex, tempBuf) == -1) {
-			return (-1);
+	}
+	writeBackMode = enable;
+
+	// Return successfully
+	pthread_mutex_unlock(&busLock);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_set_sparse
+// Description  : Turns zero frame elision on or off.  While on, a frame a
+//                write leaves all zero is freed instead of written, and reads
+//                of it return zeros without touching the controller.
+//
+// Inputs       : enable - non-zero to turn zero frames into holes
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_set_sparse(int enable) {
+	pthread_mutex_lock(&busLock);
+	sparseMode = enable;
+
+	// Return successfully
+	pthread_mutex_unlock(&busLock);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_set_dedup
+// Description  : Turns frame deduplication on or off.  While on, each frame
+//                written is fingerprinted, and one identical to a frame
+//                already stored shares that frame instead of being written.
+//                Frames shared while it was on stay shared when it is off.
+//                The digest index is allocated the first time it is on.
+//
+// Inputs       : enable - non-zero to share identical frames
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_set_dedup(int enable) {
+	pthread_mutex_lock(&allocLock);
+	if (enable && allocateDigests() == -1) {
+		pthread_mutex_unlock(&allocLock);
+		return (-1);
+	}
+	pthread_mutex_lock(&busLock);
+	dedupMode = enable;
+
+	// Return successfully
+	pthread_mutex_unlock(&busLock);
+	pthread_mutex_unlock(&allocLock);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_set_compress
+// Description  : Turns frame compression on or off.  While on, each frame
+//                written that compresses well enough is packed with the
+//                file's other compressed frames, so several share a
+//                cartridge frame.  Frames stay compressed until rewritten
+//                when it is off.  The tables tracking them are allocated the
+//                first time it is on.
+//
+// Inputs       : enable - non-zero to store frames compressed
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_set_compress(int enable) {
+	pthread_mutex_lock(&allocLock);
+	if (enable && allocatePackTables() == -1) {
+		pthread_mutex_unlock(&allocLock);
+		return (-1);
+	}
+	pthread_mutex_lock(&busLock);
+	compressMode = enable;
+
+	// Return successfully
+	pthread_mutex_unlock(&busLock);
+	pthread_mutex_unlock(&allocLock);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_truncate
+// Description  : Shortens a file to a given length, returning the frames past
+//                the new end to the free pool
+//
+// Inputs       : fd - the file handle
+//                length - the new length of the file in bytes
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_truncate(int16_t fd, uint32_t length) {
+	struct frame location;
+	char tempBuf[CART_FRAME_SIZE], *contents = tempBuf;
+	int fileFrame, hole, status = 0;
+
+	if (lockFile(fd) == -1) {
+		return (-1);
+	}
+	if (length > files[fd].endPosition) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: truncate length exceeds file length.");
+		pthread_mutex_unlock(&files[fd].lock);
+		return (-1);
+	}
+	if (commitWrites(fd) == -1) {
+		pthread_mutex_unlock(&files[fd].lock);
+		return (-1);
+	}
+
+	// Zero the rest of the new final frame so nothing stale reappears, a
+	// hole already reads as zeros
+	if (length % CART_FRAME_SIZE != 0) {
+		fileFrame = length / CART_FRAME_SIZE;
+		pthread_mutex_lock(&busLock);
+		hole = (mapFrame(fd, fileFrame, &location) == -1);
+		if (!hole) {
+			status = readFileFrame(&location, tempBuf);
 		}
-		// Update tempBuf before writing
-		strncpy(&tempBuf[positionInFrame], buf+locationInBuf, bytesToWrite);
-		// Write frame
-		if (writeCommand(files[fd].listOfFrames[listIndex].frameIndex, tempBuf) == -1) {
-			return (-1);
+		pthread_mutex_unlock(&busLock);
+		if (!hole && status != -1) {
+			memset(&tempBuf[length % CART_FRAME_SIZE], 0x0, CART_FRAME_SIZE - length % CART_FRAME_SIZE);
+			status = storeFrames(fd, &fileFrame, &contents, 1);
 		}
-		
-		bytesRemaining -= bytesToWrite;
-		files[fd].currentPosition += bytesToWrite;
-		locationInBuf += bytesToWrite;
-		if (files[fd].endPosition < files[fd].currentPosition) {
-			files[fd].endPosition = files[fd].currentPosition;
+		if (status == -1) {
+			pthread_mutex_unlock(&files[fd].lock);
+			return (-1);
 		}
 	}
 
+	releaseFrames(fd, (length + CART_FRAME_SIZE - 1) / CART_FRAME_SIZE);
+	files[fd].endPosition = length;
+	if (files[fd].currentPosition > length) {
+		files[fd].currentPosition = length;
+	}
+
 	// Return successfully
-	return (count);
+	pthread_mutex_unlock(&files[fd].lock);
+	return (0);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : cart_seek
-// Description  : Seek to specific point in the file
+// Function     : cart_delete
+// Description  : Removes a closed file from the filesystem and frees its
+//                frames
 //
-// Inputs       : fd - filename of the file to write to
-//                loc - offfset of file in relation to beginning of file
+// Inputs       : path - filename of the file to delete
 // Outputs      : 0 if successful, -1 if failure
 
-int32_t cart_seek(int16_t fd, uint32_t loc) {
-	if (checkFileHandle(fd) == -1) {
+int32_t cart_delete(char *path) {
+	int fd, *link;
+
+	pthread_mutex_lock(&tableLock);
+	fd = findFile(path);
+	if (fd == -1) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: no such file [%s].", path);
+		pthread_mutex_unlock(&tableLock);
 		return (-1);
 	}
-	if (loc > files[fd].endPosition) {
-		logMessage(LOG_ERROR_LEVEL, "CART driver failed: offset exceeds file length.");
+	pthread_mutex_lock(&files[fd].lock);
+	if (files[fd].openFlag == 1) {
+		logMessage(LOG_ERROR_LEVEL, "CART driver failed: cannot delete open file [%s].", path);
+		pthread_mutex_unlock(&files[fd].lock);
+		pthread_mutex_unlock(&tableLock);
 		return (-1);
 	}
-	files[fd].currentPosition = loc;
+
+	// Unlink the file from the path index
+	for (link = &pathIndex[hashPath(path)]; *link != fd; link = &files[*link].nextInBucket);
+	*link = files[fd].nextInBucket;
+
+	// Release its frames and metadata, the handle can then be reused.  The
+	// allocator counts every file's runs, so they go under its lock.
+	releaseFrames(fd, 0);
+	pthread_mutex_lock(&allocLock);
+	freeExtents(fd);
+	pthread_mutex_unlock(&allocLock);
+	files[fd].filePath[0] = '\0';
+	files[fd].endPosition = 0;
+	files[fd].currentPosition = 0;
+	files[fd].nextInBucket = -1;
+	pthread_mutex_unlock(&files[fd].lock);
+	freeHandles[numberOfFreeHandles++] = fd;
 
 	// Return successfully
+	pthread_mutex_unlock(&tableLock);
 	return (0);
 }
@@ -13,10 +13,46 @@
 
 // Include files
 #include <stdint.h>
+#include <sys/uio.h>
+#include <cart_controller.h>
 
 // Defines
 #define CART_MAX_TOTAL_FILES 1024 // Maximum number of files ever
 #define CART_MAX_PATH_LENGTH 128 // Maximum length of filename length
+#define CART_MAX_ASYNC_REQUESTS 256 // Most asynchronous requests outstanding
+#define CART_ASYNC_PENDING -2 // Returned by cart_poll while a request is unfinished
+#define CART_BUS_LATENCY_BUCKETS 32 // Bus latency histogram, bucket i counts [2^i, 2^(i+1)) ns
+
+// Type definitions
+typedef struct {
+	uint64_t loads;         // LDCART operations sent to the controller
+	uint64_t loadsAvoided;  // LDCART operations skipped, cartridge already loaded
+	uint64_t reads;         // RDFRME operations sent to the controller
+	uint64_t readsAvoided;  // Read-modify-write reads skipped, frame fully overwritten or new
+	uint64_t writes;        // WRFRME operations sent to the controller
+	uint64_t zeroes;        // BZERO operations sent to the controller
+	uint64_t batches;       // Queued batches of frame transfers submitted
+	uint64_t readAheads;    // Of the reads, frames fetched ahead of a sequential reader
+	uint64_t writesCoalesced; // Small writes merged in a file's write buffer
+	uint64_t elided;        // Frames left all zero and freed as holes instead of written
+	uint64_t deduplicated;  // Frames matching a stored frame and sharing it instead of written
+	uint64_t compressed;    // Frames compressed and packed in with others instead of written whole
+} CartDriverStatistics;
+
+typedef struct {
+	uint64_t count[CART_OP_MAXVAL];         // Bus operations issued, by opcode
+	uint64_t failures[CART_OP_MAXVAL];      // Of those, the ones the controller failed
+	uint64_t nanoseconds[CART_OP_MAXVAL];   // Total time spent in cart_io_bus, by opcode
+	uint64_t latency[CART_OP_MAXVAL][CART_BUS_LATENCY_BUCKETS]; // Latency histograms, by opcode
+	uint64_t cartridgeSwitches;             // Loads that replaced a different cartridge
+	uint64_t bytesRead;                     // Bytes moved from the controller
+	uint64_t bytesWritten;                  // Bytes moved to the controller
+} CartBusStatistics;
+
+typedef void (*CartAsyncCallback)(int32_t request, int32_t result, void *arg);
+	// Called from the driver's worker thread when an asynchronous request
+	// finishes, with the result the synchronous call would have returned.
+	// It may call the driver, but not cart_poweroff or cart_wait.
 
 //
 // Interface functions
@@ -24,6 +60,9 @@
 int32_t cart_poweron(void);
 	// Startup up the CART interface, initialize filesystem
 
+int32_t cart_mount(void);
+	// Startup up the CART interface, mount the filesystem saved at power off
+
 int32_t cart_poweroff(void);
 	// Shut down the CART interface, close all files
 
@@ -40,7 +79,58 @@ int32_t cart_write(int16_t fd, void *buf, int32_t count);
 	// Writes "count" bytes to the file handle "fh" from the buffer  "buf"
 
 int32_t cart_seek(int16_t fd, uint32_t loc);
-	// Seek to specific point in the file
+	// Seek to specific point in the file, past the end leaves a hole once written
+
+int32_t cart_readv(int16_t fd, const struct iovec *iov, int iovcnt);
+	// Reads from the current position into a list of buffers
+
+int32_t cart_writev(int16_t fd, const struct iovec *iov, int iovcnt);
+	// Writes a list of buffers at the current position
+
+int32_t cart_pread(int16_t fd, void *buf, int32_t count, uint32_t loc);
+	// Reads "count" bytes at offset "loc" without moving the file position
+
+int32_t cart_pwrite(int16_t fd, void *buf, int32_t count, uint32_t loc);
+	// Writes "count" bytes at offset "loc" without moving the file position
+
+int32_t cart_read_async(int16_t fd, void *buf, int32_t count, uint32_t loc, CartAsyncCallback callback, void *arg);
+	// Queue a read of "count" bytes at offset "loc", returns a request handle
+
+int32_t cart_write_async(int16_t fd, void *buf, int32_t count, uint32_t loc, CartAsyncCallback callback, void *arg);
+	// Queue a write of "count" bytes at offset "loc", returns a request handle
+
+int32_t cart_poll(int32_t request);
+	// Result of a finished request, CART_ASYNC_PENDING if it is still running
+
+int32_t cart_wait(int32_t request);
+	// Wait for a request to finish and return its result
+
+int32_t cart_truncate(int16_t fd, uint32_t length);
+	// Shorten a file, freeing the frames past its new end
+
+int32_t cart_delete(char *path);
+	// Remove a closed file and free its frames
+
+int32_t cart_flush(int16_t fd);
+	// Write the file's buffered frames back to the controller
+
+int32_t cart_set_write_back(int enable);
+	// Turn write-back buffering of modified frames on or off
+
+int32_t cart_set_sparse(int enable);
+	// Turn freeing frames left all zero, as holes reading back zeros, on or off
+
+int32_t cart_set_dedup(int enable);
+	// Turn sharing one frame between identical frames of data on or off
+
+int32_t cart_set_compress(int enable);
+	// Turn storing frames compressed, several to a frame, on or off
+
+int32_t cart_get_statistics(CartDriverStatistics *stats);
+	// Copies out the bus operation counters since power on
+
+int32_t cart_get_bus_statistics(CartBusStatistics *stats);
+	// Copies out the per-opcode bus counts and latencies since power on
 
 // My defined functions
 uint64_t create_cart_opcode(uint64_t ky1, uint64_t ky2, uint64_t rt1, uint64_t ct1, uint64_t fm1);
@@ -0,0 +1,31 @@
+#ifndef CART_HASH_INCLUDED
+#define CART_HASH_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_hash.h
+//  Description    : This is the string hash shared by the CART driver's path
+//                   index and the simulator's file table.
+//
+//  Author         : John Flanigan
+//  Last Modified  : Oct 16 2026
+//
+
+// Includes
+#include <stdint.h>
+
+///
+// Hash Interfaces
+
+static inline uint32_t cart_hash_string(const char *str) {
+	uint32_t hash = 2166136261u;	// FNV-1a offset basis
+
+	while (*str != '\0') {
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619u;	// FNV-1a prime
+	}
+	return (hash);
+}
+	// Hash a NUL terminated string (32 bit FNV-1a), callers mask the result
+
+#endif
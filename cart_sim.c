@@ -10,6 +10,7 @@
 
 // Include Files
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <errno.h>
@@ -17,43 +18,157 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <pthread.h>
 
 // Project Includes
 #include <cart_driver.h>
 #include <cart_controller.h>
+#include <cart_cache.h>
+#include <cart_hash.h>
+#include <cart_test.h>
 #include <cmpsc311_log.h>
 #include <cmpsc311_util.h>
 
 // Defines
 #define CART_WORKLOAD_DIR "workload"
 #define CART_SIM_MAX_OPEN_FILES 128
-#define CART_ARGUMENTS "huvl:x:"
+#define CART_SIM_FILE_INDEX_SIZE 256 // Filename index buckets, a power of two
+#define CART_SIM_MAX_JOBS 64        // Most replay threads
+#define CART_SIM_BINARY_MAGIC 0x4c575743 // "CWWL", a compiled binary workload
+#define CART_SIM_BINARY_VERSION 1
+#define CART_SIM_VALIDATE_CHUNK (64*1024) // Bytes of each file compared at a time
+#define CART_SIM_BYTES(b) (0x0101010101010101ULL * (uint8_t)(b)) // Byte b in every byte of a word
+#define CART_ARGUMENTS "hutvwsdzmkgl:c:j:b:x:"
 #define USAGE \
-	"USAGE: cart_sim [-h] [-v] [-l <logfile>] [-c <sz>] <workload-file>\n" \
+	"USAGE: cart_sim [-h] [-v] [-w] [-s] [-d] [-z] [-m] [-k] [-g] [-l <logfile>] [-c <sz>]\n" \
+	"                [-j <n>] [-b <binfile>] <workload-file>\n" \
+	"       cart_sim -u | -t [-m] [-c <sz>]\n" \
 	"\n" \
 	"where:\n" \
 	"    -h - help mode (display this message)\n" \
+	"    -u - run the controller unit tests\n" \
+	"    -t - run the driver feature tests, with -m first checking the file\n" \
+	"         the last run of them left\n" \
 	"    -v - verbose output\n" \
+	"    -w - write-back frame caching (flushed on close and shut down)\n" \
+	"    -s - sparse files, frames written all zero are freed as holes\n" \
+	"    -d - deduplicate, identical frames share one cartridge frame\n" \
+	"    -z - compress, frames are stored compressed several to a cartridge frame\n" \
+	"         (with -d, identical compressed frames are shared too)\n" \
+	"    -m - mount the filesystem saved by the last run instead of formatting\n" \
+	"    -k - keep a copy of each file read back from the cartridges in\n" \
+	"         workload/<file>.cmm for debugging\n" \
+	"    -g - validate by comparing digests of the files, not their bytes\n" \
 	"    -l - write log messages to the filename <logfile>\n" \
-	"    -c - set the cart block cache to size <sz> (disabled for assign #2)\n" \
+	"    -c - set the cart frame cache to size <sz> frames (0 disables)\n" \
+	"    -j - replay on up to <n> threads, sharded by file, reporting the\n" \
+	"         throughput at each thread count\n" \
+	"    -b - compile the text workload into the binary workload <binfile>,\n" \
+	"         then exit without simulating\n" \
 	"\n" \
-	"    <workload-file> - file contain the workload to simulate\n" \
+	"    <workload-file> - file contain the workload to simulate, either text\n" \
+	"                      or a binary workload made with -b\n" \
 	"\n" \
 
+// Workload commands, as decoded for replay
+#define CART_SIM_OP_WRITE   0
+#define CART_SIM_OP_WRITEAT 1
+#define CART_SIM_OP_SEEK    2
+#define CART_SIM_OP_READ    3
+#define CART_SIM_OP_MAXVAL  4
+
+// This is a decoded workload operation
+typedef struct {
+	int       command;   // One of the CART_SIM_OP_ commands
+	int       file;      // Index of the file in the file table
+	int32_t   len;       // Number of bytes to read or write
+	int32_t   off;       // Offset to seek to (or write at)
+	char     *data;      // Bytes to write, NULL for seeks and reads
+} CartSimulationOp;
+
 // This is the file table
 typedef struct {
 	char     *filename;  // This is the filename for the test file
 	int16_t   fhandle;   // This is a file handle for the opened file
+	int       next;      // Next entry in the same index bucket, -1 if last
+	int       nops;      // Number of operations on the file
+	int       shard;     // Replay thread the file is assigned to
+	char     *expected;  // What the file should hold, as replayed so far
+	int32_t   length;    // Length of the expected contents
+	int32_t   capacity;  // Bytes allocated for the expected contents
+	int32_t   position;  // Where the next replayed read or write lands
 } CartSimulationTable;
 
+// This is a decoded workload, its files and operations in workload order
+typedef struct {
+	CartSimulationTable ftable[CART_SIM_MAX_OPEN_FILES]; // The files
+	int       findex[CART_SIM_FILE_INDEX_SIZE]; // Filename index into the files
+	int       nfiles;    // Number of files
+	CartSimulationOp *ops; // The operations
+	int       nops;      // Number of operations
+	int       maxops;    // Number of operations allocated
+	uint64_t  bytes;     // Bytes read and written by the operations
+	int32_t   maxread;   // Longest read in the workload
+	char     *image;     // Mapped workload file, the payloads point into it
+	size_t    size;      // Length of the mapping
+} CartSimulationWorkload;
+
+// This is the header of a binary workload, followed by the filenames (each
+// a 16 bit length then the name) and the operations (each a
+// CartSimulationRecord then, for writes, the payload), all in host byte order
+typedef struct {
+	uint32_t  magic;     // CART_SIM_BINARY_MAGIC
+	uint32_t  version;   // CART_SIM_BINARY_VERSION
+	uint32_t  nfiles;    // Number of filenames
+	uint32_t  nops;      // Number of operations
+} CartSimulationHeader;
+
+typedef struct {
+	uint8_t   command;   // One of the CART_SIM_OP_ commands
+	uint8_t   unused;
+	uint16_t  file;      // Index of the file in the filename list
+	int32_t   len;       // Number of bytes to read or write
+	int32_t   off;       // Offset to seek to (or write at)
+} CartSimulationRecord;
+
+// This is a replay thread and the files it was given
+typedef struct {
+	pthread_t thread;    // The thread
+	CartSimulationWorkload *wl; // The workload
+	int       shard;     // Files with this shard are replayed here
+	int       status;    // 0 if every operation succeeded, -1 if not
+} CartSimulationShard;
+
 //
 // Global Data
 int verbose;
+int mount_cart;   // Mount the saved filesystem rather than formatting
+int replay_jobs;  // Replay threads for parallel replay, 0 for serial replay
+int validate_copy;   // Write the files read back in validation to .cmm copies
+int validate_digest; // Validate by digest rather than byte for byte
 
 //
 // Functional Prototypes
 
 int simulate_CART( char *wload );             // control loop of the CART simulation
+int replay_workload( CartSimulationWorkload *wl ); // replay of a decoded workload
+int decode_workload( char *wload, CartSimulationWorkload *wl ); // Decode a text or binary workload
+int parse_text_workload( char *wload, CartSimulationWorkload *wl ); // Decode a text workload
+int parse_number( char **pos, char *end, int32_t *value ); // Parse a number from a workload
+int parse_token( char **pos, char *end, char **token ); // Parse a word from a workload
+void caret_to_newline( char *buf, size_t len ); // Turn '^' into '\n' in place
+int load_binary_workload( char *wload, CartSimulationWorkload *wl ); // Decode a binary workload
+int save_binary_workload( char *bfile, CartSimulationWorkload *wl ); // Write a binary workload
+void free_workload( CartSimulationWorkload *wl ); // Release a decoded workload
+int find_file( CartSimulationWorkload *wl, char *fname ); // Find or add a file
+CartSimulationOp *add_op( CartSimulationWorkload *wl ); // Append an operation
+int replay_op( CartSimulationTable *file, CartSimulationOp *op, char *rbuf ); // Run one operation
+int expect_write( CartSimulationTable *file, char *data, int32_t len ); // Track a replayed write
+int expect_existing( CartSimulationTable *file ); // Start from a mounted file's contents
+void *replay_shard( void *arg );              // Body of a replay thread
+unsigned int hash_filename( char *fname );    // Filename index bucket of a filename
 int validate_file(char *fname, int16_t mfh);  // Validate a file in the filesystem
 
 //
@@ -71,8 +186,10 @@ int validate_file(char *fname, int16_t mfh);  // Validate a file in the filesyst
 int main( int argc, char *argv[] ) {
 
 	// Local variables
-	int ch, verbose = 0, log_initialized = 0, unit_tests = 0;
-	uint32_t cache_size = 1024; // Defaults to 1024 cache lines
+	int ch, verbose = 0, log_initialized = 0, unit_tests = 0, driver_tests = 0, write_back = 0, sparse = 0, dedup = 0, compress = 0, err;
+	char *binary_file = NULL;
+	CartSimulationWorkload *wl;
+	uint32_t cache_size = DEFAULT_CART_FRAME_CACHE_SIZE; // Defaults to 1024 cache lines
 
 	// Process the command line parameters
 	while ((ch = getopt(argc, argv, CART_ARGUMENTS)) != -1) {
@@ -86,10 +203,42 @@ int main( int argc, char *argv[] ) {
 			verbose = 1;
 			break;
 
+		case 'w': // Write-back Flag
+			write_back = 1;
+			break;
+
+		case 's': // Sparse Flag
+			sparse = 1;
+			break;
+
+		case 'd': // Deduplication Flag
+			dedup = 1;
+			break;
+
+		case 'z': // Compression Flag
+			compress = 1;
+			break;
+
+		case 'm': // Mount Flag
+			mount_cart = 1;
+			break;
+
+		case 'k': // Keep validation copies Flag
+			validate_copy = 1;
+			break;
+
+		case 'g': // Digest validation Flag
+			validate_digest = 1;
+			break;
+
 		case 'u': // Unit test Flag
 			unit_tests = 1;
 			break;
 
+		case 't': // Driver test Flag
+			driver_tests = 1;
+			break;
+
 		case 'l': // Set the log filename
 			initializeLogWithFilename( optarg );
 			log_initialized = 1;
@@ -97,7 +246,19 @@ int main( int argc, char *argv[] ) {
 
 		case 'c': // Set cache line size
 			if ( sscanf( optarg, "%u", &cache_size ) != 1 ) {
-			    logMessage( LOG_ERROR_LEVEL, "Bad  cache size [%s]", argv[optind] );
+			    logMessage( LOG_ERROR_LEVEL, "Bad  cache size [%s]", optarg );
+			}
+			break;
+
+		case 'b': // Compile to a binary workload
+			binary_file = optarg;
+			break;
+
+		case 'j': // Set the number of replay threads
+			if ( (sscanf( optarg, "%d", &replay_jobs ) != 1) || (replay_jobs < 1) ||
+					(replay_jobs > CART_SIM_MAX_JOBS) ) {
+			    fprintf( stderr, "Bad thread count [%s], must be 1 to %d.\n", optarg, CART_SIM_MAX_JOBS );
+			    return( -1 );
 			}
 			break;
 
@@ -131,6 +292,16 @@ int main( int argc, char *argv[] ) {
 			logMessage(LOG_ERROR_LEVEL, "Unit tests failed, aborting.\n\n");
 		}
 
+	} else if (driver_tests) {
+
+		// Run the driver feature tests
+		set_cart_cache_size( cache_size );
+		if (cart_driver_test( mount_cart ) == 0) {
+			logMessage(LOG_INFO_LEVEL, "Driver tests completed successfully.\n\n");
+		} else {
+			logMessage(LOG_ERROR_LEVEL, "Driver tests failed, aborting.\n\n");
+		}
+
 	} else {
 
 		// The filename should be the next option
@@ -142,8 +313,29 @@ int main( int argc, char *argv[] ) {
 
 		}
 
-		// Run the simulation
-		if ( simulate_CART(argv[optind]) == 0 ) {
+		// Setup the frame cache
+		set_cart_cache_size( cache_size );
+		cart_set_write_back( write_back );
+		cart_set_sparse( sparse );
+		cart_set_dedup( dedup );
+		cart_set_compress( compress );
+
+		// Compile the workload, or run the simulation
+		if ( binary_file != NULL ) {
+			if ( (wl = calloc(1, sizeof(CartSimulationWorkload))) == NULL ) {
+				logMessage( LOG_ERROR_LEVEL, "CART_SIM : Failed to allocate workload" );
+				return( -1 );
+			}
+			err = decode_workload( argv[optind], wl );
+			if ( err == 0 ) {
+				err = save_binary_workload( binary_file, wl );
+			}
+			free_workload( wl );
+			free( wl );
+			return( err );
+		}
+		err = simulate_CART( argv[optind] );
+		if ( err == 0 ) {
 			logMessage( LOG_INFO_LEVEL, "CART simulation completed successfully.\n\n" );
 		} else {
 			logMessage( LOG_INFO_LEVEL, "CART simulation failed.\n\n" );
@@ -154,11 +346,23 @@ int main( int argc, char *argv[] ) {
 	return( 0 );
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : hash_filename
+// Description  : Compute the filename index bucket of a filename (FNV-1a)
+//
+// Inputs       : fname - the filename
+// Outputs      : the bucket for the filename
+
+unsigned int hash_filename( char *fname ) {
+	return( cart_hash_string(fname) & (CART_SIM_FILE_INDEX_SIZE-1) );
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : simulate_CART
 // Description  : The main control loop for the processing of the CART
-//                simulation.
+//                simulation, decodes the workload then replays it
 //
 // Inputs       : wload - the name of the workload file
 // Outputs      : 0 if successful test, -1 if failure
@@ -166,212 +370,816 @@ int main( int argc, char *argv[] ) {
 int simulate_CART( char *wload ) {
 
 	// Local variables
-	char line[1024], fname[128], command[128], text[1025], *sep, *rbuf;
-	FILE *fhandle = NULL;
-	int32_t err=0, len, off, fields, linecount;
-	CartSimulationTable ftable[CART_SIM_MAX_OPEN_FILES];
-	int idx, i;
-
-	// Setup the file table
-	memset(ftable, 0x0, sizeof(CartSimulationTable)*CART_SIM_MAX_OPEN_FILES);
-
-	// Open the workload file
-	linecount = 0;
-	if ( (fhandle=fopen(wload, "r")) == NULL ) {
+	CartSimulationWorkload *wl;
+	int err;
+
+	if ( (wl = calloc(1, sizeof(CartSimulationWorkload))) == NULL ) {
+		logMessage( LOG_ERROR_LEVEL, "CART_SIM : Failed to allocate workload" );
+		return( -1 );
+	}
+	err = decode_workload( wload, wl );
+	if ( err == 0 ) {
+		err = replay_workload( wl );
+	}
+	free_workload( wl );
+	free( wl );
+	return( err );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : find_file
+// Description  : Finds a file in a decoded workload, adding it to the file
+//                table the first time it is seen
+//
+// Inputs       : wl - the workload
+//                fname - the filename
+// Outputs      : index of the file in the file table
+
+int find_file( CartSimulationWorkload *wl, char *fname ) {
+
+	// Local variables
+	int idx;
+
+	idx = wl->findex[hash_filename(fname)];
+	while ( (idx != -1) && (strcmp(wl->ftable[idx].filename,fname) != 0) ) {
+		idx = wl->ftable[idx].next;
+	}
+	if (idx == -1) {
+		idx = wl->nfiles++;
+		CMPSC_ASSERT1(idx<CART_SIM_MAX_OPEN_FILES, "Too many open files on CART sim [%d]", idx);
+		wl->ftable[idx].filename = strdup(fname);
+		wl->ftable[idx].next = wl->findex[hash_filename(fname)];
+		wl->findex[hash_filename(fname)] = idx;
+	}
+	return( idx );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : add_op
+// Description  : Appends an operation to a decoded workload
+//
+// Inputs       : wl - the workload
+// Outputs      : the new operation, to be filled in
+
+CartSimulationOp *add_op( CartSimulationWorkload *wl ) {
+
+	if (wl->nops == wl->maxops) {
+		wl->maxops = (wl->maxops == 0) ? 1024 : wl->maxops * 2;
+		wl->ops = realloc(wl->ops, sizeof(CartSimulationOp)*wl->maxops);
+		CMPSC_ASSERT0(wl->ops != NULL, "CART_SIM : Failed to allocate workload");
+	}
+	return( &wl->ops[wl->nops++] );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : decode_workload
+// Description  : Decodes a whole workload file, text or binary, into a list
+//                of operations in workload order.  The file is mapped into
+//                memory and the write payloads are used where they lie.
+//
+// Inputs       : wload - the name of the workload file
+//                wl - the workload to fill in, zeroed
+// Outputs      : 0 if successful, -1 if failure
+
+int decode_workload( char *wload, CartSimulationWorkload *wl ) {
+
+	// Local variables
+	struct stat stats;
+	uint32_t magic = 0;
+	int i, fh;
+
+	// Setup the file table and its filename index
+	for (i=0; i<CART_SIM_FILE_INDEX_SIZE; i++) {
+		wl->findex[i] = -1;
+	}
+
+	// Map the workload file, privately so payloads can be decoded in place
+	if ( (fh=open(wload, O_RDONLY)) == -1 ) {
 		logMessage( LOG_ERROR_LEVEL, "Failure opening the workload file [%s], error: %s.\n",
 			wload, strerror(errno) );
 		return( -1 );
 	}
+	if ( fstat(fh, &stats) != 0 ) {
+		logMessage( LOG_ERROR_LEVEL, "Failure reading the workload file [%s], error: %s.\n",
+			wload, strerror(errno) );
+		close( fh );
+		return( -1 );
+	}
+	if ( stats.st_size > 0 ) {
+		wl->image = mmap(NULL, stats.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fh, 0);
+		if ( wl->image == MAP_FAILED ) {
+			logMessage( LOG_ERROR_LEVEL, "Failure mapping the workload file [%s], error: %s.\n",
+				wload, strerror(errno) );
+			wl->image = NULL;
+			close( fh );
+			return( -1 );
+		}
+		wl->size = stats.st_size;
+		madvise(wl->image, wl->size, MADV_SEQUENTIAL);
+	}
+	close( fh );
 
-	// Startup the interface
-	if (cart_poweron() == -1) {
-		logMessage( LOG_ERROR_LEVEL, "CART simulator failed initialization.");
-		fclose( fhandle );
+	// Binary workloads start with their magic number
+	if ( wl->size >= sizeof(magic) ) {
+		memcpy( &magic, wl->image, sizeof(magic) );
+	}
+	if ( magic == CART_SIM_BINARY_MAGIC ) {
+		return( load_binary_workload(wload, wl) );
+	}
+	return( parse_text_workload(wload, wl) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : parse_number
+// Description  : Parses a decimal number, after any blanks, from a workload
+//
+// Inputs       : pos - where to start, moved past the number
+//                end - end of the workload
+//                value - set to the number
+// Outputs      : 0 if successful, -1 if there is no number
+
+int parse_number( char **pos, char *end, int32_t *value ) {
+
+	// Local variables
+	char *p = *pos;
+	int64_t number = 0;
+	int negative = 0;
+
+	while ( (p < end) && ((*p == ' ') || (*p == '\t')) ) {
+		p++;
+	}
+	if ( (p < end) && (*p == '-') ) {
+		negative = 1;
+		p++;
+	}
+	if ( (p == end) || (*p < '0') || (*p > '9') ) {
 		return( -1 );
 	}
-	logMessage(CartSimulatorLLevel, "CART simulator initialization complete.");
+	while ( (p < end) && (*p >= '0') && (*p <= '9') ) {
+		number = number*10 + (*p++ - '0');
+		if ( number > INT32_MAX ) {
+			return( -1 );
+		}
+	}
+	*value = negative ? -number : number;
+	*pos = p;
+	return( 0 );
+}
 
-	// While file not done
-	while (!feof(fhandle)) {
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : parse_token
+// Description  : Finds the next blank separated word, within the line, of a
+//                workload
+//
+// Inputs       : pos - where to start, moved past the word
+//                end - end of the workload
+//                token - set to the start of the word
+// Outputs      : length of the word, 0 if there is none
 
-		// Get the line and bail out on fail
-		if (fgets(line, 1024, fhandle) != NULL) {
+int parse_token( char **pos, char *end, char **token ) {
 
-			// Parse out the string
-			linecount ++;
-			fields = sscanf(line, "%s %s %d %d", fname, command, &len, &off);
-			sep = strchr(line, ':');
-			if ( (fields != 4) || (sep == NULL) ) {
-				logMessage( LOG_ERROR_LEVEL, "CART un-parsable workload string, aborting [%s], line %d",
-						line, linecount );
-				fclose( fhandle );
-				return( -1 );
-			}
+	// Local variables
+	char *p = *pos;
 
-			// Just log the contents
-			logMessage(CartSimulatorLLevel, "File [%s], command [%s], len=%d, offset=%d",
-					fname, command, len, off);
+	while ( (p < end) && ((*p == ' ') || (*p == '\t')) ) {
+		p++;
+	}
+	*token = p;
+	while ( (p < end) && (*p != ' ') && (*p != '\t') && (*p != '\n') ) {
+		p++;
+	}
+	*pos = p;
+	return( p - *token );
+}
 
-			// Now walk the the table looking for the file
-			idx = -1;
-			i = 0;
-			while ( (i < CART_SIM_MAX_OPEN_FILES) && (idx == -1) ) {
-				if ( (ftable[i].filename != NULL) && (strcmp(ftable[i].filename,fname) == 0) ) {
-					idx = i;
-				}
-				i++;
-			}
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : caret_to_newline
+// Description  : Replaces every '^' in a buffer with '\n', eight bytes at a
+//                time.  Each word is compared against '^' in every byte at
+//                once and the matching bytes are flipped to '\n'.
+//
+// Inputs       : buf - the buffer
+//                len - number of bytes
+// Outputs      : none
 
-			// File is not found, open the file
-			if (idx == -1) {
+void caret_to_newline( char *buf, size_t len ) {
 
-				// Log message, find unused index and save filename for later use
-				logMessage(CartSimulatorLLevel, "CART_SIM : Opening file [%s]", fname);
-				idx = 0;
-				while ((ftable[idx].filename != NULL) && (idx < CART_SIM_MAX_OPEN_FILES)) {
-					idx++;
-				}
-				CMPSC_ASSERT1(idx<CART_SIM_MAX_OPEN_FILES, "Too many open files on CART sim [%d]", idx);
-				ftable[idx].filename = strdup(fname);
-
-				// Now perform the open
-				ftable[idx].fhandle = cart_open(ftable[idx].filename);
-				if (ftable[idx].fhandle == -1) {
-					// Failed, error out
-					logMessage(LOG_ERROR_LEVEL, "Open of new file [%s] failed, aborting simulation.", fname);
-					return(-1);
-				}
+	// Local variables
+	uint64_t word, diff, match;
+	size_t i = 0;
+
+	for (; i+8 <= len; i+=8) {
+		memcpy( &word, &buf[i], 8 );
+		diff = word ^ CART_SIM_BYTES('^');
+
+		// High bit of each byte set where the byte of diff is zero
+		match = ~(((diff & CART_SIM_BYTES(0x7f)) + CART_SIM_BYTES(0x7f)) | diff) & CART_SIM_BYTES(0x80);
+		if ( match ) {
+			word ^= ((match >> 7) * 0xff) & CART_SIM_BYTES('^' ^ '\n');
+			memcpy( &buf[i], &word, 8 );
+		}
+	}
+	for (; i<len; i++) {
+		if ( buf[i] == '^' ) {
+			buf[i] = '\n';
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : parse_text_workload
+// Description  : Decodes a mapped text workload in one pass.  Each line is
+//                "<file> <command> <len> <off> :<payload>", the payload
+//                being <len> bytes with newlines written as '^'.  Lines may
+//                be of any length.
+//
+// Inputs       : wload - the name of the workload file
+//                wl - the workload, with the file mapped
+// Outputs      : 0 if successful, -1 if failure
+
+int parse_text_workload( char *wload, CartSimulationWorkload *wl ) {
+
+	// Local variables
+	char fname[128], *pos, *end, *line, *token, *command;
+	int32_t len, off, linecount = 0;
+	int flen, clen;
+	CartSimulationOp *op;
+
+	pos = wl->image;
+	end = wl->image + wl->size;
+	while ( pos < end ) {
+
+		// Skip blank lines
+		linecount ++;
+		line = pos;
+		if ( *pos == '\n' ) {
+			pos++;
+			continue;
+		}
 
+		// Parse out the fields, up to the payload separator
+		flen = parse_token( &pos, end, &token );
+		clen = parse_token( &pos, end, &command );
+		if ( (flen == 0) || (flen >= sizeof(fname)) || (clen == 0) ||
+				(parse_number(&pos, end, &len) != 0) || (parse_number(&pos, end, &off) != 0) ||
+				(len < 0) ) {
+			pos = NULL;
+		} else {
+			while ( (pos < end) && ((*pos == ' ') || (*pos == '\t')) ) {
+				pos++;
 			}
+			pos = ( (pos < end) && (*pos == ':') ) ? pos+1 : NULL;
+		}
+		if ( pos == NULL ) {
+			logMessage( LOG_ERROR_LEVEL, "CART un-parsable workload string, aborting [%.*s], line %d",
+					(int)(((end-line) < 80) ? (end-line) : 80), line, linecount );
+			return( -1 );
+		}
+		memcpy( fname, token, flen );
+		fname[flen] = 0x0;
+
+		op = add_op( wl );
+		op->file = find_file( wl, fname );
+		op->len = len;
+		op->off = off;
+		op->data = NULL;
+		wl->ftable[op->file].nops ++;
+
+		// Decode the command
+		if ( (clen == 7) && (strncmp(command, "WRITEAT", 7) == 0) ) {
+			op->command = CART_SIM_OP_WRITEAT;
+		} else if ( (clen == 5) && (strncmp(command, "WRITE", 5) == 0) ) {
+			op->command = CART_SIM_OP_WRITE;
+		} else if ( (clen == 4) && (strncmp(command, "SEEK", 4) == 0) ) {
+			op->command = CART_SIM_OP_SEEK;
+		} else if ( (clen == 4) && (strncmp(command, "READ", 4) == 0) ) {
+			op->command = CART_SIM_OP_READ;
+		} else {
+			logMessage( LOG_ERROR_LEVEL, "CART_SIM : Failed, unknown command [%.*s], line %d",
+					clen, command, linecount );
+			return( -1 );
+		}
 
-			// Now execute the specific command
-			if (strncmp(command, "WRITEAT", 7) == 0) {
+		// Decode the text to write where it lies
+		if ( (op->command == CART_SIM_OP_WRITE) || (op->command == CART_SIM_OP_WRITEAT) ) {
+			if ( (end-pos < len) || (memchr(pos, '\n', len) != NULL) ) {
+				logMessage( LOG_ERROR_LEVEL, "Workload str shorter than %d, line %d", len, linecount );
+				return( -1 );
+			}
+			caret_to_newline( pos, len );
+			op->data = pos;
+			pos += len;
+		} else if ( (op->command == CART_SIM_OP_READ) && (len > wl->maxread) ) {
+			wl->maxread = len;
+		}
+		if (op->command != CART_SIM_OP_SEEK) {
+			wl->bytes += len;
+		}
 
-				// Log the command executed
-				logMessage(CartSimulatorLLevel, "CART_SIM : Writing %d bytes at position %d from file [%s]", len, off, fname);
+		// Move to the next line
+		if ( (pos = memchr(pos, '\n', end-pos)) == NULL ) {
+			break;
+		}
+		pos++;
+	}
+	return( 0 );
+}
 
-				// First perform the seek
-				if (cart_seek(ftable[idx].fhandle, off)) {
-					// Failed, error out
-					logMessage(LOG_ERROR_LEVEL, "Seek/WriteAt file [%s] to position %d failed, aborting simulation.", fname, off);
-					return(-1);
-				}
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : load_binary_workload
+// Description  : Decodes a mapped binary workload, the write payloads are
+//                used in place
+//
+// Inputs       : wload - the name of the workload file
+//                wl - the workload, with the file mapped
+// Outputs      : 0 if successful, -1 if failure
 
-				// Now see if we need more data to fill, terminate the lines
-				CMPSC_ASSERT1(len<1024, "Simulated workload command text too large [%d]", len);
-				CMPSC_ASSERT2((strlen(sep+1)>=len), "Workload str [%d<%d]", strlen(sep+1), len);
-				strncpy(text, sep+1, len);
-				text[len] = 0x0;
-				for (i=0; i<strlen(text); i++) {
-					if (text[i] == '^') {
-						text[i] = '\n';
-					}
-				}
+int load_binary_workload( char *wload, CartSimulationWorkload *wl ) {
 
-				// Now perform the write
-				if (cart_write(ftable[idx].fhandle, text, len) != len) {
-					// Failed, error out
-					logMessage(LOG_ERROR_LEVEL, "WriteAt of file [%s], length %d failed, aborting simulation.", fname, len);
-					return(-1);
-				}
+	// Local variables
+	CartSimulationHeader header;
+	CartSimulationRecord record;
+	CartSimulationOp *op;
+	char fname[128];
+	size_t pos;
+	uint16_t length;
+	uint32_t i;
+
+	if ( wl->size < sizeof(header) ) {
+		logMessage( LOG_ERROR_LEVEL, "Failure loading binary workload [%s].", wload );
+		return( -1 );
+	}
+	memcpy( &header, wl->image, sizeof(header) );
+	if ( (header.version != CART_SIM_BINARY_VERSION) || (header.nfiles > CART_SIM_MAX_OPEN_FILES) ) {
+		logMessage( LOG_ERROR_LEVEL, "Unsupported binary workload [%s], version %u.", wload, header.version );
+		return( -1 );
+	}
+	pos = sizeof(header);
 
+	// The filenames, in file table order
+	for (i=0; i<header.nfiles; i++) {
+		if ( pos+sizeof(length) > wl->size ) {
+			break;
+		}
+		memcpy( &length, &wl->image[pos], sizeof(length) );
+		pos += sizeof(length);
+		if ( (length >= sizeof(fname)) || (pos+length > wl->size) ) {
+			break;
+		}
+		memcpy( fname, &wl->image[pos], length );
+		fname[length] = 0x0;
+		pos += length;
+		find_file( wl, fname );
+	}
+	if ( (i < header.nfiles) || (wl->nfiles != header.nfiles) ) {
+		logMessage( LOG_ERROR_LEVEL, "Corrupt file list in binary workload [%s].", wload );
+		return( -1 );
+	}
 
-			} else if (strncmp(command, "WRITE", 5) == 0) {
+	// The operations, pointing at their payloads.  The count is checked
+	// against the bytes left before sizing the table from it.
+	if ( header.nops > (wl->size-pos) / sizeof(record) ) {
+		logMessage( LOG_ERROR_LEVEL, "Corrupt operation count %u in binary workload [%s].", header.nops, wload );
+		return( -1 );
+	}
+	wl->maxops = header.nops;
+	if ( (wl->ops = malloc(sizeof(CartSimulationOp)*(header.nops+1))) == NULL ) {
+		logMessage( LOG_ERROR_LEVEL, "CART_SIM : Failed to allocate workload" );
+		return( -1 );
+	}
+	for (i=0; i<header.nops; i++) {
+		if ( pos+sizeof(record) > wl->size ) {
+			break;
+		}
+		memcpy( &record, &wl->image[pos], sizeof(record) );
+		pos += sizeof(record);
+		if ( (record.command >= CART_SIM_OP_MAXVAL) || (record.file >= wl->nfiles) || (record.len < 0) ) {
+			break;
+		}
+		op = add_op( wl );
+		op->command = record.command;
+		op->file = record.file;
+		op->len = record.len;
+		op->off = record.off;
+		op->data = NULL;
+		wl->ftable[op->file].nops ++;
+		if ( (op->command == CART_SIM_OP_WRITE) || (op->command == CART_SIM_OP_WRITEAT) ) {
+			if ( pos+record.len > wl->size ) {
+				break;
+			}
+			op->data = &wl->image[pos];
+			pos += record.len;
+		} else if ( (op->command == CART_SIM_OP_READ) && (op->len > wl->maxread) ) {
+			wl->maxread = op->len;
+		}
+		if (op->command != CART_SIM_OP_SEEK) {
+			wl->bytes += record.len;
+		}
+	}
+	if ( i < header.nops ) {
+		logMessage( LOG_ERROR_LEVEL, "Corrupt operation %u in binary workload [%s].", i, wload );
+		return( -1 );
+	}
+	return( 0 );
+}
 
-				// Now see if we need more data to fill, terminate the lines
-				CMPSC_ASSERT1(len<1024, "Simulated workload command text too large [%d]", len);
-				CMPSC_ASSERT2((strlen(sep+1)>=len), "Workload str [%d<%d]", strlen(sep+1), len);
-				strncpy(text, sep+1, len);
-				text[len] = 0x0;
-				for (i=0; i<strlen(text); i++) {
-					if (text[i] == '^') {
-						text[i] = '\n';
-					}
-				}
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : save_binary_workload
+// Description  : Writes a decoded workload out as a binary workload
+//
+// Inputs       : bfile - the name of the binary workload file
+//                wl - the workload
+// Outputs      : 0 if successful, -1 if failure
 
-				// Log the command executed
-				logMessage(CartSimulatorLLevel, "CART_SIM : Writing %d bytes to file [%s]", len, fname);
+int save_binary_workload( char *bfile, CartSimulationWorkload *wl ) {
 
-				// Now perform the write
-				if (cart_write(ftable[idx].fhandle, text, len) != len) {
-					// Failed, error out
-					logMessage(LOG_ERROR_LEVEL, "Write of file [%s], length %d failed, aborting simulation.", fname, len);
-					return(-1);
-				}
+	// Local variables
+	CartSimulationHeader header;
+	CartSimulationRecord record;
+	CartSimulationOp *op;
+	FILE *fhandle;
+	uint16_t length;
+	int i, err = 0;
+
+	if ( (fhandle=fopen(bfile, "w")) == NULL ) {
+		logMessage( LOG_ERROR_LEVEL, "Failure creating binary workload [%s], error: %s.",
+			bfile, strerror(errno) );
+		return( -1 );
+	}
 
+	// The header, then the filenames
+	header.magic = CART_SIM_BINARY_MAGIC;
+	header.version = CART_SIM_BINARY_VERSION;
+	header.nfiles = wl->nfiles;
+	header.nops = wl->nops;
+	err |= (fwrite(&header, sizeof(header), 1, fhandle) != 1);
+	for (i=0; i<wl->nfiles; i++) {
+		length = strlen(wl->ftable[i].filename);
+		err |= (fwrite(&length, sizeof(length), 1, fhandle) != 1);
+		err |= (fwrite(wl->ftable[i].filename, length, 1, fhandle) != 1);
+	}
 
-			} else if (strncmp(command, "SEEK", 4) == 0) {
+	// The operations, each followed by its decoded payload
+	for (i=0; i<wl->nops; i++) {
+		op = &wl->ops[i];
+		memset( &record, 0x0, sizeof(record) );
+		record.command = op->command;
+		record.file = op->file;
+		record.len = op->len;
+		record.off = op->off;
+		err |= (fwrite(&record, sizeof(record), 1, fhandle) != 1);
+		if ( (op->data != NULL) && (op->len > 0) ) {
+			err |= (fwrite(op->data, op->len, 1, fhandle) != 1);
+		}
+	}
+	if ( (fclose(fhandle) != 0) || err ) {
+		logMessage( LOG_ERROR_LEVEL, "Failure writing binary workload [%s].", bfile );
+		return( -1 );
+	}
+	logMessage( LOG_OUTPUT_LEVEL, "CART simulator compiled %d operations on %d files into [%s].",
+		wl->nops, wl->nfiles, bfile );
+	return( 0 );
+}
 
-				// Log the command executed
-				logMessage(CartSimulatorLLevel, "CART_SIM : Seeking to position %d in file [%s]", off, fname);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : free_workload
+// Description  : Releases the operations and filenames of a decoded
+//                workload, and unmaps the workload file
+//
+// Inputs       : wl - the workload
+// Outputs      : none
 
-				// Now perform the seek
-				if (cart_seek(ftable[idx].fhandle, off) != len) {
-					// Failed, error out
-					logMessage(LOG_ERROR_LEVEL, "Seek in file [%s] to position %d failed, aborting simulation.", fname, off);
-					return(-1);
-				}
+void free_workload( CartSimulationWorkload *wl ) {
 
-			} else if (strncmp(command, "READ", 4) == 0) {
+	// Local variables
+	int i;
 
-				// Log the command executed
-				logMessage(CartSimulatorLLevel, "CART_SIM : Reading %d bytes from file [%s]", len, fname);
+	// The payloads lie in the mapped workload
+	for (i=0; i<wl->nfiles; i++) {
+		free(wl->ftable[i].filename);
+		free(wl->ftable[i].expected);
+	}
+	free(wl->ops);
+	if ( wl->image != NULL ) {
+		munmap(wl->image, wl->size);
+	}
+}
 
-				// Now perform the read
-				rbuf = malloc(len);
-				if (cart_read(ftable[idx].fhandle, rbuf, len) != len) {
-					// Failed, error out
-					logMessage(LOG_ERROR_LEVEL, "Read file [%s] of length %d failed, aborting simulation.", fname, off);
-					return(-1);
-				}
-				free(rbuf);
-				rbuf = NULL;
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : replay_workload
+// Description  : Replays a decoded workload.  Without -j the operations run
+//                once, in order, on this thread.  With -j the operations are
+//                split by file, so each file's operations keep their order
+//                on one thread, and the replay is run at 1, 2, 4, ... up to
+//                the requested number of threads.  The throughput of each
+//                replay is reported.
+//
+// Inputs       : wl - the workload
+// Outputs      : 0 if successful test, -1 if failure
 
-			} else {
+int replay_workload( CartSimulationWorkload *wl ) {
 
-				// Bomb out, don't understand the command
-				CMPSC_ASSERT1(0, "CART_SIM : Failed, unknown command [%s]", command);
+	// Local variables
+	CartSimulationTable *ftable = wl->ftable;
+	CartSimulationShard shards[CART_SIM_MAX_JOBS];
+	int load[CART_SIM_MAX_JOBS], idx, j, jobs, max_jobs, started, busy, err = 0;
+	struct timespec start, stop;
+	double seconds, base = 0.0;
+
+	// Startup the interface and open the files, a mounted file starts out
+	// holding what the last run left in it
+	if ( (mount_cart ? cart_mount() : cart_poweron()) == -1 ) {
+		logMessage( LOG_ERROR_LEVEL, "CART simulator failed initialization.");
+		return( -1 );
+	}
+	for (idx=0; (idx<wl->nfiles) && (err==0); idx++) {
+		if ( (ftable[idx].fhandle = cart_open(ftable[idx].filename)) == -1 ) {
+			logMessage(LOG_ERROR_LEVEL, "Open of new file [%s] failed, aborting simulation.", ftable[idx].filename);
+			err = -1;
+		} else if ( mount_cart && (expect_existing(&ftable[idx]) != 0) ) {
+			err = -1;
+		}
+	}
+	logMessage(CartSimulatorLLevel, "CART simulator decoded %d operations on %d files.", wl->nops, wl->nfiles);
+
+	// Replay at each thread count, doubling up to the one asked for.  Files
+	// are not split, so threads beyond the number of files sit idle.
+	max_jobs = (replay_jobs > 0) ? replay_jobs : 1;
+	if ( (err == 0) && (max_jobs > wl->nfiles) ) {
+		logMessage(LOG_WARNING_LEVEL, "CART replay: %d threads asked for but the workload has %d file(s), "
+			"the rest sit idle.", max_jobs, wl->nfiles);
+	}
+	jobs = 1;
+	while ( (err == 0) && (jobs <= max_jobs) ) {
+
+		// Give each file to the thread with the fewest operations so far
+		memset(load, 0x0, sizeof(load));
+		for (idx=0; (idx<wl->nfiles) && (err==0); idx++) {
+			ftable[idx].shard = 0;
+			for (j=1; j<jobs; j++) {
+				if (load[j] < load[ftable[idx].shard]) {
+					ftable[idx].shard = j;
+				}
+			}
+			load[ftable[idx].shard] += ftable[idx].nops;
 
+			// Every replay starts from the beginning of the file
+			ftable[idx].position = 0;
+			if (cart_seek(ftable[idx].fhandle, 0) != 0) {
+				logMessage(LOG_ERROR_LEVEL, "Seek in file [%s] to position 0 failed, aborting simulation.", ftable[idx].filename);
+				err = -1;
 			}
 		}
+		if ( err ) {
+			break;
+		}
+		for (j=0, busy=0; j<jobs; j++) {
+			busy += (load[j] > 0);
+		}
 
-		// Check for the virtual level failing
+		// Run the threads (or, for a serial replay, this one) and time them
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (started=0; started<jobs; started++) {
+			shards[started].wl = wl;
+			shards[started].shard = started;
+			shards[started].status = 0;
+			if (replay_jobs == 0) {
+				replay_shard(&shards[started]);
+			} else if (pthread_create(&shards[started].thread, NULL, replay_shard, &shards[started]) != 0) {
+				logMessage(LOG_ERROR_LEVEL, "CART simulator failed to start replay thread.");
+				err = -1;
+				break;
+			}
+		}
+		for (j=0; j<started; j++) {
+			if (replay_jobs > 0) {
+				pthread_join(shards[j].thread, NULL);
+			}
+			err |= shards[j].status;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &stop);
 		if ( err ) {
-			logMessage( LOG_ERROR_LEVEL, "CRUS system failed, aborting [%d]", err );
-			fclose( fhandle );
-			return( -1 );
+			break;
 		}
+
+		// Report the throughput, and the speedup over one thread
+		seconds = (stop.tv_sec-start.tv_sec) + (stop.tv_nsec-start.tv_nsec)/1e9;
+		if (jobs == 1) {
+			base = seconds;
+		}
+		logMessage(LOG_OUTPUT_LEVEL, "CART replay: %d threads (%d with files), %d ops, %lu bytes in %.3f s "
+			"(%.0f ops/s, %.2f MB/s, %.2fx)", jobs, busy, wl->nops, wl->bytes, seconds, wl->nops/seconds,
+			wl->bytes/seconds/1e6, base/seconds);
+
+		// Double the thread count, ending on the one asked for
+		jobs = ( (jobs < max_jobs) && (jobs*2 > max_jobs) ) ? max_jobs : jobs*2;
+	}
+	if ( err ) {
+		logMessage( LOG_ERROR_LEVEL, "CART replay failed, aborting." );
 	}
 
-	// Now walk the the table looking for the file
-	for (i=0; i<CART_SIM_MAX_OPEN_FILES; i++) {
-		if ( (ftable[i].filename != NULL) && (strcmp(ftable[i].filename,fname) == 0) ) {
-			if (validate_file(ftable[i].filename, ftable[idx].fhandle) != 0) {
-				logMessage(LOG_ERROR_LEVEL, "CART Validation failed on file [%s].", ftable[i].filename,fname);
-				fclose( fhandle );
-				return(-1);
-			}
-		}		
+	// Validate every file
+	for (idx=0; (idx<wl->nfiles) && (err==0); idx++) {
+		if (validate_file(ftable[idx].filename, ftable[idx].fhandle) != 0) {
+			logMessage(LOG_ERROR_LEVEL, "CART Validation failed on file [%s].", ftable[idx].filename);
+			err = -1;
+		}
 	}
 
-	// Shut down the interface
+	// Shut down the interface, after a failure too
 	if (cart_poweroff() == -1) {
 		logMessage( LOG_ERROR_LEVEL, "CART simulator failed shutdown.");
-		fclose( fhandle );
+		err = -1;
+	}
+	if ( err ) {
 		return( -1 );
 	}
 	logMessage(CartSimulatorLLevel, "CART simulator shutdown complete.");
 	logMessage(LOG_OUTPUT_LEVEL, "CART simulation: all tests successful!!!.");
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : replay_shard
+// Description  : Body of a replay thread, runs the operations on the files
+//                assigned to the thread's shard, in workload order
+//
+// Inputs       : arg - the thread's CartSimulationShard
+// Outputs      : NULL
 
-	// Close the workload file, successfully
-	fclose( fhandle );
+void *replay_shard( void *arg ) {
+
+	// Local variables
+	CartSimulationShard *shard = arg;
+	CartSimulationWorkload *wl = shard->wl;
+	char *rbuf;
+	int i;
+
+	if ( (rbuf = malloc(wl->maxread+1)) == NULL ) {
+		logMessage( LOG_ERROR_LEVEL, "CART_SIM : Failed to allocate read buffer" );
+		shard->status = -1;
+		return( NULL );
+	}
+	for (i=0; i<wl->nops; i++) {
+		if (wl->ftable[wl->ops[i].file].shard != shard->shard) {
+			continue;
+		}
+		if (replay_op(&wl->ftable[wl->ops[i].file], &wl->ops[i], rbuf) != 0) {
+			shard->status = -1;
+			break;
+		}
+	}
+	free( rbuf );
+	return( NULL );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : replay_op
+// Description  : Runs one decoded workload operation against the driver
+//
+// Inputs       : file - the file the operation is on
+//                op - the operation
+//                rbuf - buffer big enough for the workload's longest read
+// Outputs      : 0 if successful, -1 if failure
+
+int replay_op( CartSimulationTable *file, CartSimulationOp *op, char *rbuf ) {
+
+	switch (op->command) {
+	case CART_SIM_OP_WRITEAT: // Seek then write
+		if (cart_seek(file->fhandle, op->off)) {
+			logMessage(LOG_ERROR_LEVEL, "Seek/WriteAt file [%s] to position %d failed, aborting simulation.", file->filename, op->off);
+			return( -1 );
+		}
+		file->position = op->off;
+		// Fall through - then write
+
+	case CART_SIM_OP_WRITE:
+		if (cart_write(file->fhandle, op->data, op->len) != op->len) {
+			logMessage(LOG_ERROR_LEVEL, "Write of file [%s], length %d failed, aborting simulation.", file->filename, op->len);
+			return( -1 );
+		}
+		if (expect_write(file, op->data, op->len) != 0) {
+			return( -1 );
+		}
+		break;
+
+	case CART_SIM_OP_SEEK:
+		if (cart_seek(file->fhandle, op->off) != 0) {
+			logMessage(LOG_ERROR_LEVEL, "Seek in file [%s] to position %d failed, aborting simulation.", file->filename, op->off);
+			return( -1 );
+		}
+		file->position = op->off;
+		break;
+
+	case CART_SIM_OP_READ:
+		if (cart_read(file->fhandle, rbuf, op->len) != op->len) {
+			logMessage(LOG_ERROR_LEVEL, "Read file [%s] of length %d failed, aborting simulation.", file->filename, op->len);
+			return( -1 );
+		}
+
+		// The bytes must be what the replayed writes left there
+		if ( (file->position > file->length-op->len) ||
+				(memcmp(rbuf, &file->expected[file->position], op->len) != 0) ) {
+			logMessage(LOG_ERROR_LEVEL, "Read file [%s] of length %d at position %d returned the wrong "
+				"bytes, aborting simulation.", file->filename, op->len, file->position);
+			return( -1 );
+		}
+		file->position += op->len;
+		break;
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : expect_write
+// Description  : Applies a replayed write to the contents the file is
+//                expected to have, a gap left by writing past the end
+//                reading as zeros
+//
+// Inputs       : file - the file written
+//                data - the bytes written at the file's position
+//                len - the number of bytes
+// Outputs      : 0 if successful, -1 if failure
+
+int expect_write( CartSimulationTable *file, char *data, int32_t len ) {
+
+	// Local variables
+	int32_t end = file->position + len, capacity;
+	char *grown;
+
+	if ( end > file->capacity ) {
+		capacity = (file->capacity == 0) ? CART_FRAME_SIZE : file->capacity;
+		while ( capacity < end ) {
+			capacity *= 2;
+		}
+		if ( (grown = realloc(file->expected, capacity)) == NULL ) {
+			logMessage( LOG_ERROR_LEVEL, "CART_SIM : Failed to allocate expected contents" );
+			return( -1 );
+		}
+		file->expected = grown;
+		file->capacity = capacity;
+	}
+	if ( file->position > file->length ) {
+		memset( &file->expected[file->length], 0x0, file->position-file->length );
+	}
+	memcpy( &file->expected[file->position], data, len );
+	file->position = end;
+	if ( end > file->length ) {
+		file->length = end;
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : expect_existing
+// Description  : Reads a mounted file's contents back as what it is
+//                expected to hold before the replay writes to it
+//
+// Inputs       : file - the file, just opened
+// Outputs      : 0 if successful, -1 if failure
+
+int expect_existing( CartSimulationTable *file ) {
+
+	// Local variables
+	char buf[CART_FRAME_SIZE];
+	int32_t len;
+
+	file->position = 0;
+	while ( (len = cart_read(file->fhandle, buf, CART_FRAME_SIZE)) > 0 ) {
+		if ( expect_write(file, buf, len) != 0 ) {
+			return( -1 );
+		}
+	}
+	if ( (len == -1) || (cart_seek(file->fhandle, 0) != 0) ) {
+		logMessage(LOG_ERROR_LEVEL, "Read of mounted file [%s] failed, aborting simulation.", file->filename);
+		return( -1 );
+	}
+	file->position = 0;
 	return( 0 );
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : validate_file
-// Description  : Vadliate a file in the filesystem
+// Description  : Validate a file in the filesystem against its source,
+//                reading both a chunk at a time so memory use does not grow
+//                with the file.  The chunks are compared directly, or with
+//                -g only hashed and the digests compared at the end.
 //
 // Inputs       : fname - the name of the file to validate
 //                mfh - the memory file handle
@@ -381,8 +1189,12 @@ int validate_file(char *fname, int16_t mfh) {
 
 	// Local variables
 	char filename[256], bkfile[256], *filbuf, *membuf;
+	char fildigest[128], memdigest[128];
+	gcry_md_hd_t filhash = NULL, memhash = NULL;
 	struct stat stats;
-	int idx, fh;
+	off_t done;
+	int32_t len, idx;
+	int fh, bkfh = -1, err = 0;
 
 	// First figure out how big the file is, setup buffer
 	snprintf(filename, 256, "%s/%s", CART_WORKLOAD_DIR, fname);
@@ -391,61 +1203,95 @@ int validate_file(char *fname, int16_t mfh) {
 			"unknown source.", filename);
 		return(-1);		
 	}
-	if ( ((filbuf = malloc(stats.st_size)) == NULL) || ((membuf = malloc(stats.st_size)) == NULL) ) {
+	if ((filbuf = malloc(2*CART_SIM_VALIDATE_CHUNK)) == NULL) {
 		logMessage(LOG_ERROR_LEVEL, "Failure validating file [%s], failed "
 			"buffer allocation.", filename);
 		return(-1);		
 	}
+	membuf = filbuf + CART_SIM_VALIDATE_CHUNK;
 
-	// Now open the file and read the contents
+	// Now open the file, and seek to the beginning of the memory file
 	if ((fh=open(filename, O_RDONLY)) == -1) {
 		logMessage(LOG_ERROR_LEVEL, "Failure validating file [%s], open failed ", filename);
+		free(filbuf);
 		return(-1);		
 	}
-	if ((read(fh, filbuf, stats.st_size)) == -1) {
-		logMessage(LOG_ERROR_LEVEL, "Failure validating file [%s], read failed ", filename);
-		return(-1);
-	}
-	close(fh);
-
-	// Seek to the beginning of the memory file, read the contents
 	if (cart_seek(mfh, 0) == -1) {
 		// Failed, error out
 		logMessage(LOG_ERROR_LEVEL, "Read cart file [%s] see to zero failed.", fname);
-		return(-1);
-	}
-	if (cart_read(mfh, membuf, stats.st_size) != stats.st_size) {
-		// Failed, error out
-		logMessage(LOG_ERROR_LEVEL, "Read cart file [%s] of length %d failed.", fname, stats.st_size);
-		return(-1);
+		err = -1;
 	}
 
-	// Now create a backup of the memory file so people can debug
+	// Create a copy of the memory file so people can debug, if asked
 	snprintf(bkfile, 256, "%s/%s.cmm", CART_WORKLOAD_DIR, fname);
-	if ((fh=open(bkfile, O_RDWR|O_CREAT|O_TRUNC, S_IRWXU)) == -1) {
+	if ( (! err) && validate_copy && ((bkfh=open(bkfile, O_RDWR|O_CREAT|O_TRUNC, S_IRWXU)) == -1) ) {
 		logMessage(LOG_ERROR_LEVEL, "Failure creating backup file [%s], open failed (%s) ", 
 			bkfile, strerror(errno));
-		return(-1);		
+		err = -1;
 	}
-	if ((write(fh, membuf, stats.st_size)) == -1) {
-		logMessage(LOG_ERROR_LEVEL, "Failure writing backup file [%s].", bkfile);
-		return(-1);
+	if ( (! err) && validate_digest ) {
+		gcry_check_version(NULL);
+		if ( (gcry_md_open(&filhash, CMPSC311_HASH_TYPE, 0) != 0) ||
+				(gcry_md_open(&memhash, CMPSC311_HASH_TYPE, 0) != 0) ) {
+			logMessage(LOG_ERROR_LEVEL, "Failure validating file [%s], digest setup failed.", filename);
+			err = -1;
+		}
 	}
-	close(fh);
 
-
-	// Now walk the buffers and compare byte for byte
-	for (idx=0; idx<stats.st_size; idx++) {
-		if (membuf[idx] != filbuf[idx]) {
-			logMessage(LOG_ERROR_LEVEL, "Validation of [%s] failed at offset %d (mem %x/'%c' "
-				"!= fil %x/'%c'", fname, idx, membuf[idx], membuf[idx], filbuf[idx], filbuf[idx]);
-			return(-1);
+	// Now walk the files a chunk at a time, memcmp compares many bytes at once
+	for (done=0; (! err) && (done<stats.st_size); done+=len) {
+		len = (stats.st_size-done < CART_SIM_VALIDATE_CHUNK) ? stats.st_size-done : CART_SIM_VALIDATE_CHUNK;
+		if (read(fh, filbuf, len) != len) {
+			logMessage(LOG_ERROR_LEVEL, "Failure validating file [%s], read failed ", filename);
+			err = -1;
+		} else if (cart_read(mfh, membuf, len) != len) {
+			// Failed, error out
+			logMessage(LOG_ERROR_LEVEL, "Read cart file [%s] of length %d at offset %ld failed.", fname, len, done);
+			err = -1;
+		} else if ( (bkfh != -1) && (write(bkfh, membuf, len) != len) ) {
+			logMessage(LOG_ERROR_LEVEL, "Failure writing backup file [%s].", bkfile);
+			err = -1;
+		} else if ( validate_digest ) {
+			gcry_md_write(filhash, filbuf, len);
+			gcry_md_write(memhash, membuf, len);
+		} else if ( memcmp(membuf, filbuf, len) != 0 ) {
+			for (idx=0; membuf[idx] == filbuf[idx]; idx++);
+			logMessage(LOG_ERROR_LEVEL, "Validation of [%s] failed at offset %ld (mem %x/'%c' "
+				"!= fil %x/'%c'", fname, done+idx, membuf[idx], membuf[idx], filbuf[idx], filbuf[idx]);
+			err = -1;
 		}
 	}
 
-	// Free the buffers, log success, and return successfully
+	// The cartridge file must end where the source does
+	if ( (! err) && ((len = cart_read(mfh, membuf, 1)) != 0) ) {
+		logMessage(LOG_ERROR_LEVEL, "Validation of [%s] failed, cart file is longer than the "
+			"source (%ld bytes).", fname, (long)stats.st_size);
+		err = -1;
+	}
+
+	// Compare the digests of the whole files
+	if ( (! err) && validate_digest && (memcmp(gcry_md_read(filhash, 0), gcry_md_read(memhash, 0),
+			CMPSC311_HASH_LENGTH) != 0) ) {
+		bufToString((char *)gcry_md_read(memhash, 0), CMPSC311_HASH_LENGTH, memdigest, sizeof(memdigest));
+		bufToString((char *)gcry_md_read(filhash, 0), CMPSC311_HASH_LENGTH, fildigest, sizeof(fildigest));
+		logMessage(LOG_ERROR_LEVEL, "Validation of [%s] failed, digest mem %s != fil %s", fname,
+			memdigest, fildigest);
+		err = -1;
+	}
+
+	// Free the buffers and digests, close the files
+	gcry_md_close(filhash);
+	gcry_md_close(memhash);
+	if (bkfh != -1) {
+		close(bkfh);
+	}
+	close(fh);
 	free(filbuf);
-	free(membuf);
+	if ( err ) {
+		return(-1);
+	}
+
+	// Log success, and return successfully
 	logMessage(LOG_OUTPUT_LEVEL, "Validation of [%s], length %d sucessful.", fname, stats.st_size);
 	return( 0 );
 }
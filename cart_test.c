@@ -0,0 +1,1061 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_test.c
+//  Description    : These are the feature tests for the CART driver, run by
+//                   cart_sim -t.  They check the interfaces the workloads do
+//                   not reach, and that the storage options save the bus
+//                   operations they should, through the driver statistics.
+//                   The last test leaves a file behind, which cart_sim -t -m
+//                   checks after mounting the filesystem.
+//
+//  Author         : John Flanigan
+//  Last Modified  : Oct 16 2026
+//
+
+// Include Files
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+// Project Includes
+#include <cart_driver.h>
+#include <cart_controller.h>
+#include <cart_test.h>
+#include <cmpsc311_log.h>
+
+// Defines
+#define CART_TEST_LENGTH (5*CART_FRAME_SIZE-120) // A small file, ending mid frame
+#define CART_TEST_SPARSE_LENGTH (200*1024*1024) // Zeros written to the sparse file
+#define CART_TEST_CHUNK (100*1024*1024)         // Written at a time, more than the cartridges hold
+#define CART_TEST_HOLE (1024*1024)              // Bytes of a hole read back, and left before the end
+#define CART_TEST_BUFFER_FRAMES 64              // Frames the driver buffers writes for, per file
+#define CART_TEST_BUFFER_EVICT 4                // Frames a full buffer commits, oldest first
+#define CART_TEST_BUFFER_OFFSET 100             // Where in each frame the small writes go
+#define CART_TEST_BUFFER_WRITE 10               // Bytes in each small write
+#define CART_TEST_BUFFER_FAR (2*CART_TEST_BUFFER_FRAMES+1) // Frame too far from the rest to buffer with them
+#define CART_TEST_BUFFER_LENGTH (CART_TEST_BUFFER_FAR*CART_FRAME_SIZE+CART_TEST_BUFFER_OFFSET+CART_TEST_BUFFER_WRITE) // File length
+#define CART_TEST_PACK_FRAMES 64                // Frames of the compressed file
+#define CART_TEST_DEDUP_FRAMES 16               // Frames of the deduplicated files
+#define CART_TEST_ASYNC_WRITES 8                // Frames written asynchronously, one request each
+#define CART_TEST_ASYNC_CLOSE_LENGTH (256*1024) // Bytes of each write queued before a close
+#define CART_TEST_MOUNT_FRAMES 40               // Frames of the file left to mount
+#define CART_TEST_MOUNT_LENGTH (CART_TEST_MOUNT_FRAMES*CART_FRAME_SIZE-300) // Its length, ending mid frame
+#define CART_TEST_MOUNT_PATH "cart_test.mount"  // Its name
+
+// This is one feature test
+typedef struct {
+	char     *name;      // The feature tested
+	int     (*run)( void ); // The test, 0 if it passed, -1 if not
+} CartTestCase;
+
+// What an asynchronous request's callback was told
+typedef struct {
+	int32_t   request;   // The request handle
+	int32_t   result;    // Its result
+	int       calls;     // Times the callback was called
+} CartTestAsync;
+
+//
+// Functional Prototypes
+
+int test_truncate( void );                    // Shorten a file and grow it again
+int test_delete( void );                      // Delete a file and reuse its name
+int test_vectored( void );                    // Gather writes and scatter reads
+int test_buffer( void );                      // Merge small writes in the write buffer
+int check_buffer( char *model );              // The checks of test_buffer
+int buffer_write( int16_t fh, char *model, int frame, int seed ); // A small write into a frame
+int test_sparse( void );                      // Write zeros as holes and read them back
+int test_dedup( void );                       // Share identical frames, copy them on write
+int test_compress( void );                    // Pack compressed frames, compact and share them
+int test_async( void );                       // Run reads and writes asynchronously
+void async_done( int32_t request, int32_t result, void *arg ); // Record a finished request
+int check_async_close( char *data );          // The closing checks of test_async
+int test_mount( void );                       // Leave a file for a mount to find
+int test_remount( void );                     // Check the file left before mounting
+void mount_contents( char *buf );             // The contents of the file left to mount
+int check_compress( char *data, char *noise ); // The checks of test_compress
+int test_failed( char *test, char *what );    // Report a failed check
+void fill_pattern( char *buf, int32_t len, int seed ); // Fill a buffer with test bytes
+void fill_noise( char *buf, int32_t len, uint32_t seed ); // Fill a buffer with incompressible bytes
+int check_contents( int16_t fh, uint32_t loc, char *expect, int32_t len ); // Compare file bytes
+
+//
+// Global Data
+
+CartTestCase cart_tests[] = {
+	{ "truncate", test_truncate },
+	{ "delete", test_delete },
+	{ "vectored", test_vectored },
+	{ "buffer", test_buffer },
+	{ "sparse", test_sparse },
+	{ "dedup", test_dedup },
+	{ "compress", test_compress },
+	{ "async", test_async },
+	{ "mount", test_mount },
+};
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_driver_test
+// Description  : Runs each feature test on a freshly formatted filesystem,
+//                the storage options all off between tests.  When mounting,
+//                first checks the file the tests left last time.
+//
+// Inputs       : mount - non-zero to mount the filesystem saved last time
+// Outputs      : 0 if every test passed, -1 if not
+
+int cart_driver_test( int mount ) {
+
+	// Local variables
+	int i, err = 0;
+
+	if ( (mount ? cart_mount() : cart_poweron()) == -1 ) {
+		logMessage( LOG_ERROR_LEVEL, "CART test failed initialization." );
+		return( -1 );
+	}
+	if ( mount ) {
+		if ( test_remount() == 0 ) {
+			logMessage( LOG_OUTPUT_LEVEL, "CART test remount: passed." );
+		} else {
+			logMessage( LOG_ERROR_LEVEL, "CART test remount: failed." );
+			err = -1;
+		}
+	}
+	for (i=0; i<sizeof(cart_tests)/sizeof(CartTestCase); i++) {
+		if ( cart_tests[i].run() == 0 ) {
+			logMessage( LOG_OUTPUT_LEVEL, "CART test %s: passed.", cart_tests[i].name );
+		} else {
+			logMessage( LOG_ERROR_LEVEL, "CART test %s: failed.", cart_tests[i].name );
+			err = -1;
+		}
+		cart_set_sparse( 0 );
+		cart_set_dedup( 0 );
+		cart_set_compress( 0 );
+	}
+
+	// Shut down the interface, after a failure too
+	if ( cart_poweroff() == -1 ) {
+		logMessage( LOG_ERROR_LEVEL, "CART test failed shutdown." );
+		err = -1;
+	}
+	if ( err == 0 ) {
+		logMessage( LOG_OUTPUT_LEVEL, "CART driver tests: all tests successful!!!." );
+	}
+	return( err );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_truncate
+// Description  : Cuts a file mid frame, checks the bytes kept, then grows
+//                it past the old end so the cut bytes must read as zeros
+//
+// Inputs       : none
+// Outputs      : 0 if it passed, -1 if not
+
+int test_truncate( void ) {
+
+	// Local variables
+	char data[CART_TEST_LENGTH], zeros[CART_TEST_LENGTH], buf[CART_TEST_LENGTH];
+	int16_t fh;
+
+	fill_pattern( data, CART_TEST_LENGTH, 1 );
+	memset( zeros, 0x0, CART_TEST_LENGTH );
+	if ( ((fh = cart_open("cart_test.truncate")) == -1) ||
+			(cart_write(fh, data, CART_TEST_LENGTH) != CART_TEST_LENGTH) ) {
+		return( test_failed("truncate", "could not write the file") );
+	}
+
+	// Cut it mid frame, nothing past the new end reads back
+	if ( cart_truncate(fh, 1500) != 0 ) {
+		return( test_failed("truncate", "truncating to 1500 bytes failed") );
+	}
+	if ( check_contents(fh, 0, data, 1500) != 0 ) {
+		return( test_failed("truncate", "the bytes kept changed") );
+	}
+	if ( cart_pread(fh, buf, CART_TEST_LENGTH, 1500) != 0 ) {
+		return( test_failed("truncate", "bytes past the new end still read back") );
+	}
+
+	// Grow it past the old end, the bytes cut must not reappear
+	if ( cart_pwrite(fh, data, 10, 4000) != 10 ) {
+		return( test_failed("truncate", "could not grow the file again") );
+	}
+	if ( (check_contents(fh, 1500, zeros, 2500) != 0) || (check_contents(fh, 4000, data, 10) != 0) ) {
+		return( test_failed("truncate", "the bytes cut reappeared") );
+	}
+
+	// Growing by truncation is refused, emptying the file is not
+	if ( cart_truncate(fh, CART_TEST_LENGTH) != -1 ) {
+		return( test_failed("truncate", "truncating past the end succeeded") );
+	}
+	if ( (cart_truncate(fh, 0) != 0) || (cart_pread(fh, buf, 1, 0) != 0) ) {
+		return( test_failed("truncate", "the emptied file still has bytes") );
+	}
+	if ( (cart_close(fh) != 0) || (cart_delete("cart_test.truncate") != 0) ) {
+		return( test_failed("truncate", "could not remove the file") );
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_delete
+// Description  : Deletes a file, refusing while it is open, then creates a
+//                file of the same name, which must start out empty
+//
+// Inputs       : none
+// Outputs      : 0 if it passed, -1 if not
+
+int test_delete( void ) {
+
+	// Local variables
+	char data[CART_TEST_LENGTH];
+	int16_t fh;
+
+	fill_pattern( data, CART_TEST_LENGTH, 2 );
+	if ( ((fh = cart_open("cart_test.delete")) == -1) ||
+			(cart_write(fh, data, CART_TEST_LENGTH) != CART_TEST_LENGTH) ) {
+		return( test_failed("delete", "could not write the file") );
+	}
+	if ( cart_delete("cart_test.delete") != -1 ) {
+		return( test_failed("delete", "an open file was deleted") );
+	}
+	if ( (cart_close(fh) != 0) || (cart_delete("cart_test.delete") != 0) ) {
+		return( test_failed("delete", "deleting the closed file failed") );
+	}
+	if ( cart_delete("cart_test.delete") != -1 ) {
+		return( test_failed("delete", "the file was deleted twice") );
+	}
+
+	// The name is free again, for a new empty file
+	if ( (fh = cart_open("cart_test.delete")) == -1 ) {
+		return( test_failed("delete", "could not reuse the name") );
+	}
+	if ( cart_read(fh, data, CART_TEST_LENGTH) != 0 ) {
+		return( test_failed("delete", "the new file has the old one's bytes") );
+	}
+	if ( (cart_close(fh) != 0) || (cart_delete("cart_test.delete") != 0) ) {
+		return( test_failed("delete", "could not remove the new file") );
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_vectored
+// Description  : Writes a file from a list of buffers that split inside
+//                frames and include empty ones, then reads it back into a
+//                list split differently.  A list longer than a transfer can
+//                report must be refused without touching the file.
+//
+// Inputs       : none
+// Outputs      : 0 if it passed, -1 if not
+
+int test_vectored( void ) {
+
+	// Local variables
+	char data[CART_TEST_LENGTH], buf[CART_TEST_LENGTH];
+	struct iovec iov[5];
+	int16_t fh;
+
+	fill_pattern( data, CART_TEST_LENGTH, 3 );
+	if ( (fh = cart_open("cart_test.vectored")) == -1 ) {
+		return( test_failed("vectored", "could not open the file") );
+	}
+
+	// Gather from buffers ending mid frame, with empty ones between
+	iov[0].iov_base = data;
+	iov[0].iov_len = 700;
+	iov[1].iov_base = &data[700];
+	iov[1].iov_len = 0;
+	iov[2].iov_base = &data[700];
+	iov[2].iov_len = 1000;
+	iov[3].iov_base = &data[1700];
+	iov[3].iov_len = 0;
+	iov[4].iov_base = &data[1700];
+	iov[4].iov_len = CART_TEST_LENGTH-1700;
+	if ( cart_writev(fh, iov, 5) != CART_TEST_LENGTH ) {
+		return( test_failed("vectored", "the gathered write was short") );
+	}
+	if ( cart_read(fh, buf, 1) != 0 ) {
+		return( test_failed("vectored", "the write did not move the position to the end") );
+	}
+	if ( check_contents(fh, 0, data, CART_TEST_LENGTH) != 0 ) {
+		return( test_failed("vectored", "the gathered bytes did not read back") );
+	}
+
+	// Scatter into buffers split elsewhere
+	memset( buf, 0x0, CART_TEST_LENGTH );
+	iov[0].iov_base = buf;
+	iov[0].iov_len = 1;
+	iov[1].iov_base = &buf[1];
+	iov[1].iov_len = 0;
+	iov[2].iov_base = &buf[1];
+	iov[2].iov_len = 2*CART_FRAME_SIZE;
+	iov[3].iov_base = &buf[1+2*CART_FRAME_SIZE];
+	iov[3].iov_len = CART_TEST_LENGTH-1-2*CART_FRAME_SIZE;
+	if ( (cart_seek(fh, 0) != 0) || (cart_readv(fh, iov, 4) != CART_TEST_LENGTH) ||
+			(memcmp(buf, data, CART_TEST_LENGTH) != 0) ) {
+		return( test_failed("vectored", "the scattered read did not match") );
+	}
+
+	// A list totalling more than INT32_MAX bytes is refused, whatever its parts
+	iov[0].iov_base = data;
+	iov[0].iov_len = INT32_MAX/2+1;
+	iov[1].iov_base = data;
+	iov[1].iov_len = INT32_MAX/2+1;
+	if ( (cart_seek(fh, 0) != 0) || (cart_writev(fh, iov, 2) != -1) || (cart_readv(fh, iov, 2) != -1) ) {
+		return( test_failed("vectored", "a list too long was not refused") );
+	}
+	if ( (cart_pread(fh, buf, 1, CART_TEST_LENGTH) != 0) || (check_contents(fh, 0, data, CART_TEST_LENGTH) != 0) ) {
+		return( test_failed("vectored", "a refused list changed the file") );
+	}
+	if ( (cart_close(fh) != 0) || (cart_delete("cart_test.vectored") != 0) ) {
+		return( test_failed("vectored", "could not remove the file") );
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_buffer
+// Description  : Makes small writes to a frame at a time, which must wait in
+//                the file's write buffer until it is full, a write lands far
+//                from them, or the file is flushed or closed.  Reads must
+//                see the bytes still buffered.
+//
+// Inputs       : none
+// Outputs      : 0 if it passed, -1 if not
+
+int test_buffer( void ) {
+
+	// Local variables
+	char *model;
+	int err;
+
+	if ( (model = calloc(1, CART_TEST_BUFFER_LENGTH)) == NULL ) {
+		return( test_failed("buffer", "could not allocate the file contents") );
+	}
+	err = check_buffer( model );
+	free( model );
+	return( err );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : check_buffer
+// Description  : The checks of test_buffer, counting the frames written as
+//                each one should commit buffered frames
+//
+// Inputs       : model - the file contents expected, CART_TEST_BUFFER_LENGTH
+//                        zeroed bytes to start
+// Outputs      : 0 if it passed, -1 if not
+
+int check_buffer( char *model ) {
+
+	// Local variables
+	CartDriverStatistics before, after;
+	int16_t fh;
+	int i;
+
+	if ( (fh = cart_open("cart_test.buffer")) == -1 ) {
+		return( test_failed("buffer", "could not open the file") );
+	}
+
+	// A small write is only buffered, and reads back from there
+	cart_get_statistics( &before );
+	if ( buffer_write(fh, model, 0, 0) != 0 ) {
+		return( test_failed("buffer", "could not write the first frame") );
+	}
+	if ( check_contents(fh, 0, model, CART_TEST_BUFFER_OFFSET+CART_TEST_BUFFER_WRITE) != 0 ) {
+		return( test_failed("buffer", "a read did not see the buffered bytes") );
+	}
+	cart_get_statistics( &after );
+	if ( (after.writes != before.writes) || (after.writesCoalesced-before.writesCoalesced != 1) ) {
+		return( test_failed("buffer", "the small write was not buffered") );
+	}
+
+	// Fill the buffer, then write the first frames again so they are newest
+	for (i=1; i<CART_TEST_BUFFER_FRAMES; i++) {
+		if ( buffer_write(fh, model, i, i) != 0 ) {
+			return( test_failed("buffer", "could not fill the buffer") );
+		}
+	}
+	for (i=0; i<CART_TEST_BUFFER_EVICT; i++) {
+		if ( buffer_write(fh, model, i, CART_TEST_BUFFER_FRAMES+i) != 0 ) {
+			return( test_failed("buffer", "could not write the first frames again") );
+		}
+	}
+	cart_get_statistics( &after );
+	if ( after.writes != before.writes ) {
+		return( test_failed("buffer", "frames were written before the buffer was full") );
+	}
+
+	// Another frame commits the oldest, which a write then brings back.  Had
+	// the first frames gone instead, the last one back would commit nothing.
+	before = after;
+	if ( buffer_write(fh, model, CART_TEST_BUFFER_FRAMES, 1) != 0 ) {
+		return( test_failed("buffer", "could not write past the full buffer") );
+	}
+	cart_get_statistics( &after );
+	if ( after.writes-before.writes != CART_TEST_BUFFER_EVICT ) {
+		return( test_failed("buffer", "a full buffer did not commit its oldest frames") );
+	}
+	before = after;
+	for (i=CART_TEST_BUFFER_EVICT; i<2*CART_TEST_BUFFER_EVICT; i++) {
+		if ( buffer_write(fh, model, i, 2) != 0 ) {
+			return( test_failed("buffer", "could not write a committed frame again") );
+		}
+	}
+	cart_get_statistics( &after );
+	if ( after.writes-before.writes != CART_TEST_BUFFER_EVICT ) {
+		return( test_failed("buffer", "the frames committed were not the oldest") );
+	}
+
+	// A write far from the buffered frames commits them all
+	before = after;
+	if ( buffer_write(fh, model, CART_TEST_BUFFER_FAR, 3) != 0 ) {
+		return( test_failed("buffer", "could not write far from the buffer") );
+	}
+	cart_get_statistics( &after );
+	if ( after.writes-before.writes != CART_TEST_BUFFER_FRAMES-CART_TEST_BUFFER_EVICT+1 ) {
+		return( test_failed("buffer", "a far write did not commit the buffer") );
+	}
+
+	// Flushing and closing commit what is left
+	before = after;
+	if ( cart_flush(fh) != 0 ) {
+		return( test_failed("buffer", "could not flush the file") );
+	}
+	cart_get_statistics( &after );
+	if ( after.writes-before.writes != 1 ) {
+		return( test_failed("buffer", "a flush did not commit the buffer") );
+	}
+	before = after;
+	if ( (buffer_write(fh, model, CART_TEST_BUFFER_FAR, 4) != 0) || (cart_close(fh) != 0) ) {
+		return( test_failed("buffer", "could not write and close the file") );
+	}
+	cart_get_statistics( &after );
+	if ( after.writes-before.writes != 1 ) {
+		return( test_failed("buffer", "a close did not commit the buffer") );
+	}
+
+	// Every write landed
+	if ( ((fh = cart_open("cart_test.buffer")) == -1) ||
+			(check_contents(fh, 0, model, CART_TEST_BUFFER_LENGTH) != 0) ||
+			(cart_pread(fh, model, 1, CART_TEST_BUFFER_LENGTH) != 0) ) {
+		return( test_failed("buffer", "the file did not read back") );
+	}
+	if ( (cart_close(fh) != 0) || (cart_delete("cart_test.buffer") != 0) ) {
+		return( test_failed("buffer", "could not remove the file") );
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : buffer_write
+// Description  : Writes CART_TEST_BUFFER_WRITE new bytes into a frame of the
+//                file, and into the contents expected of it
+//
+// Inputs       : fh - the file handle
+//                model - the file contents expected
+//                frame - the frame of the file to write into
+//                seed - picks the bytes
+// Outputs      : 0 if successful, -1 if not
+
+int buffer_write( int16_t fh, char *model, int frame, int seed ) {
+
+	// Local variables
+	int32_t loc = frame*CART_FRAME_SIZE+CART_TEST_BUFFER_OFFSET;
+
+	fill_pattern( &model[loc], CART_TEST_BUFFER_WRITE, seed );
+	if ( cart_pwrite(fh, &model[loc], CART_TEST_BUFFER_WRITE, loc) != CART_TEST_BUFFER_WRITE ) {
+		return( -1 );
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_sparse
+// Description  : With sparse files on, writes 200 MB of zeros, each write
+//                more than the cartridges hold, which must cost no frames.
+//                Reads them back without the bus, then writes past a
+//                further hole.
+//
+// Inputs       : none
+// Outputs      : 0 if it passed, -1 if not
+
+int test_sparse( void ) {
+
+	// Local variables
+	CartDriverStatistics before, after;
+	char *zeros, end[] = "end";
+	int32_t off;
+	int16_t fh;
+
+	if ( (zeros = calloc(1, CART_TEST_CHUNK)) == NULL ) {
+		return( test_failed("sparse", "could not allocate the zeros") );
+	}
+	cart_set_sparse( 1 );
+	if ( (fh = cart_open("cart_test.sparse")) == -1 ) {
+		free( zeros );
+		return( test_failed("sparse", "could not open the file") );
+	}
+
+	// Every frame of zeros is elided, none written
+	cart_get_statistics( &before );
+	for (off=0; off<CART_TEST_SPARSE_LENGTH; off+=CART_TEST_CHUNK) {
+		if ( cart_write(fh, zeros, CART_TEST_CHUNK) != CART_TEST_CHUNK ) {
+			free( zeros );
+			return( test_failed("sparse", "could not write the zeros") );
+		}
+	}
+	cart_get_statistics( &after );
+	if ( (after.writes != before.writes) ||
+			(after.elided-before.elided != CART_TEST_SPARSE_LENGTH/CART_FRAME_SIZE) ) {
+		free( zeros );
+		return( test_failed("sparse", "writing the zeros cost frames") );
+	}
+
+	// The holes read back as zeros without touching the bus
+	before = after;
+	if ( check_contents(fh, CART_TEST_SPARSE_LENGTH/2, zeros, CART_TEST_HOLE) != 0 ) {
+		free( zeros );
+		return( test_failed("sparse", "the zeros did not read back") );
+	}
+	cart_get_statistics( &after );
+	if ( after.reads != before.reads ) {
+		free( zeros );
+		return( test_failed("sparse", "reading the holes read frames") );
+	}
+	free( zeros );
+
+	// A write past the end leaves a hole before it and stores one frame
+	before = after;
+	if ( (cart_pwrite(fh, end, sizeof(end), CART_TEST_SPARSE_LENGTH+CART_TEST_HOLE) != sizeof(end)) ||
+			(cart_flush(fh) != 0) ) {
+		return( test_failed("sparse", "could not write past the end") );
+	}
+	cart_get_statistics( &after );
+	if ( after.writes-before.writes != 1 ) {
+		return( test_failed("sparse", "writing past the end stored more than one frame") );
+	}
+	if ( check_contents(fh, CART_TEST_SPARSE_LENGTH+CART_TEST_HOLE, end, sizeof(end)) != 0 ) {
+		return( test_failed("sparse", "the byte past the hole did not read back") );
+	}
+	if ( (cart_close(fh) != 0) || (cart_delete("cart_test.sparse") != 0) ) {
+		return( test_failed("sparse", "could not remove the file") );
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_dedup
+// Description  : With deduplication on, writes a copy of a file, which must
+//                share every frame of the original instead of writing one.
+//                Changing the copy then writes a frame of its own and leaves
+//                the original alone.
+//
+// Inputs       : none
+// Outputs      : 0 if it passed, -1 if not
+
+int test_dedup( void ) {
+
+	// Local variables
+	CartDriverStatistics before, after;
+	char data[CART_TEST_DEDUP_FRAMES*CART_FRAME_SIZE], changed[] = "changed";
+	int32_t len = CART_TEST_DEDUP_FRAMES*CART_FRAME_SIZE;
+	int16_t fh, copy;
+
+	fill_pattern( data, len, 5 );
+	cart_set_dedup( 1 );
+	if ( ((fh = cart_open("cart_test.dedup")) == -1) || (cart_write(fh, data, len) != len) ||
+			(cart_flush(fh) != 0) ) {
+		return( test_failed("dedup", "could not write the file") );
+	}
+
+	// The copy writes nothing, every frame is shared
+	cart_get_statistics( &before );
+	if ( ((copy = cart_open("cart_test.dedup.copy")) == -1) || (cart_write(copy, data, len) != len) ||
+			(cart_flush(copy) != 0) ) {
+		return( test_failed("dedup", "could not write the copy") );
+	}
+	cart_get_statistics( &after );
+	if ( (after.writes != before.writes) ||
+			(after.deduplicated-before.deduplicated != CART_TEST_DEDUP_FRAMES) ) {
+		return( test_failed("dedup", "the copy did not share the frames") );
+	}
+	if ( check_contents(copy, 0, data, len) != 0 ) {
+		return( test_failed("dedup", "the copy did not read back") );
+	}
+
+	// Changing a shared frame copies it, the original keeps its bytes
+	before = after;
+	if ( (cart_pwrite(copy, changed, sizeof(changed), 2*CART_FRAME_SIZE+100) != sizeof(changed)) ||
+			(cart_flush(copy) != 0) ) {
+		return( test_failed("dedup", "could not change the copy") );
+	}
+	cart_get_statistics( &after );
+	if ( after.writes-before.writes != 1 ) {
+		return( test_failed("dedup", "changing a shared frame did not write one frame") );
+	}
+	if ( check_contents(fh, 0, data, len) != 0 ) {
+		return( test_failed("dedup", "changing the copy changed the original") );
+	}
+	memcpy( &data[2*CART_FRAME_SIZE+100], changed, sizeof(changed) );
+	if ( check_contents(copy, 0, data, len) != 0 ) {
+		return( test_failed("dedup", "the change to the copy did not read back") );
+	}
+	if ( (cart_close(copy) != 0) || (cart_close(fh) != 0) ||
+			(cart_delete("cart_test.dedup.copy") != 0) || (cart_delete("cart_test.dedup") != 0) ) {
+		return( test_failed("dedup", "could not remove the files") );
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_compress
+// Description  : With compression on, writes frames that pack several to a
+//                cartridge frame, then overwrites most of them with bytes
+//                that do not compress, so the rest are packed again when
+//                flushed.  With deduplication on too, a copy of the file
+//                shares the compressed frames instead of writing them.
+//
+// Inputs       : none
+// Outputs      : 0 if it passed, -1 if not
+
+int test_compress( void ) {
+
+	// Local variables
+	char *data, *noise;
+	int err;
+
+	data = malloc( CART_TEST_PACK_FRAMES*CART_FRAME_SIZE );
+	noise = malloc( CART_FRAME_SIZE );
+	if ( (data == NULL) || (noise == NULL) ) {
+		err = test_failed( "compress", "could not allocate the frames" );
+	} else {
+		err = check_compress( data, noise );
+	}
+	free( data );
+	free( noise );
+	return( err );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : check_compress
+// Description  : Runs the checks of test_compress in the buffers given
+//
+// Inputs       : data - CART_TEST_PACK_FRAMES frames, the file's contents
+//                noise - a frame, incompressible bytes
+// Outputs      : 0 if it passed, -1 if not
+
+int check_compress( char *data, char *noise ) {
+
+	// Local variables
+	CartDriverStatistics before, after;
+	int32_t len = CART_TEST_PACK_FRAMES*CART_FRAME_SIZE, i;
+	int16_t fh;
+
+	fill_pattern( data, len, 3 );
+	cart_set_compress( 1 );
+
+	// Every frame is stored compressed, taking fewer writes than frames
+	cart_get_statistics( &before );
+	if ( ((fh = cart_open("cart_test.compress")) == -1) || (cart_write(fh, data, len) != len) ||
+			(cart_flush(fh) != 0) ) {
+		return( test_failed("compress", "could not write the file") );
+	}
+	cart_get_statistics( &after );
+	if ( (after.compressed-before.compressed != CART_TEST_PACK_FRAMES) ||
+			(after.writes-before.writes >= CART_TEST_PACK_FRAMES/2) ) {
+		return( test_failed("compress", "the frames were not packed") );
+	}
+	if ( check_contents(fh, 0, data, len) != 0 ) {
+		return( test_failed("compress", "the compressed frames did not read back") );
+	}
+
+	// Overwrite three frames in four, the rest are packed again on flush
+	for (i=0; i<CART_TEST_PACK_FRAMES; i++) {
+		if ( i%4 != 0 ) {
+			fill_noise( noise, CART_FRAME_SIZE, i );
+			memcpy( &data[i*CART_FRAME_SIZE], noise, CART_FRAME_SIZE );
+			if ( cart_pwrite(fh, noise, CART_FRAME_SIZE, i*CART_FRAME_SIZE) != CART_FRAME_SIZE ) {
+				return( test_failed("compress", "could not overwrite the frames") );
+			}
+		}
+	}
+	cart_get_statistics( &before );
+	if ( cart_flush(fh) != 0 ) {
+		return( test_failed("compress", "could not flush the overwritten file") );
+	}
+	cart_get_statistics( &after );
+	if ( after.compressed == before.compressed ) {
+		return( test_failed("compress", "the frames left were not packed again") );
+	}
+	if ( (check_contents(fh, 0, data, len) != 0) || (cart_close(fh) != 0) ) {
+		return( test_failed("compress", "the file changed when packed again") );
+	}
+
+	// With deduplication, a copy shares the compressed frames
+	fill_pattern( data, len, 4 );
+	cart_set_dedup( 1 );
+	if ( ((fh = cart_open("cart_test.compress")) == -1) || (cart_write(fh, data, len) != len) ||
+			(cart_close(fh) != 0) ) {
+		return( test_failed("compress", "could not write the file again") );
+	}
+	cart_get_statistics( &before );
+	if ( ((fh = cart_open("cart_test.compress.copy")) == -1) || (cart_write(fh, data, len) != len) ||
+			(cart_flush(fh) != 0) ) {
+		return( test_failed("compress", "could not write the copy") );
+	}
+	cart_get_statistics( &after );
+	if ( (after.deduplicated-before.deduplicated < CART_TEST_PACK_FRAMES/2) ||
+			(after.writes-before.writes >= after.compressed-before.compressed) ) {
+		return( test_failed("compress", "the copy did not share the compressed frames") );
+	}
+	if ( (check_contents(fh, 0, data, len) != 0) || (cart_close(fh) != 0) ||
+			(cart_delete("cart_test.compress.copy") != 0) || (cart_delete("cart_test.compress") != 0) ) {
+		return( test_failed("compress", "could not remove the files") );
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_async
+// Description  : Queues a write per frame and waits for each, then reads the
+//                file back once through a callback and once by polling.
+//                Requests run in order, so waiting for a later one finishes
+//                the earlier.  A handle already collected must be refused,
+//                and requests queued on a file closed since must not run.
+//
+// Inputs       : none
+// Outputs      : 0 if it passed, -1 if not
+
+int test_async( void ) {
+
+	// Local variables
+	char data[CART_TEST_ASYNC_WRITES*CART_FRAME_SIZE], buf[CART_TEST_ASYNC_WRITES*CART_FRAME_SIZE], *closing;
+	int32_t len = CART_TEST_ASYNC_WRITES*CART_FRAME_SIZE, requests[CART_TEST_ASYNC_WRITES], request, reading, result;
+	CartTestAsync done = { -1, -1, 0 };
+	int16_t fh;
+	int i, err;
+
+	fill_pattern( data, len, 6 );
+	if ( (fh = cart_open("cart_test.async")) == -1 ) {
+		return( test_failed("async", "could not open the file") );
+	}
+
+	// Queue every write before waiting for any
+	for (i=0; i<CART_TEST_ASYNC_WRITES; i++) {
+		requests[i] = cart_write_async( fh, &data[i*CART_FRAME_SIZE], CART_FRAME_SIZE, i*CART_FRAME_SIZE, NULL, NULL );
+		if ( requests[i] == -1 ) {
+			return( test_failed("async", "could not queue a write") );
+		}
+	}
+	for (i=0; i<CART_TEST_ASYNC_WRITES; i++) {
+		if ( cart_wait(requests[i]) != CART_FRAME_SIZE ) {
+			return( test_failed("async", "a write did not finish whole") );
+		}
+	}
+
+	// A read with a callback, finished once the write queued after it is
+	memset( buf, 0x0, len );
+	if ( ((reading = cart_read_async(fh, buf, len, 0, async_done, &done)) == -1) ||
+			((request = cart_write_async(fh, data, 1, 0, NULL, NULL)) == -1) || (cart_wait(request) != 1) ) {
+		return( test_failed("async", "could not read with a callback") );
+	}
+	if ( (done.calls != 1) || (done.request != reading) || (done.result != len) || (memcmp(buf, data, len) != 0) ) {
+		return( test_failed("async", "the callback did not get the file") );
+	}
+
+	// A read polled until it finishes
+	memset( buf, 0x0, len );
+	if ( (request = cart_read_async(fh, buf, len, 0, NULL, NULL)) == -1 ) {
+		return( test_failed("async", "could not queue a polled read") );
+	}
+	while ( (result = cart_poll(request)) == CART_ASYNC_PENDING );
+	if ( (result != len) || (memcmp(buf, data, len) != 0) ) {
+		return( test_failed("async", "the polled read did not get the file") );
+	}
+
+	// Its handle was collected, and is no longer valid
+	if ( (cart_poll(request) != -1) || (cart_wait(request) != -1) || (cart_wait(requests[0]) != -1) ) {
+		return( test_failed("async", "a collected handle was accepted") );
+	}
+	if ( (cart_close(fh) != 0) || (cart_delete("cart_test.async") != 0) ) {
+		return( test_failed("async", "could not remove the file") );
+	}
+
+	// Writes still queued when their file is closed
+	if ( (closing = malloc(CART_TEST_ASYNC_CLOSE_LENGTH)) == NULL ) {
+		return( test_failed("async", "could not allocate the writes") );
+	}
+	err = check_async_close( closing );
+	free( closing );
+	return( err );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : async_done
+// Description  : Callback of an asynchronous request, records its result
+//
+// Inputs       : request - the request handle
+//                result - its result
+//                arg - the CartTestAsync to record it in
+// Outputs      : none
+
+void async_done( int32_t request, int32_t result, void *arg ) {
+
+	// Local variables
+	CartTestAsync *done = (CartTestAsync *)arg;
+
+	done->request = request;
+	done->result = result;
+	done->calls++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : check_async_close
+// Description  : Queues large writes to a file, then closes and deletes it
+//                and creates another, which gets its handle.  Each write
+//                must have run before the close or failed, and none may
+//                reach the new file.
+//
+// Inputs       : data - CART_TEST_ASYNC_CLOSE_LENGTH bytes to write
+// Outputs      : 0 if it passed, -1 if not
+
+int check_async_close( char *data ) {
+
+	// Local variables
+	int32_t requests[CART_TEST_ASYNC_WRITES], result;
+	char buf[1];
+	int16_t fh, reused = -1;
+	int i, err = 0;
+
+	fill_pattern( data, CART_TEST_ASYNC_CLOSE_LENGTH, 8 );
+	if ( (fh = cart_open("cart_test.async.closed")) == -1 ) {
+		return( test_failed("async", "could not open the file to close") );
+	}
+	for (i=0; i<CART_TEST_ASYNC_WRITES; i++) {
+		requests[i] = cart_write_async( fh, data, CART_TEST_ASYNC_CLOSE_LENGTH, i*CART_TEST_ASYNC_CLOSE_LENGTH, NULL, NULL );
+		if ( requests[i] == -1 ) {
+			err = test_failed( "async", "could not queue a write to the file to close" );
+		}
+	}
+	if ( (cart_close(fh) != 0) || (cart_delete("cart_test.async.closed") != 0) ||
+			((reused = cart_open("cart_test.async.reused")) == -1) ) {
+		err = test_failed( "async", "could not replace the closed file" );
+	}
+
+	// Wait for every write, the buffer must outlive them
+	for (i=0; i<CART_TEST_ASYNC_WRITES; i++) {
+		if ( requests[i] != -1 ) {
+			result = cart_wait( requests[i] );
+			if ( (result != CART_TEST_ASYNC_CLOSE_LENGTH) && (result != -1) ) {
+				err = test_failed( "async", "a write queued before the close was cut short" );
+			}
+		}
+	}
+	if ( reused != -1 ) {
+		if ( cart_pread(reused, buf, 1, 0) != 0 ) {
+			err = test_failed( "async", "writes queued before the close reached the new file" );
+		}
+		if ( (cart_close(reused) != 0) || (cart_delete("cart_test.async.reused") != 0) ) {
+			err = test_failed( "async", "could not remove the new file" );
+		}
+	}
+	return( err );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_mount
+// Description  : Leaves a file for cart_sim -t -m to check once mounted.  Its
+//                first half is compressed, the rest stored whole, and it is
+//                cut mid frame, so every kind of extent is saved.
+//
+// Inputs       : none
+// Outputs      : 0 if it passed, -1 if not
+
+int test_mount( void ) {
+
+	// Local variables
+	char data[CART_TEST_MOUNT_FRAMES*CART_FRAME_SIZE];
+	int32_t half = CART_TEST_MOUNT_FRAMES/2*CART_FRAME_SIZE;
+	int16_t fh;
+
+	mount_contents( data );
+	if ( (fh = cart_open(CART_TEST_MOUNT_PATH)) == -1 ) {
+		return( test_failed("mount", "could not open the file") );
+	}
+	cart_set_compress( 1 );
+	if ( (cart_write(fh, data, half) != half) || (cart_flush(fh) != 0) ) {
+		return( test_failed("mount", "could not write the compressed half") );
+	}
+	cart_set_compress( 0 );
+	if ( (cart_write(fh, &data[half], sizeof(data)-half) != sizeof(data)-half) ||
+			(cart_truncate(fh, CART_TEST_MOUNT_LENGTH) != 0) ) {
+		return( test_failed("mount", "could not write the rest") );
+	}
+	if ( (check_contents(fh, 0, data, CART_TEST_MOUNT_LENGTH) != 0) || (cart_close(fh) != 0) ) {
+		return( test_failed("mount", "the file did not read back") );
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_remount
+// Description  : Checks the file test_mount left, once mounted, and that it
+//                can still be written without disturbing the rest
+//
+// Inputs       : none
+// Outputs      : 0 if it passed, -1 if not
+
+int test_remount( void ) {
+
+	// Local variables
+	char data[CART_TEST_MOUNT_FRAMES*CART_FRAME_SIZE], buf[1], end[] = "end";
+	int16_t fh;
+
+	mount_contents( data );
+	if ( (fh = cart_open(CART_TEST_MOUNT_PATH)) == -1 ) {
+		return( test_failed("remount", "could not open the file") );
+	}
+	if ( (check_contents(fh, 0, data, CART_TEST_MOUNT_LENGTH) != 0) ||
+			(cart_pread(fh, buf, 1, CART_TEST_MOUNT_LENGTH) != 0) ) {
+		return( test_failed("remount", "the mounted file does not hold what was left") );
+	}
+
+	// Frames written now must not land on the mounted file's
+	if ( (cart_pwrite(fh, end, sizeof(end), CART_TEST_MOUNT_LENGTH) != sizeof(end)) ||
+			(cart_pwrite(fh, data, CART_FRAME_SIZE, 3*CART_FRAME_SIZE) != CART_FRAME_SIZE) ) {
+		return( test_failed("remount", "could not write the mounted file") );
+	}
+	memcpy( &data[3*CART_FRAME_SIZE], data, CART_FRAME_SIZE );
+	if ( (check_contents(fh, 0, data, CART_TEST_MOUNT_LENGTH) != 0) ||
+			(check_contents(fh, CART_TEST_MOUNT_LENGTH, end, sizeof(end)) != 0) ) {
+		return( test_failed("remount", "writing the mounted file disturbed it") );
+	}
+	if ( (cart_close(fh) != 0) || (cart_delete(CART_TEST_MOUNT_PATH) != 0) ) {
+		return( test_failed("remount", "could not remove the file") );
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : mount_contents
+// Description  : Fills in the contents of the file left to mount, the
+//                first half compressible and the rest not
+//
+// Inputs       : buf - CART_TEST_MOUNT_FRAMES frames to fill
+// Outputs      : none
+
+void mount_contents( char *buf ) {
+
+	// Local variables
+	int32_t half = CART_TEST_MOUNT_FRAMES/2*CART_FRAME_SIZE;
+
+	fill_pattern( buf, half, 7 );
+	fill_noise( &buf[half], CART_TEST_MOUNT_FRAMES*CART_FRAME_SIZE-half, 7 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : test_failed
+// Description  : Reports a check a test failed
+//
+// Inputs       : test - the test
+//                what - the check that failed
+// Outputs      : -1, for the test to return
+
+int test_failed( char *test, char *what ) {
+	logMessage( LOG_ERROR_LEVEL, "CART test %s: %s.", test, what );
+	return( -1 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fill_pattern
+// Description  : Fills a buffer with bytes that differ from frame to frame
+//                and from seed to seed
+//
+// Inputs       : buf - the buffer
+//                len - its length
+//                seed - picks the bytes
+// Outputs      : none
+
+void fill_pattern( char *buf, int32_t len, int seed ) {
+
+	// Local variables
+	int32_t i;
+
+	for (i=0; i<len; i++) {
+		buf[i] = (char)((i*31 + i/CART_FRAME_SIZE*7 + seed*101) % 251 + 1);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : fill_noise
+// Description  : Fills a buffer with pseudo-random bytes, which do not
+//                compress
+//
+// Inputs       : buf - the buffer
+//                len - its length
+//                seed - picks the bytes
+// Outputs      : none
+
+void fill_noise( char *buf, int32_t len, uint32_t seed ) {
+
+	// Local variables
+	int32_t i;
+
+	for (i=0; i<len; i++) {
+		seed = seed*1103515245 + 12345;
+		buf[i] = (char)(seed >> 16);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : check_contents
+// Description  : Reads bytes of a file, without moving its position, and
+//                compares them to what they should be
+//
+// Inputs       : fh - the file handle
+//                loc - the offset to read at
+//                expect - the bytes it should hold
+//                len - the number of bytes
+// Outputs      : 0 if they match, -1 if not
+
+int check_contents( int16_t fh, uint32_t loc, char *expect, int32_t len ) {
+
+	// Local variables
+	char *buf;
+	int err = 0;
+
+	if ( (buf = malloc(len)) == NULL ) {
+		return( -1 );
+	}
+	if ( (cart_pread(fh, buf, len, loc) != len) || (memcmp(buf, expect, len) != 0) ) {
+		err = -1;
+	}
+	free( buf );
+	return( err );
+}
@@ -0,0 +1,21 @@
+#ifndef CART_TEST_INCLUDED
+#define CART_TEST_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_test.h
+//  Description    : This is the interface for the feature tests of the CART
+//                   memory system driver.
+//
+//  Author         : John Flanigan
+//  Last Modified  : Oct 16 2026
+//
+
+///
+// Test Interfaces
+
+int cart_driver_test( int mount );
+	// Run the driver feature tests on a freshly formatted filesystem, or
+	// on the one saved by the last run, checking the file it left
+
+#endif